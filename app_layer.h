@@ -0,0 +1,421 @@
+#pragma once
+
+#include <strings.h>
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "packet.h"
+#include "string_pool.h"
+
+#define APP_NAME_SIZE 256    // Buffer for one name, DNS names are at most 253 characters
+#define APP_DNS_JUMPS 16     // Compression pointers followed per DNS name
+#define APP_TOP_HOSTS 100
+
+/*
+Application layer parsers for the names on-call engineers look for: DNS
+queries and answers, HTTP/1.x request lines and Host headers and the server
+name of TLS ClientHellos.
+
+They read only the captured bytes of a single packet, check every length
+against them and never allocate, names are written lowercased into a caller
+buffer of APP_NAME_SIZE bytes. A ClientHello or request split over several
+segments is only parsed as far as its first segment goes.
+*/
+
+// Bytes kept in names, anything outside printable ASCII becomes '?'
+inline char appNameChar(unsigned char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return (char)(c - 'A' + 'a');
+    return c > ' ' && c < 127 ? (char)c : '?';
+}
+
+/*
+Decodes the DNS name at offset of message as dotted text into name, following compression
+pointers. Returns false if it is malformed or cut off, next is then set past the name as it
+appears at offset. The root name gives an empty string.
+*/
+inline bool parseDnsName(const unsigned char *message, size_t size, size_t offset, char *name, size_t &length,
+                         size_t &next)
+{
+    length = 0;
+    next = 0;
+    int jumps = 0;
+    while (true)
+    {
+        if (offset >= size)
+            return false;
+        unsigned int label = message[offset];
+        if (label == 0)
+        {
+            if (!jumps)
+                next = offset + 1;
+            break;
+        }
+        if ((label & 0xc0) == 0xc0)
+        {
+            if (offset + 1 >= size || ++jumps > APP_DNS_JUMPS)
+                return false;
+            if (jumps == 1)
+                next = offset + 2;
+            offset = ((label & 0x3f) << 8) | message[offset + 1];
+            continue;
+        }
+        if (label & 0xc0)
+            return false; // Extended label types are not used
+        if (offset + 1 + label > size || length + label + 1 >= APP_NAME_SIZE)
+            return false;
+        if (length)
+            name[length++] = '.';
+        for (unsigned int i = 0; i < label; i++)
+            name[length++] = appNameChar(message[offset + 1 + i]);
+        offset += 1 + label;
+    }
+    name[length] = '\0';
+    return true;
+}
+
+// Query name of a standard DNS query or response, response tells which of the two it is
+inline bool parseDns(const unsigned char *message, size_t size, bool &response, char *name, size_t &length)
+{
+    if (size < 12)
+        return false;
+    unsigned int flags = dissectRead16(message + 2);
+    if (dissectRead16(message + 4) == 0 || ((flags >> 11) & 0xf) != 0)
+        return false; // No question, or not a standard query
+    response = (flags & 0x8000) != 0;
+    size_t next;
+    return parseDnsName(message, size, 12, name, length, next);
+}
+
+// Resource record of a DNS answer section, the data is at dataOffset of the message
+struct DnsRecord
+{
+    char name[APP_NAME_SIZE];
+    size_t nameLength;
+    unsigned short type; // 1 A, 5 CNAME, 28 AAAA...
+    unsigned int ttl;
+    size_t dataOffset;
+    unsigned short dataLength;
+};
+
+/*
+Calls visitor(record) for each answer of a DNS message whose records were captured, stopping at
+the first one that is cut off. Returns the number of answers the header announces.
+*/
+template <typename Visitor>
+inline unsigned int parseDnsAnswers(const unsigned char *message, size_t size, Visitor visitor)
+{
+    if (size < 12)
+        return 0;
+    unsigned int questions = dissectRead16(message + 4);
+    unsigned int answers = dissectRead16(message + 6);
+    size_t offset = 12;
+    DnsRecord record;
+    for (unsigned int i = 0; i < questions; i++)
+    {
+        if (!parseDnsName(message, size, offset, record.name, record.nameLength, offset) || offset + 4 > size)
+            return answers;
+        offset += 4; // Type and class
+    }
+    for (unsigned int i = 0; i < answers; i++)
+    {
+        if (!parseDnsName(message, size, offset, record.name, record.nameLength, offset) || offset + 10 > size)
+            return answers;
+        record.type = dissectRead16(message + offset);
+        record.ttl = (unsigned int)dissectRead16(message + offset + 4) << 16 | dissectRead16(message + offset + 6);
+        record.dataLength = dissectRead16(message + offset + 8);
+        record.dataOffset = offset + 10;
+        if (record.dataOffset + record.dataLength > size)
+            return answers;
+        visitor(record);
+        offset = record.dataOffset + record.dataLength;
+    }
+    return answers;
+}
+
+// Spans of an HTTP request line and its Host header, pointing into the packet
+struct HttpRequest
+{
+    const unsigned char *method;
+    size_t methodLength;
+    const unsigned char *target;
+    size_t targetLength;
+    const unsigned char *host; // NULL when no Host header was captured
+    size_t hostLength;
+    unsigned char minorVersion; // HTTP/1.x
+};
+
+// Request line and Host header of an HTTP/1.x request starting at data
+inline bool parseHttpRequest(const unsigned char *data, size_t size, HttpRequest &request)
+{
+    static const char *const methods[] = {"GET", "POST", "PUT", "HEAD", "DELETE", "OPTIONS", "PATCH", "CONNECT", "TRACE"};
+    size_t position = 0;
+    while (position < size && position < 8 && data[position] >= 'A' && data[position] <= 'Z')
+        position++;
+    if (position == size || data[position] != ' ')
+        return false;
+    bool known = false;
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]) && !known; i++)
+        known = strlen(methods[i]) == position && memcmp(methods[i], data, position) == 0;
+    if (!known)
+        return false;
+    request.method = data;
+    request.methodLength = position;
+
+    request.target = data + ++position;
+    while (position < size && data[position] != ' ' && data[position] != '\r' && data[position] != '\n')
+        position++;
+    request.targetLength = data + position - request.target;
+    if (request.targetLength == 0 || position + 10 > size || memcmp(data + position, " HTTP/1.", 8) != 0)
+        return false;
+    request.minorVersion = data[position + 8] - '0';
+    position += 9;
+    if (data[position] == '\r')
+        position++;
+    if (position >= size || data[position] != '\n')
+        return false;
+
+    // Header lines up to the empty one, or as far as they were captured, a cut off Host line is ignored
+    request.host = NULL;
+    request.hostLength = 0;
+    while (++position < size && data[position] != '\r' && data[position] != '\n')
+    {
+        size_t start = position;
+        while (position < size && data[position] != '\n')
+            position++;
+        size_t end = position;
+        if (end > start && data[end - 1] == '\r')
+            end--;
+        if (position < size && end - start > 5 && strncasecmp((const char *)data + start, "host:", 5) == 0)
+        {
+            start += 5;
+            while (start < end && (data[start] == ' ' || data[start] == '\t'))
+                start++;
+            while (end > start && (data[end - 1] == ' ' || data[end - 1] == '\t'))
+                end--;
+            request.host = data + start;
+            request.hostLength = end - start;
+            break;
+        }
+    }
+    return true;
+}
+
+// Copies a Host header or CONNECT target into name without its port
+inline size_t appHostName(const unsigned char *host, size_t size, char *name)
+{
+    size_t length = 0;
+    bool bracketed = size > 0 && host[0] == '['; // IPv6 literal, its colons are not a port
+    for (size_t i = 0; i < size && length + 1 < APP_NAME_SIZE; i++)
+    {
+        if (host[i] == ':' && !bracketed)
+            break;
+        name[length++] = appNameChar(host[i]);
+        if (host[i] == ']')
+            bracketed = false;
+    }
+    name[length] = '\0';
+    return length;
+}
+
+/*
+Server name of a TLS ClientHello starting at data, the first record of a TLS connection. Returns
+false if data is not a ClientHello, length is 0 when it has no server name or the extension lies
+past the captured bytes.
+*/
+inline bool parseTlsClientHello(const unsigned char *data, size_t size, char *name, size_t &length)
+{
+    length = 0;
+    if (size < 9 || data[0] != 22 || data[1] != 3 || data[5] != 1)
+        return false; // Handshake record, ClientHello message
+    size_t end = 5 + dissectRead16(data + 3);
+    if (end > size)
+        end = size;
+
+    size_t offset = 9 + 2 + 32; // Handshake header, client version and random
+    if (offset >= end)
+        return true;
+    offset += 1 + data[offset]; // Session id
+    if (offset + 2 > end)
+        return true;
+    offset += 2 + dissectRead16(data + offset); // Cipher suites
+    if (offset >= end)
+        return true;
+    offset += 1 + data[offset]; // Compression methods
+    if (offset + 2 > end)
+        return true;
+    size_t extensionsEnd = offset + 2 + dissectRead16(data + offset);
+    if (extensionsEnd < end)
+        end = extensionsEnd;
+    offset += 2;
+
+    while (offset + 4 <= end)
+    {
+        unsigned int type = dissectRead16(data + offset);
+        size_t extensionEnd = offset + 4 + dissectRead16(data + offset + 2);
+        if (type == 0 && extensionEnd <= end)
+        {
+            // server_name: list length, then entries of a type and a length prefixed name
+            for (offset += 6; offset + 3 <= extensionEnd; offset += 3 + dissectRead16(data + offset + 1))
+            {
+                size_t nameLength = dissectRead16(data + offset + 1);
+                if (data[offset] != 0 || offset + 3 + nameLength > extensionEnd)
+                    continue;
+                for (size_t i = 0; i < nameLength && length + 1 < APP_NAME_SIZE; i++)
+                    name[length++] = appNameChar(data[offset + 3 + i]);
+                break;
+            }
+            break;
+        }
+        offset = extensionEnd;
+    }
+    name[length] = '\0';
+    return true;
+}
+
+inline bool appIsDnsPort(unsigned int port)
+{
+    return port == 53 || port == 5353; // DNS and multicast DNS
+}
+
+/*
+Finds a DNS message, HTTP request or TLS ClientHello in the payload of a packet dissect()
+already decoded, and interns the name it carries into names. Runs on the capture workers
+right after dissect(), so it still sees the payload a snaplen cuts off afterwards.
+*/
+inline void dissectApplication(Packet &packet, StringPool &names)
+{
+    PacketInfo &info = packet.info;
+    info.application = ApplicationLayer::None;
+    info.name = STRING_POOL_NONE;
+    // A transport header cut short leaves payloadOffset on the header itself
+    if ((info.transport != TransportLayer::Tcp && info.transport != TransportLayer::Udp) ||
+        info.transportOffset + 4u > (unsigned int)packet.size || info.payloadOffset <= info.transportOffset ||
+        info.payloadOffset >= (unsigned int)packet.size)
+        return;
+
+    const unsigned char *payload = packet.data + info.payloadOffset;
+    size_t size = packet.size - info.payloadOffset;
+    unsigned int sourcePort = dissectRead16(packet.data + info.transportOffset);
+    unsigned int destinationPort = dissectRead16(packet.data + info.transportOffset + 2);
+    char name[APP_NAME_SIZE];
+    size_t length = 0;
+    if (appIsDnsPort(sourcePort) || appIsDnsPort(destinationPort))
+    {
+        bool response;
+        if (info.transport == TransportLayer::Tcp)
+        {
+            if (size < 2)
+                return;
+            payload += 2; // Messages over TCP are prefixed with their length
+            size -= 2;
+        }
+        if (!parseDns(payload, size, response, name, length))
+            return;
+        info.application = response ? ApplicationLayer::DnsResponse : ApplicationLayer::DnsQuery;
+    }
+    else if (info.transport == TransportLayer::Tcp)
+    {
+        HttpRequest request;
+        if (parseHttpRequest(payload, size, request))
+        {
+            info.application = ApplicationLayer::HttpRequest;
+            if (request.host)
+                length = appHostName(request.host, request.hostLength, name);
+            else if (request.methodLength == 7) // CONNECT names the host in its target
+                length = appHostName(request.target, request.targetLength, name);
+        }
+        else if (parseTlsClientHello(payload, size, name, length))
+            info.application = ApplicationLayer::TlsClientHello;
+        else
+            return;
+    }
+    else
+        return;
+    info.name = names.intern(name, length);
+}
+
+inline const char *applicationName(ApplicationLayer application)
+{
+    switch (application)
+    {
+    case ApplicationLayer::DnsQuery:
+        return "DNS query";
+    case ApplicationLayer::DnsResponse:
+        return "DNS response";
+    case ApplicationLayer::HttpRequest:
+        return "HTTP request";
+    case ApplicationLayer::TlsClientHello:
+        return "TLS ClientHello";
+    default:
+        return NULL;
+    }
+}
+
+// How often one name was seen, per kind of message
+struct HostStats
+{
+    unsigned int name; // Id in the StringPool
+    unsigned long long lookups;    // DNS queries and responses
+    unsigned long long requests;   // HTTP requests
+    unsigned long long handshakes; // TLS ClientHellos
+    unsigned long long firstSeen;  // Packet timestamps in nanoseconds
+    unsigned long long lastSeen;
+
+    unsigned long long total() const { return lookups + requests + handshakes; }
+};
+
+/*
+Per name totals of the packets dissectApplication() named, for the Top hosts
+view. Updated from the GUI thread as packets are drained, like FlowTable, and
+keyed by the interned id so counting never touches the name itself.
+*/
+class HostTable
+{
+private:
+    std::unordered_map<unsigned int, HostStats> hosts;
+
+public:
+    void update(const Packet &packet)
+    {
+        const PacketInfo &info = packet.info;
+        if (info.name == STRING_POOL_NONE)
+            return;
+
+        HostStats &stats = hosts[info.name];
+        if (stats.name == STRING_POOL_NONE)
+        {
+            stats.name = info.name;
+            stats.firstSeen = packet.timestamp;
+        }
+        stats.lastSeen = std::max(stats.lastSeen, packet.timestamp);
+        if (info.application == ApplicationLayer::HttpRequest)
+            stats.requests++;
+        else if (info.application == ApplicationLayer::TlsClientHello)
+            stats.handshakes++;
+        else
+            stats.lookups++;
+    }
+
+    // The count names seen most often, most first
+    void topHosts(std::vector<HostStats> &top, size_t count = APP_TOP_HOSTS) const
+    {
+        top.clear();
+        top.reserve(hosts.size());
+        for (auto it = hosts.begin(); it != hosts.end(); ++it)
+            top.push_back(it->second);
+        if (count > top.size())
+            count = top.size();
+        std::partial_sort(top.begin(), top.begin() + count, top.end(),
+                          [](const HostStats &a, const HostStats &b) { return a.total() > b.total(); });
+        top.resize(count);
+    }
+
+    size_t size() const { return hosts.size(); }
+
+    void clear() { hosts.clear(); }
+};
@@ -0,0 +1,827 @@
+#include "app_layer.h"
+#include "display_filter.h"
+#include "flow_table.h"
+#include "pcap_reader.h"
+#include "pcap_writer.h"
+#include "pipeline.h"
+#include "sniff.h"
+
+#include <getopt.h>
+#include <sys/mman.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+/*
+Benchmark suite for the capture pipeline.
+
+Every stage is driven by the same deterministic set of synthetic frames, a
+seeded mix of TCP, UDP, VLAN tagged, IPv6 and ARP traffic over a few thousand
+flows, or by the packets of a capture file given with -r. The offline stages
+(dissector, queue, store, spill, flow table, pipelines, writer, reader) need no privileges.
+The capture stages replay the frames through a PACKET_TX_RING socket on the
+capture interface, loopback by default or one end of a veth pair, and need
+root. Each result reports packets per second, nanoseconds per packet, drops
+and the peak RSS during the stage, as a table or as JSON lines with -j so
+builds can be compared.
+*/
+
+#define BENCH_FRAMES 100000 // Synthetic frames generated by default
+#define BENCH_FLOWS 4096
+#define BENCH_TX_FRAME_SIZE 2048
+#define BENCH_TX_BLOCK_SIZE (1 << 20)
+#define BENCH_TX_BLOCK_COUNT 16
+
+struct BenchResult
+{
+    std::string stage;
+    std::string backend;
+    unsigned int workers;
+    unsigned long long packets;
+    unsigned long long sent; // Frames injected by the generator, capture stages only
+    double seconds;
+    unsigned long long drops;
+    unsigned long long peakRss; // KiB
+};
+
+static bool jsonOutput = false;
+
+// Starts a new peak RSS measurement, only the kernel can reset the high water mark
+static void resetPeakRss()
+{
+    std::ofstream clear("/proc/self/clear_refs");
+    clear << "5";
+}
+
+static unsigned long long peakRss()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return strtoull(line.c_str() + 6, NULL, 10);
+    return 0;
+}
+
+static void report(const BenchResult &result)
+{
+    double pps = result.seconds > 0 ? result.packets / result.seconds : 0.0;
+    double nsPerPacket = result.packets ? result.seconds * 1e9 / result.packets : 0.0;
+    if (jsonOutput)
+    {
+        printf("{\"stage\":\"%s\",\"backend\":\"%s\",\"workers\":%u,\"packets\":%llu,\"sent\":%llu,"
+               "\"seconds\":%.6f,\"pps\":%.0f,\"nsPerPacket\":%.1f,\"drops\":%llu,\"peakRssKiB\":%llu}\n",
+               result.stage.c_str(), result.backend.c_str(), result.workers, result.packets, result.sent,
+               result.seconds, pps, nsPerPacket, result.drops, result.peakRss);
+    }
+    else
+    {
+        std::string name = result.backend.empty() ? result.stage : result.stage + " " + result.backend;
+        printf("%-18s %7u %12llu %12llu %12.0f %9.1f %10llu %10.1f\n", name.c_str(), result.workers,
+               result.packets, result.sent, pps, nsPerPacket, result.drops, result.peakRss / 1024.0);
+    }
+    fflush(stdout);
+}
+
+static double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Small linear congruential generator, the frame set only depends on the seed
+class BenchRandom
+{
+private:
+    unsigned long long state;
+
+public:
+    explicit BenchRandom(unsigned long long seed) : state(seed * 2862933555777941757ULL + 3037000493ULL) {}
+
+    unsigned int next(unsigned int bound)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (unsigned int)((state >> 33) % bound);
+    }
+};
+
+static void put16(unsigned char *data, unsigned int value)
+{
+    data[0] = (unsigned char)(value >> 8);
+    data[1] = (unsigned char)value;
+}
+
+/*
+Builds one synthetic frame into frame and returns its size. Addresses are in
+the 198.18.0.0/15 benchmarking range and checksums are left at zero, so the
+kernel discards injected frames instead of answering them.
+*/
+static unsigned int makeFrame(BenchRandom &random, unsigned char *frame)
+{
+    unsigned int flow = random.next(BENCH_FLOWS);
+    unsigned int kind = random.next(100);
+    memset(frame, 0, 64);
+    const unsigned char dest[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+    unsigned char source[6] = {0x02, 0x00, 0x00, 0x00, (unsigned char)(flow >> 8), (unsigned char)flow};
+    memcpy(frame, dest, 6);
+    memcpy(frame + 6, source, 6);
+    unsigned int offset = 12;
+
+    if (kind < 2) // ARP request
+    {
+        put16(frame + 12, 0x0806);
+        put16(frame + 14, 1);
+        put16(frame + 16, 0x0800);
+        frame[18] = 6;
+        frame[19] = 4;
+        put16(frame + 20, 1);
+        return 60;
+    }
+    if (kind < 7) // 802.1Q tagged
+    {
+        put16(frame + offset, 0x8100);
+        put16(frame + offset + 2, 100 + flow % 8);
+        offset += 4;
+    }
+
+    bool tcp = kind >= 32 || (kind >= 7 && kind < 15);
+    unsigned int payload;
+    if (tcp)
+    {
+        unsigned int size = random.next(10);
+        payload = size < 4 ? 0 : size < 6 ? 512 : 1448; // Mostly acknowledgements and full segments
+    }
+    else
+        payload = 32 + random.next(480);
+    unsigned int transportLength = tcp ? 20 : 8;
+
+    if (kind >= 7 && kind < 15) // IPv6
+    {
+        put16(frame + offset, 0x86dd);
+        offset += 2;
+        unsigned char *ip = frame + offset;
+        memset(ip, 0, 40);
+        ip[0] = 0x60;
+        put16(ip + 4, transportLength + payload);
+        ip[6] = tcp ? 6 : 17;
+        ip[7] = 64;
+        ip[8] = 0x20;
+        ip[9] = 0x01;
+        ip[10] = 0x0d;
+        ip[11] = 0xb8;
+        memcpy(ip + 24, ip + 8, 4);
+        ip[22] = (unsigned char)(flow >> 8);
+        ip[23] = (unsigned char)flow;
+        ip[39] = 1;
+        offset += 40;
+    }
+    else
+    {
+        put16(frame + offset, 0x0800);
+        offset += 2;
+        unsigned char *ip = frame + offset;
+        memset(ip, 0, 20);
+        ip[0] = 0x45;
+        put16(ip + 2, 20 + transportLength + payload);
+        ip[8] = 64;
+        ip[9] = tcp ? 6 : 17;
+        ip[12] = 198;
+        ip[13] = 18;
+        ip[14] = (unsigned char)(flow >> 8);
+        ip[15] = (unsigned char)flow;
+        ip[16] = 198;
+        ip[17] = 19;
+        ip[19] = 1;
+        offset += 20;
+    }
+
+    unsigned char *transport = frame + offset;
+    memset(transport, 0, transportLength);
+    put16(transport, 10000 + flow);
+    put16(transport + 2, tcp ? 443 : 53);
+    if (tcp)
+    {
+        transport[12] = 0x50;
+        transport[13] = payload ? 0x18 : 0x10; // PSH ACK or a bare ACK
+    }
+    else
+        put16(transport + 4, 8 + payload);
+    offset += transportLength;
+    memset(frame + offset, 0x5a, payload);
+    if (!tcp && payload >= 40) // A DNS query naming the flow, for the application layer stage
+    {
+        unsigned char *dns = frame + offset;
+        memset(dns, 0, 12);
+        put16(dns + 4, 1);
+        int length = snprintf((char *)dns + 13, 32, "host%u", flow);
+        dns[12] = (unsigned char)length;
+        memcpy(dns + 13 + length, "\7example\3com", 13);
+    }
+    return offset + payload < 60 ? 60 : offset + payload;
+}
+
+static void generateFrames(PacketStore &frames, size_t count, unsigned long long seed)
+{
+    BenchRandom random(seed);
+    unsigned char frame[1600];
+    unsigned long long timestamp = 1700000000000000000ULL;
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned int size = makeFrame(random, frame);
+        timestamp += 1000 + random.next(1000);
+        frames.add(frame, size, timestamp);
+    }
+}
+
+static BenchResult startResult(const char *stage)
+{
+    BenchResult result;
+    result.stage = stage;
+    result.workers = 1;
+    result.packets = 0;
+    result.sent = 0;
+    result.seconds = 0;
+    result.drops = 0;
+    result.peakRss = 0;
+    resetPeakRss();
+    return result;
+}
+
+static void benchDissect(const PacketStore &frames, int passes)
+{
+    BenchResult result = startResult("dissect");
+    unsigned int flags = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (PacketHandle i = 0; i < frames.size(); i++)
+        {
+            PacketInfo info;
+            dissect(frames[i].data, frames[i].size, info);
+            flags += info.flags + info.payloadOffset;
+        }
+    }
+    result.seconds = elapsedSince(start);
+    result.packets = (unsigned long long)frames.size() * passes;
+    result.peakRss = peakRss();
+    if (flags == 1) // Keeps the loop from being optimized away
+        printf(" ");
+    report(result);
+}
+
+// Producer and consumer on one thread, measures the copy and publish cost without contention
+// Formats every frame as a hex and ASCII dump, as the detail view and exports do
+static void benchHexdump(const PacketStore &frames, int passes)
+{
+    BenchResult result = startResult("hexdump");
+    std::vector<char> text(HEXDUMP_SIZE(BUFFSIZE));
+    size_t written = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (PacketHandle i = 0; i < frames.size(); i++)
+            written += hexdump(frames[i].data, frames[i].size, text.data(), text.size());
+    }
+    result.seconds = elapsedSince(start);
+    result.packets = (unsigned long long)frames.size() * passes;
+    result.peakRss = peakRss();
+    if (written == 1) // Keeps the loop from being optimized away
+        printf(" ");
+    report(result);
+}
+
+// Filters every frame with a display filter mixing header fields and a payload search
+static void benchDisplayFilter(const PacketStore &frames, int passes)
+{
+    BenchResult result = startResult("display filter");
+    std::string error;
+    size_t shown = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        DisplayFilter filter;
+        filter.setExpression("tcp.port == 443 || udp.port == 53 && payload contains \"www\"", error);
+        filter.update(frames);
+        shown += filter.size();
+    }
+    result.seconds = elapsedSince(start);
+    result.packets = (unsigned long long)frames.size() * passes;
+    result.peakRss = peakRss();
+    if (shown == 1) // Keeps the loop from being optimized away
+        printf(" ");
+    report(result);
+}
+
+static void benchTimeline(const PacketStore &frames, int passes)
+{
+    BenchResult result = startResult("timeline");
+    Timeline timeline;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (PacketHandle i = 0; i < frames.size(); i++)
+            timeline.add(frames[i]);
+    }
+    result.seconds = elapsedSince(start);
+    result.packets = (unsigned long long)frames.size() * passes;
+    result.peakRss = peakRss();
+    unsigned long long first, last;
+    if (timeline.getRange(first, last) && first == last) // Keeps the loop from being optimized away
+        printf(" ");
+    report(result);
+}
+
+static void benchApplication(const PacketStore &frames, int passes)
+{
+    BenchResult result = startResult("app layer");
+    StringPool names;
+    unsigned long long found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (PacketHandle i = 0; i < frames.size(); i++)
+        {
+            Packet packet = frames[i];
+            dissectApplication(packet, names);
+            found += packet.info.name != STRING_POOL_NONE;
+        }
+    }
+    result.seconds = elapsedSince(start);
+    result.packets = (unsigned long long)frames.size() * passes;
+    result.peakRss = peakRss();
+    if (found == 1) // Keeps the loop from being optimized away
+        printf(" ");
+    report(result);
+}
+
+static void benchQueue(const PacketStore &frames, int passes)
+{
+    BenchResult result = startResult("queue");
+    FrameQueue queue;
+    unsigned long long bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (PacketHandle i = 0; i < frames.size(); i++)
+        {
+            const Packet &packet = frames[i];
+            queue.push(packet);
+            if ((i + 1) % QUEUE_READ_BATCH == 0)
+            {
+                queue.publish();
+                result.packets += queue.consume([&bytes](const Packet &queued)
+                                                { bytes += queued.size; },
+                                                QUEUE_READ_BATCH);
+            }
+        }
+        queue.publish();
+        result.packets += queue.consume([&bytes](const Packet &queued)
+                                        { bytes += queued.size; },
+                                        frames.size());
+    }
+    result.seconds = elapsedSince(start);
+    result.drops = queue.overflowCount();
+    result.peakRss = peakRss();
+    report(result);
+}
+
+static void benchStore(const PacketStore &frames, int passes)
+{
+    BenchResult result = startResult("store");
+    PacketStore store;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        store.clear();
+        for (PacketHandle i = 0; i < frames.size(); i++)
+            store.add(frames[i]);
+        result.drops += store.droppedPackets();
+    }
+    result.seconds = elapsedSince(start);
+    result.packets = (unsigned long long)frames.size() * passes;
+    result.peakRss = peakRss();
+    report(result);
+}
+
+// Adds the frames to a store two chunks large, every older chunk is compressed to a spill file in /tmp
+static void benchSpill(const PacketStore &frames, int passes)
+{
+    BenchResult result = startResult("spill");
+    PacketStore store(2 * STORE_CHUNK_SIZE);
+    if (!store.setSpillDirectory("/tmp"))
+        return;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (PacketHandle i = 0; i < frames.size(); i++)
+            store.add(frames[i]);
+    }
+    result.seconds = elapsedSince(start);
+    result.packets = (unsigned long long)frames.size() * passes;
+    result.drops = store.droppedPackets();
+    result.peakRss = peakRss();
+    report(result);
+
+    // Reads every packet back, decompressing each segment once
+    result = startResult("spill read");
+    unsigned long long bytes = 0;
+    start = std::chrono::steady_clock::now();
+    store.visit(0, store.size(), [&bytes](PacketHandle, const Packet &packet) { bytes += packet.data[0]; });
+    result.seconds = elapsedSince(start);
+    result.packets = store.size();
+    result.peakRss = peakRss();
+    if (bytes == 1) // Keeps the loop from being optimized away
+        printf(" ");
+    report(result);
+}
+
+static void benchFlows(const PacketStore &frames, int passes)
+{
+    BenchResult result = startResult("flows");
+    FlowTable flows;
+    std::vector<Flow> top;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (PacketHandle i = 0; i < frames.size(); i++)
+            flows.update(frames[i]);
+        flows.topFlows(top);
+    }
+    result.seconds = elapsedSince(start);
+    result.packets = (unsigned long long)frames.size() * passes;
+    result.drops = flows.refusedFlows();
+    result.peakRss = peakRss();
+    report(result);
+}
+
+/*
+Runs the frames through the same stages composed at compile time and at run time,
+measuring what the inlined chain saves over one virtual call per packet and stage.
+*/
+static void benchPipeline(const PacketStore &frames, int passes)
+{
+    std::string error;
+    DisplayFilter filter;
+    filter.setExpression("tcp || udp.port == 53", error);
+
+    BenchResult result = startResult("pipeline static");
+    Timeline timeline;
+    FlowTable flows;
+    unsigned long long kept = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        auto pipeline = makePipeline(StoreSource(frames), DissectStage(), FilterStage(filter), SnaplenStage(96),
+                                     TimelineStage(&timeline), FlowStage(flows), CountSink());
+        while (pipeline.run() > 0)
+            ;
+        kept += pipeline.stage<5>().packets;
+    }
+    result.seconds = elapsedSince(start);
+    result.packets = (unsigned long long)frames.size() * passes;
+    result.peakRss = peakRss();
+    report(result);
+
+    result = startResult("pipeline dynamic");
+    timeline.clear();
+    flows.clear();
+    unsigned long long dynamicKept = 0;
+    start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        DynamicPipeline pipeline;
+        pipeline.add("dissect", DissectStage());
+        pipeline.add("filter", FilterStage(filter));
+        pipeline.add("snaplen", SnaplenStage(96));
+        pipeline.add("timeline", TimelineStage(&timeline));
+        pipeline.add("flows", FlowStage(flows));
+        pipeline.add("count", CountSink());
+        StoreSource source(frames);
+        while (source.read([&pipeline, &dynamicKept](Packet *packets, size_t count)
+                           { dynamicKept += pipeline.process(packets, count); }) > 0)
+            ;
+    }
+    result.seconds = elapsedSince(start);
+    result.packets = (unsigned long long)frames.size() * passes;
+    result.peakRss = peakRss();
+    if (kept != dynamicKept)
+        std::cerr << "Pipelines kept " << kept << " and " << dynamicKept << " packets" << std::endl;
+    report(result);
+}
+
+// Writes the frames once, the file is read back by benchReader()
+static bool benchWriter(const PacketStore &frames, const std::string &path)
+{
+    BenchResult result = startResult("writer");
+    PcapngWriter writer;
+    auto start = std::chrono::steady_clock::now();
+    if (!writer.open(path))
+        return false;
+    for (PacketHandle i = 0; i < frames.size(); i++)
+        writer.write(frames[i]);
+    writer.close();
+    result.seconds = elapsedSince(start);
+    result.packets = writer.packetsWritten();
+    result.drops = frames.size() - writer.packetsWritten();
+    result.peakRss = peakRss();
+    report(result);
+    return !writer.hasFailed();
+}
+
+static void benchReader(const std::string &path)
+{
+    BenchResult result = startResult("reader");
+    PcapReader reader;
+    std::string error;
+    auto start = std::chrono::steady_clock::now();
+    if (!reader.open(path, error))
+    {
+        std::cerr << error << std::endl;
+        return;
+    }
+    unsigned long long bytes = 0;
+    size_t count;
+    while ((count = reader.consume([&bytes](const Packet &packet)
+                                   { bytes += packet.size; })) > 0)
+        result.packets += count;
+    result.seconds = elapsedSince(start);
+    result.peakRss = peakRss();
+    report(result);
+}
+
+/*
+Replays frames through a TPACKET_V2 transmit ring: frames are copied into the
+shared mapping and a single send() hands a whole batch to the kernel.
+*/
+class FrameInjector
+{
+private:
+    int sock;
+    unsigned char *map;
+    size_t mapSize;
+    unsigned int frameCount;
+    unsigned int current;
+
+public:
+    FrameInjector() : sock(-1), map(NULL), mapSize(0), frameCount(0), current(0) {}
+
+    ~FrameInjector()
+    {
+        if (map)
+            munmap(map, mapSize);
+        if (sock >= 0)
+            close(sock);
+    }
+
+    bool open(int interfaceIndex)
+    {
+        sock = socket(AF_PACKET, SOCK_RAW, 0); // Protocol 0, the socket never receives
+        int version = TPACKET_V2;
+        struct tpacket_req req;
+        req.tp_block_size = BENCH_TX_BLOCK_SIZE;
+        req.tp_block_nr = BENCH_TX_BLOCK_COUNT;
+        req.tp_frame_size = BENCH_TX_FRAME_SIZE;
+        req.tp_frame_nr = BENCH_TX_BLOCK_SIZE / BENCH_TX_FRAME_SIZE * BENCH_TX_BLOCK_COUNT;
+        if (sock < 0 || setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+            setsockopt(sock, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+        {
+            std::cerr << "Error setting up the transmit ring" << std::endl;
+            return false;
+        }
+        frameCount = req.tp_frame_nr;
+        mapSize = (size_t)req.tp_block_size * req.tp_block_nr;
+        void *mapping = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0);
+        if (mapping == MAP_FAILED)
+        {
+            std::cerr << "Error mapping the transmit ring" << std::endl;
+            return false;
+        }
+        map = static_cast<unsigned char *>(mapping);
+
+        struct sockaddr_ll addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sll_family = AF_PACKET;
+        addr.sll_protocol = 0;
+        addr.sll_ifindex = interfaceIndex;
+        return bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    }
+
+    // Largest frame that fits in a ring slot
+    static unsigned int maxFrameSize() { return BENCH_TX_FRAME_SIZE - TPACKET2_HDRLEN + sizeof(struct sockaddr_ll); }
+
+    // Queues one frame, returns false while the ring is full
+    bool queue(const Packet &packet)
+    {
+        struct tpacket2_hdr *hdr = reinterpret_cast<struct tpacket2_hdr *>(map + (size_t)current * BENCH_TX_FRAME_SIZE);
+        if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE)
+            return false;
+        unsigned char *data = reinterpret_cast<unsigned char *>(hdr) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+        memcpy(data, packet.data, packet.size);
+        hdr->tp_len = packet.size;
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+        current = (current + 1) % frameCount;
+        return true;
+    }
+
+    // Sends every queued frame
+    void flush() { send(sock, NULL, 0, 0); }
+};
+
+static std::atomic<bool> sending(false);
+
+static void injectThreadFunc(const PacketStore *frames, int interfaceIndex, unsigned long long *sent)
+{
+    FrameInjector injector;
+    if (!injector.open(interfaceIndex))
+        return;
+
+    PacketHandle next = 0;
+    while (sending)
+    {
+        unsigned int batch = 0;
+        for (unsigned int tries = 0; tries < 256; tries++)
+        {
+            const Packet &packet = (*frames)[next];
+            if (packet.size <= (int)FrameInjector::maxFrameSize())
+            {
+                if (!injector.queue(packet))
+                    break;
+                batch++;
+            }
+            next = (next + 1) % frames->size();
+        }
+        injector.flush();
+        *sent += batch;
+        if (batch == 0)
+            std::this_thread::yield();
+    }
+}
+
+// Replays the frames on the interface for a while and drains the capture into a store
+static void benchCapture(const PacketStore &frames, CaptureBackend backend, unsigned int workers,
+                         FanoutMode mode, const std::string &interface, int seconds)
+{
+    BenchResult result = startResult("capture");
+    result.backend = backend == CaptureBackend::Ring ? "ring" : backend == CaptureBackend::RecvMmsg ? "recvmmsg" : "recvfrom";
+    result.workers = workers;
+
+    PacketSniffer sniffer;
+    if (!sniffer.setInterface(interface) || !sniffer.startCapture(backend, workers, mode))
+    {
+        std::cerr << "Unable to start capture with " << workers << " workers, the capture stages need root" << std::endl;
+        return;
+    }
+
+    PacketStore store;
+    sending = true;
+    std::thread injector(injectThreadFunc, &frames, sniffer.getInterfaceIndex(), &result.sent);
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::seconds(seconds);
+    while (std::chrono::steady_clock::now() < end)
+    {
+        size_t count = sniffer.drain(store);
+        result.packets += count;
+        if (store.memoryUsage() > (256u << 20))
+            store.clear();
+        if (count == 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    result.seconds = elapsedSince(start);
+    sending = false;
+    injector.join();
+    sniffer.stopCapture();
+
+    result.drops = sniffer.getKernelStats().drops + sniffer.queueOverflows() + store.droppedPackets();
+    result.peakRss = peakRss();
+    report(result);
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n <frames>      Synthetic frames, default %d\n"
+            "  -S <seed>        Seed of the synthetic frames, default 1\n"
+            "  -r <file>        Use the packets of a pcap or pcapng file instead\n"
+            "  -p <passes>      Passes over the frames for the offline stages, default 10\n"
+            "  -o <file>        File written by the writer stage, default /tmp/csniff_bench.pcapng\n"
+            "  -i <interface>   Interface the capture stages inject into, default lo\n"
+            "  -s <seconds>     Duration of each capture stage, default 3, 0 skips them\n"
+            "  -W <workers>     Capture stages run with 1, 2, 4 ... up to this many workers\n"
+            "  -b <backend>     ring, recvmmsg, recvfrom or all, default all\n"
+            "  -F <mode>        Fanout mode with several workers: hash, cpu or lb\n"
+            "  -j               JSON lines instead of a table\n",
+            program, BENCH_FRAMES);
+}
+
+int main(int argc, char **argv)
+{
+    size_t frameCount = BENCH_FRAMES;
+    unsigned long long seed = 1;
+    std::string input, output = "/tmp/csniff_bench.pcapng", interface = "lo";
+    int passes = 10;
+    int seconds = 3;
+    unsigned int maxWorkers = std::thread::hardware_concurrency();
+    std::string backendName = "all";
+    FanoutMode mode = FanoutMode::Hash;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:S:r:p:o:i:s:W:b:F:jh")) != -1)
+    {
+        switch (option)
+        {
+        case 'n':
+            frameCount = strtoull(optarg, NULL, 10);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            input = optarg;
+            break;
+        case 'p':
+            passes = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'i':
+            interface = optarg;
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'W':
+            maxWorkers = atoi(optarg);
+            break;
+        case 'b':
+            backendName = optarg;
+            break;
+        case 'F':
+            if (std::string(optarg) == "cpu")
+                mode = FanoutMode::Cpu;
+            else if (std::string(optarg) == "lb")
+                mode = FanoutMode::LoadBalance;
+            break;
+        case 'j':
+            jsonOutput = true;
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (maxWorkers == 0)
+        maxWorkers = 1;
+
+    PacketStore frames;
+    PcapReader reader;
+    if (!input.empty())
+    {
+        std::string error;
+        if (!reader.open(input, error))
+        {
+            std::cerr << error << std::endl;
+            return EXIT_FAILURE;
+        }
+        while (reader.drain(frames) > 0)
+            ;
+    }
+    else
+        generateFrames(frames, frameCount, seed);
+    if (frames.size() == 0)
+    {
+        std::cerr << "No frames to replay" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!jsonOutput)
+        printf("%-18s %7s %12s %12s %12s %9s %10s %10s\n", "stage", "workers", "packets", "sent", "packets/s",
+               "ns/packet", "drops", "peak MiB");
+    benchDissect(frames, passes);
+    benchHexdump(frames, passes);
+    benchDisplayFilter(frames, passes);
+    benchTimeline(frames, passes);
+    benchApplication(frames, passes);
+    benchQueue(frames, passes);
+    benchStore(frames, passes);
+    benchSpill(frames, passes);
+    benchFlows(frames, passes);
+    benchPipeline(frames, passes);
+    if (benchWriter(frames, output))
+        benchReader(output);
+
+    const char *backendNames[] = {"ring", "recvmmsg", "recvfrom"};
+    const CaptureBackend backends[] = {CaptureBackend::Ring, CaptureBackend::RecvMmsg, CaptureBackend::RecvFrom};
+    for (int i = 0; seconds > 0 && i < 3; i++)
+    {
+        if (backendName != "all" && backendName != backendNames[i])
+            continue;
+        for (unsigned int workers = 1; workers <= maxWorkers; workers *= 2)
+            benchCapture(frames, backends[i], workers, mode, interface, seconds);
+    }
+    return 0;
+}
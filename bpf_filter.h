@@ -0,0 +1,499 @@
+#pragma once
+
+#include <linux/filter.h>   // For sock_filter, sock_fprog and the BPF_* opcodes
+#include <linux/if_ether.h> // For the ETH_P_* ethertypes
+#include <netinet/in.h>     // For the IPPROTO_* protocol numbers
+
+#include <string>
+#include <vector>
+
+#include "filter_expr.h"
+
+#define BPF_SNAPLEN 0x40000 // Returned by the program for accepted packets, larger than any frame
+#define BPF_HEADERS_SNAPLEN 192 // Kept in headers only mode when the program cannot size the headers itself
+
+/*
+Compiles a FilterExpr to classic BPF for SO_ATTACH_FILTER.
+
+Boolean operators are generated as short circuit jumps: every node is emitted
+with a label to jump to when it is true and one for when it is false, labels
+are resolved to relative offsets once the whole program has been emitted.
+Frames are assumed to be Ethernet, as delivered by an AF_PACKET socket, IPv6
+transport protocols are only recognized without extension headers.
+*/
+class BpfCompiler
+{
+private:
+    struct Insn
+    {
+        struct sock_filter filter;
+        int trueLabel; // -1 for instructions that do not jump
+        int falseLabel;
+    };
+
+    std::vector<Insn> code;
+    std::vector<int> labels; // Instruction index each label points to
+    const FilterExpr *expr;
+
+    int newLabel()
+    {
+        labels.push_back(-1);
+        return (int)labels.size() - 1;
+    }
+
+    void place(int label) { labels[label] = (int)code.size(); }
+
+    void stmt(unsigned short op, unsigned int k)
+    {
+        Insn insn;
+        insn.filter.code = op;
+        insn.filter.jt = insn.filter.jf = 0;
+        insn.filter.k = k;
+        insn.trueLabel = insn.falseLabel = -1;
+        code.push_back(insn);
+    }
+
+    void jump(unsigned short op, unsigned int k, int trueLabel, int falseLabel)
+    {
+        stmt(BPF_JMP | op | BPF_K, k);
+        code.back().trueLabel = trueLabel;
+        code.back().falseLabel = falseLabel;
+    }
+
+    // Jumps on the accumulator, optionally masked first
+    void compare(FilterOp op, unsigned int value, unsigned int mask, int trueLabel, int falseLabel)
+    {
+        if (mask != 0xffffffff)
+            stmt(BPF_ALU | BPF_AND | BPF_K, mask);
+
+        switch (op)
+        {
+        case FilterOp::Eq:
+            jump(BPF_JEQ, value, trueLabel, falseLabel);
+            break;
+        case FilterOp::Ne:
+            jump(BPF_JEQ, value, falseLabel, trueLabel);
+            break;
+        case FilterOp::Gt:
+            jump(BPF_JGT, value, trueLabel, falseLabel);
+            break;
+        case FilterOp::Ge:
+            jump(BPF_JGE, value, trueLabel, falseLabel);
+            break;
+        case FilterOp::Lt:
+            jump(BPF_JGE, value, falseLabel, trueLabel);
+            break;
+        case FilterOp::Le:
+            jump(BPF_JGT, value, falseLabel, trueLabel);
+            break;
+        }
+    }
+
+    void etherType(unsigned int type, int trueLabel, int falseLabel)
+    {
+        stmt(BPF_LD | BPF_H | BPF_ABS, 12);
+        jump(BPF_JEQ, type, trueLabel, falseLabel);
+    }
+
+    void ipv4Protocol(unsigned int protocol, int trueLabel, int falseLabel)
+    {
+        int isIp = newLabel();
+        etherType(ETH_P_IP, isIp, falseLabel);
+        place(isIp);
+        stmt(BPF_LD | BPF_B | BPF_ABS, 23);
+        jump(BPF_JEQ, protocol, trueLabel, falseLabel);
+    }
+
+    void ipv6Protocol(unsigned int protocol, int trueLabel, int falseLabel)
+    {
+        int isIp6 = newLabel();
+        etherType(ETH_P_IPV6, isIp6, falseLabel);
+        place(isIp6);
+        stmt(BPF_LD | BPF_B | BPF_ABS, 20);
+        jump(BPF_JEQ, protocol, trueLabel, falseLabel);
+    }
+
+    void transport(unsigned int protocol, int trueLabel, int falseLabel)
+    {
+        int notIp = newLabel();
+        ipv4Protocol(protocol, trueLabel, notIp);
+        place(notIp);
+        ipv6Protocol(protocol, trueLabel, falseLabel);
+    }
+
+    void vlanPresent(int trueLabel, int falseLabel)
+    {
+        // Offloaded tags are only visible through the ancillary data, in band ones in the header
+        int inBand = newLabel();
+        int notDot1q = newLabel();
+        stmt(BPF_LD | BPF_B | BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT);
+        jump(BPF_JEQ, 1, trueLabel, inBand);
+        place(inBand);
+        etherType(ETH_P_8021Q, trueLabel, notDot1q);
+        place(notDot1q);
+        jump(BPF_JEQ, ETH_P_8021AD, trueLabel, falseLabel);
+    }
+
+    void vlanId(FilterOp op, unsigned int value, int trueLabel, int falseLabel)
+    {
+        int inBand = newLabel();
+        int isTagged = newLabel();
+        stmt(BPF_LD | BPF_B | BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT);
+        jump(BPF_JEQ, 1, isTagged, inBand);
+        place(isTagged);
+        stmt(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG);
+        compare(op, value, 0x0fff, trueLabel, falseLabel);
+
+        int isDot1q = newLabel();
+        int notDot1q = newLabel();
+        place(inBand);
+        etherType(ETH_P_8021Q, isDot1q, notDot1q);
+        place(notDot1q);
+        jump(BPF_JEQ, ETH_P_8021AD, isDot1q, falseLabel);
+        place(isDot1q);
+        stmt(BPF_LD | BPF_H | BPF_ABS, 14);
+        compare(op, value, 0x0fff, trueLabel, falseLabel);
+    }
+
+    // Loads a header field of an IPv4 packet, the caller has already checked the ethertype
+    void ipv4Field(FilterField field, unsigned int mask, FilterOp op, unsigned int value, int trueLabel,
+                   int falseLabel)
+    {
+        switch (field)
+        {
+        case FilterField::IpSrc:
+            stmt(BPF_LD | BPF_W | BPF_ABS, 26);
+            break;
+        case FilterField::IpDst:
+            stmt(BPF_LD | BPF_W | BPF_ABS, 30);
+            break;
+        case FilterField::IpProto:
+            stmt(BPF_LD | BPF_B | BPF_ABS, 23);
+            break;
+        case FilterField::IpTtl:
+            stmt(BPF_LD | BPF_B | BPF_ABS, 22);
+            break;
+        default:
+            stmt(BPF_LD | BPF_H | BPF_ABS, 16);
+            break;
+        }
+        compare(op, value, mask, trueLabel, falseLabel);
+    }
+
+    /*
+    Compares the source (offset 0) or destination (offset 2) port. IPv4 fragments other
+    than the first carry no transport header and never match, X holds the IPv4 header
+    length so ports are loaded relative to it.
+    */
+    void port(unsigned int protocol, const unsigned int *offsets, int count, FilterOp op, unsigned int value,
+              int trueLabel, int falseLabel)
+    {
+        int notIp = newLabel();
+        int isIp = newLabel();
+        int firstFragment = newLabel();
+        ipv4Protocol(protocol, isIp, notIp);
+        place(isIp);
+        stmt(BPF_LD | BPF_H | BPF_ABS, 20);
+        jump(BPF_JSET, 0x1fff, falseLabel, firstFragment);
+        place(firstFragment);
+        stmt(BPF_LDX | BPF_B | BPF_MSH, 14);
+        for (int i = 0; i < count; i++)
+        {
+            int next = i + 1 < count ? newLabel() : falseLabel;
+            stmt(BPF_LD | BPF_H | BPF_IND, 14 + offsets[i]);
+            compare(op, value, 0xffffffff, trueLabel, next);
+            if (i + 1 < count)
+                place(next);
+        }
+
+        int isIp6 = newLabel();
+        place(notIp);
+        ipv6Protocol(protocol, isIp6, falseLabel);
+        place(isIp6);
+        for (int i = 0; i < count; i++)
+        {
+            int next = i + 1 < count ? newLabel() : falseLabel;
+            stmt(BPF_LD | BPF_H | BPF_ABS, 54 + offsets[i]);
+            compare(op, value, 0xffffffff, trueLabel, next);
+            if (i + 1 < count)
+                place(next);
+        }
+    }
+
+    void comparison(const FilterNode &node, int trueLabel, int falseLabel)
+    {
+        // Fields matching either of two values negate a positive match, so
+        // "tcp.port != 443" means neither port is 443
+        if (node.op == FilterOp::Ne && (node.field == FilterField::IpAddr || node.field == FilterField::TcpPort ||
+                                        node.field == FilterField::UdpPort))
+        {
+            FilterNode positive = node;
+            positive.op = FilterOp::Eq;
+            comparison(positive, falseLabel, trueLabel);
+            return;
+        }
+
+        static const unsigned int source[] = {0};
+        static const unsigned int destination[] = {2};
+        static const unsigned int either[] = {0, 2};
+
+        switch (node.field)
+        {
+        case FilterField::FrameLen:
+            stmt(BPF_LD | BPF_W | BPF_LEN, 0);
+            compare(node.op, node.value, 0xffffffff, trueLabel, falseLabel);
+            break;
+        case FilterField::EthType:
+            stmt(BPF_LD | BPF_H | BPF_ABS, 12);
+            compare(node.op, node.value, 0xffffffff, trueLabel, falseLabel);
+            break;
+        case FilterField::VlanId:
+            vlanId(node.op, node.value, trueLabel, falseLabel);
+            break;
+        case FilterField::IpAddr:
+        {
+            int isIp = newLabel();
+            int notSource = newLabel();
+            etherType(ETH_P_IP, isIp, falseLabel);
+            place(isIp);
+            ipv4Field(FilterField::IpSrc, node.mask, node.op, node.value, trueLabel, notSource);
+            place(notSource);
+            ipv4Field(FilterField::IpDst, node.mask, node.op, node.value, trueLabel, falseLabel);
+            break;
+        }
+        case FilterField::IpSrc:
+        case FilterField::IpDst:
+        case FilterField::IpProto:
+        case FilterField::IpTtl:
+        case FilterField::IpLen:
+        {
+            int isIp = newLabel();
+            etherType(ETH_P_IP, isIp, falseLabel);
+            place(isIp);
+            ipv4Field(node.field, node.mask, node.op, node.value, trueLabel, falseLabel);
+            break;
+        }
+        case FilterField::TcpSrcPort:
+            port(IPPROTO_TCP, source, 1, node.op, node.value, trueLabel, falseLabel);
+            break;
+        case FilterField::TcpDstPort:
+            port(IPPROTO_TCP, destination, 1, node.op, node.value, trueLabel, falseLabel);
+            break;
+        case FilterField::TcpPort:
+            port(IPPROTO_TCP, either, 2, node.op, node.value, trueLabel, falseLabel);
+            break;
+        case FilterField::UdpSrcPort:
+            port(IPPROTO_UDP, source, 1, node.op, node.value, trueLabel, falseLabel);
+            break;
+        case FilterField::UdpDstPort:
+            port(IPPROTO_UDP, destination, 1, node.op, node.value, trueLabel, falseLabel);
+            break;
+        case FilterField::UdpPort:
+            port(IPPROTO_UDP, either, 2, node.op, node.value, trueLabel, falseLabel);
+            break;
+        case FilterField::Frame:
+        case FilterField::Payload:
+            break; // Only searched, compile() rejects searches
+        }
+    }
+
+    void protocol(FilterProtocol protocol, int trueLabel, int falseLabel)
+    {
+        switch (protocol)
+        {
+        case FilterProtocol::IPv4:
+            etherType(ETH_P_IP, trueLabel, falseLabel);
+            break;
+        case FilterProtocol::IPv6:
+            etherType(ETH_P_IPV6, trueLabel, falseLabel);
+            break;
+        case FilterProtocol::Arp:
+            etherType(ETH_P_ARP, trueLabel, falseLabel);
+            break;
+        case FilterProtocol::Tcp:
+            transport(IPPROTO_TCP, trueLabel, falseLabel);
+            break;
+        case FilterProtocol::Udp:
+            transport(IPPROTO_UDP, trueLabel, falseLabel);
+            break;
+        case FilterProtocol::Icmp:
+        {
+            int notIp = newLabel();
+            ipv4Protocol(IPPROTO_ICMP, trueLabel, notIp);
+            place(notIp);
+            ipv6Protocol(IPPROTO_ICMPV6, trueLabel, falseLabel);
+            break;
+        }
+        case FilterProtocol::Vlan:
+            vlanPresent(trueLabel, falseLabel);
+            break;
+        }
+    }
+
+    void generate(int index, int trueLabel, int falseLabel)
+    {
+        const FilterNode &node = expr->nodes[index];
+        switch (node.type)
+        {
+        case FilterNodeType::And:
+        {
+            int right = newLabel();
+            generate(node.left, right, falseLabel);
+            place(right);
+            generate(node.right, trueLabel, falseLabel);
+            break;
+        }
+        case FilterNodeType::Or:
+        {
+            int right = newLabel();
+            generate(node.left, trueLabel, right);
+            place(right);
+            generate(node.right, trueLabel, falseLabel);
+            break;
+        }
+        case FilterNodeType::Not:
+            generate(node.left, falseLabel, trueLabel);
+            break;
+        case FilterNodeType::Protocol:
+            protocol(node.protocol, trueLabel, falseLabel);
+            break;
+        case FilterNodeType::Compare:
+            comparison(node, trueLabel, falseLabel);
+            break;
+        case FilterNodeType::Contains:
+            break; // Rejected by compile()
+        }
+    }
+
+    // Ends a path that left the bytes to keep in A, capped at snaplen
+    void returnLength(unsigned int snaplen, int capped)
+    {
+        int exact = newLabel();
+        jump(BPF_JGT, snaplen, capped, exact);
+        place(exact);
+        stmt(BPF_RET | BPF_A, 0);
+    }
+
+    /*
+    Accept path of headers only mode. Untagged IPv4 gets its exact Ethernet, IP and TCP
+    or UDP/ICMP header length, everything else BPF_HEADERS_SNAPLEN bytes, which user space
+    cuts at the end of the dissected headers.
+    */
+    void acceptHeaders(unsigned int snaplen)
+    {
+        int ipv4 = newLabel(), tcp = newLabel(), notTcp = newLabel(), notUdp = newLabel();
+        int shortHeader = newLabel(), ipOnly = newLabel(), fallback = newLabel(), capped = newLabel();
+
+        stmt(BPF_LD | BPF_H | BPF_ABS, 12);
+        jump(BPF_JEQ, ETH_P_IP, ipv4, fallback);
+
+        place(ipv4);
+        stmt(BPF_LDX | BPF_B | BPF_MSH, ETH_HLEN); // X = IP header length
+        stmt(BPF_LD | BPF_B | BPF_ABS, ETH_HLEN + 9);
+        jump(BPF_JEQ, IPPROTO_TCP, tcp, notTcp);
+
+        // A load past the end would reject the packet, so check the data offset byte is there
+        place(tcp);
+        stmt(BPF_LD | BPF_W | BPF_LEN, 0);
+        stmt(BPF_ALU | BPF_SUB | BPF_X, 0);
+        int dataOffset = newLabel();
+        jump(BPF_JGE, ETH_HLEN + 13, dataOffset, ipOnly);
+        place(dataOffset);
+        stmt(BPF_LD | BPF_B | BPF_IND, ETH_HLEN + 12);
+        stmt(BPF_ALU | BPF_RSH | BPF_K, 4);
+        stmt(BPF_ALU | BPF_LSH | BPF_K, 2);
+        stmt(BPF_ALU | BPF_ADD | BPF_X, 0);
+        stmt(BPF_ALU | BPF_ADD | BPF_K, ETH_HLEN);
+        returnLength(snaplen, capped);
+
+        place(notTcp);
+        jump(BPF_JEQ, IPPROTO_UDP, shortHeader, notUdp);
+        place(notUdp);
+        jump(BPF_JEQ, IPPROTO_ICMP, shortHeader, ipOnly);
+
+        place(shortHeader); // UDP and ICMP headers are 8 bytes
+        stmt(BPF_MISC | BPF_TXA, 0);
+        stmt(BPF_ALU | BPF_ADD | BPF_K, ETH_HLEN + 8);
+        returnLength(snaplen, capped);
+
+        place(ipOnly);
+        stmt(BPF_MISC | BPF_TXA, 0);
+        stmt(BPF_ALU | BPF_ADD | BPF_K, ETH_HLEN);
+        returnLength(snaplen, capped);
+
+        place(fallback);
+        stmt(BPF_RET | BPF_K, snaplen < BPF_HEADERS_SNAPLEN ? snaplen : BPF_HEADERS_SNAPLEN);
+
+        place(capped);
+        stmt(BPF_RET | BPF_K, snaplen);
+    }
+
+public:
+    /*
+    Compiles the expression into program, accepted packets are truncated to snaplen bytes,
+    or to their headers with headersOnly. Returns false when the expression searches the
+    packet bytes or a conditional jump does not fit the 8 bit offset of classic BPF.
+    */
+    bool compile(const FilterExpr &filter, std::vector<struct sock_filter> &program, std::string &error,
+                 unsigned int snaplen = BPF_SNAPLEN, bool headersOnly = false)
+    {
+        for (size_t i = 0; i < filter.nodes.size(); i++)
+        {
+            if (filter.nodes[i].type == FilterNodeType::Contains)
+            {
+                error = "'contains' only works in display filters";
+                program.clear();
+                return false;
+            }
+        }
+
+        code.clear();
+        labels.clear();
+        expr = &filter;
+
+        int accept = newLabel();
+        int reject = newLabel();
+        if (!filter.empty())
+            generate(filter.root, accept, reject);
+
+        place(accept);
+        if (headersOnly)
+            acceptHeaders(snaplen);
+        else
+            stmt(BPF_RET | BPF_K, snaplen);
+        place(reject);
+        stmt(BPF_RET | BPF_K, 0);
+
+        program.clear();
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            struct sock_filter insn = code[i].filter;
+            if (code[i].trueLabel >= 0)
+            {
+                int jt = labels[code[i].trueLabel] - (int)i - 1;
+                int jf = labels[code[i].falseLabel] - (int)i - 1;
+                if (jt < 0 || jt > 255 || jf < 0 || jf > 255)
+                {
+                    error = "Filter is too large for classic BPF jumps";
+                    program.clear();
+                    return false;
+                }
+                insn.jt = (unsigned char)jt;
+                insn.jf = (unsigned char)jf;
+            }
+            program.push_back(insn);
+        }
+        return true;
+    }
+
+    // Parses and compiles text in one step
+    bool compile(const std::string &text, std::vector<struct sock_filter> &program, std::string &error,
+                 unsigned int snaplen = BPF_SNAPLEN, bool headersOnly = false)
+    {
+        FilterExpr filter;
+        FilterParser parser;
+        if (!parser.parse(text, filter, error))
+            return false;
+        return compile(filter, program, error, snaplen, headersOnly);
+    }
+};
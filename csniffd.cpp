@@ -0,0 +1,260 @@
+#include "pcap_writer.h"
+#include "sniff.h"
+
+#include <getopt.h>
+#include <signal.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+/*
+Headless capture daemon, must run as root.
+
+Captures with the same PacketSniffer as the GUI and streams the packets to a
+pcapng file, or only counts them when no output file is given. Stops after
+the packet count or duration limit, or on SIGINT/SIGTERM, and prints a stats
+line to stderr every few seconds.
+*/
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void handleSignal(int)
+{
+    stopRequested = 1;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -i <interface>   Capture on this interface only, default every interface\n"
+            "  -L               List the interfaces and exit\n"
+            "  -p               Put the capture interfaces in promiscuous mode\n"
+            "  -H               Use hardware timestamps when the interface supports them\n"
+            "  -f <filter>      Capture filter, e.g. \"tcp.port == 443\"\n"
+            "  -S <bytes>       Keep at most this many bytes of every packet\n"
+            "  -T               Keep only the packet headers\n"
+            "  -w <file>        Write the packets to a pcapng file\n"
+            "  -C <MiB>         Start a new file after this many MiB\n"
+            "  -G <seconds>     Start a new file after this many seconds\n"
+            "  -D               Write with O_DIRECT when supported\n"
+            "  -c <count>       Stop after this many packets\n"
+            "  -d <seconds>     Stop after this many seconds\n"
+            "  -s <seconds>     Stats line interval, 0 disables it, default 5\n"
+            "  -m <file>        Write metrics at every stats interval and on exit, JSON if the\n"
+            "                   name ends in .json, Prometheus text format otherwise\n"
+            "  -b <backend>     ring, recvmmsg or recvfrom, default ring\n"
+            "  -W <workers>     Capture threads, default 1\n"
+            "  -F <mode>        Fanout mode with several workers: hash, cpu or lb\n",
+            program);
+}
+
+static void writeMetrics(PacketSniffer &sniffer, const std::string &path)
+{
+    if (path.empty())
+        return;
+    MetricsSnapshot metrics;
+    sniffer.getMetrics(metrics);
+    bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+    if (!writeMetricsFile(path, json ? formatJson(metrics) : formatPrometheus(metrics)))
+        fprintf(stderr, "Error writing %s\n", path.c_str());
+}
+
+static void printStats(PacketSniffer &sniffer, const PcapngWriter &writer, unsigned long long packets,
+                       unsigned long long lastPackets, double interval)
+{
+    CaptureStats stats = sniffer.getKernelStats();
+    fprintf(stderr, "%llu packets (%.0f/s), kernel %llu received %llu dropped, queue %llu dropped",
+            packets, interval > 0 ? (packets - lastPackets) / interval : 0.0, stats.packets, stats.drops,
+            sniffer.queueOverflows());
+    if (writer.isOpen() || writer.getFilesWritten() > 0)
+        fprintf(stderr, ", %.1f MiB written to %u files%s", writer.getBytesWritten() / (1024.0 * 1024.0),
+                writer.getFilesWritten(), writer.hasFailed() ? ", write errors" : "");
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    std::string interface, filter, output, metricsPath;
+    PcapWriterOptions writerOptions;
+    unsigned long long maxPackets = 0;
+    int duration = 0;
+    int statsInterval = 5;
+    CaptureBackend backend = CaptureBackend::Ring;
+    unsigned int workers = 1;
+    FanoutMode mode = FanoutMode::Hash;
+    bool promiscuous = false;
+    TimestampMode timestamps = TimestampMode::Software;
+    unsigned int snaplen = 0;
+    bool headersOnly = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "i:LpHf:S:Tw:C:G:Dc:d:s:m:b:W:F:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'i':
+            interface = optarg;
+            break;
+        case 'L':
+        {
+            std::vector<CaptureInterface> interfaces = PacketSniffer::listInterfaces();
+            for (size_t i = 0; i < interfaces.size(); i++)
+                printf("%d %s%s%s\n", interfaces[i].index, interfaces[i].name.c_str(),
+                       interfaces[i].up ? "" : " (down)", interfaces[i].loopback ? " (loopback)" : "");
+            return EXIT_SUCCESS;
+        }
+        case 'p':
+            promiscuous = true;
+            break;
+        case 'H':
+            timestamps = TimestampMode::Hardware;
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'S':
+            snaplen = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            headersOnly = true;
+            break;
+        case 'w':
+            output = optarg;
+            break;
+        case 'C':
+            writerOptions.rotateBytes = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'G':
+            writerOptions.rotateSeconds = atoi(optarg);
+            break;
+        case 'D':
+            writerOptions.directIo = true;
+            break;
+        case 'c':
+            maxPackets = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 's':
+            statsInterval = atoi(optarg);
+            break;
+        case 'm':
+            metricsPath = optarg;
+            break;
+        case 'b':
+            if (std::string(optarg) == "recvfrom")
+                backend = CaptureBackend::RecvFrom;
+            else if (std::string(optarg) == "recvmmsg")
+                backend = CaptureBackend::RecvMmsg;
+            else if (std::string(optarg) != "ring")
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'W':
+            workers = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'F':
+            if (std::string(optarg) == "cpu")
+                mode = FanoutMode::Cpu;
+            else if (std::string(optarg) == "lb")
+                mode = FanoutMode::LoadBalance;
+            else if (std::string(optarg) != "hash")
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    PacketSniffer sniffer;
+    if (!interface.empty() && !sniffer.setInterface(interface))
+        return EXIT_FAILURE;
+    sniffer.setPromiscuous(promiscuous);
+    sniffer.setTimestampMode(timestamps);
+
+    if ((snaplen || headersOnly) && !sniffer.setSnaplen(snaplen, headersOnly))
+        return EXIT_FAILURE;
+    if (snaplen)
+        writerOptions.snaplen = snaplen;
+
+    std::string error;
+    if (!sniffer.setFilter(filter, error))
+    {
+        fprintf(stderr, "Invalid filter: %s\n", error.c_str());
+        return EXIT_FAILURE;
+    }
+
+    PcapngWriter writer;
+    if (!output.empty() && !writer.open(output, writerOptions))
+        return EXIT_FAILURE;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (!sniffer.startCapture(backend, workers, mode))
+    {
+        fprintf(stderr, "Unable to start capture\n");
+        return EXIT_FAILURE;
+    }
+
+    unsigned long long packets = 0;
+    unsigned long long lastPackets = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto lastStats = start;
+    while (!stopRequested)
+    {
+        size_t limit = maxPackets ? maxPackets - packets : DRAIN_BATCH;
+        size_t count = sniffer.consume([&writer](const Packet &packet)
+                                       { writer.write(packet); },
+                                       limit < DRAIN_BATCH ? limit : DRAIN_BATCH);
+        packets += count;
+        if (maxPackets && packets >= maxPackets)
+            break;
+
+        auto now = std::chrono::steady_clock::now();
+        if (duration > 0 && now - start >= std::chrono::seconds(duration))
+            break;
+        if (statsInterval > 0 && now - lastStats >= std::chrono::seconds(statsInterval))
+        {
+            printStats(sniffer, writer, packets, lastPackets,
+                       std::chrono::duration<double>(now - lastStats).count());
+            writeMetrics(sniffer, metricsPath);
+            lastStats = now;
+            lastPackets = packets;
+        }
+        if (count == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    sniffer.stopCapture();
+    // Packets already queued when the capture stopped are still written, within the count limit
+    while (!maxPackets || packets < maxPackets)
+    {
+        size_t limit = maxPackets ? maxPackets - packets : DRAIN_BATCH;
+        size_t count = sniffer.consume([&writer](const Packet &packet)
+                                       { writer.write(packet); },
+                                       limit < DRAIN_BATCH ? limit : DRAIN_BATCH);
+        if (count == 0)
+            break;
+        packets += count;
+    }
+    writer.close();
+
+    auto end = std::chrono::steady_clock::now();
+    printStats(sniffer, writer, packets, 0, std::chrono::duration<double>(end - start).count());
+    writeMetrics(sniffer, metricsPath);
+    return writer.hasFailed() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "filter_expr.h"
+#include "packet_store.h"
+
+#define DISPLAY_FILTER_CHUNK 16384 // Packets per task when a filter is evaluated on several threads
+
+/*
+Finds the first occurrence of pattern in data, like memmem(). With SSE2 16
+candidate positions are checked at once by comparing both the first and the
+last byte of the pattern, only positions where both match are compared in
+full, which skips almost every position of real traffic.
+*/
+inline const unsigned char *findBytes(const unsigned char *data, size_t size, const unsigned char *pattern,
+                                      size_t length)
+{
+    if (length == 0)
+        return data;
+    if (length > size)
+        return NULL;
+    if (length == 1)
+        return static_cast<const unsigned char *>(memchr(data, pattern[0], size));
+
+    size_t last = size - length; // Last position the pattern can start at
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8((char)pattern[0]);
+    __m128i final = _mm_set1_epi8((char)pattern[length - 1]);
+    for (; i + 15 <= last; i += 16)
+    {
+        // The second load ends at i + 15 + length - 1, still inside data
+        __m128i heads = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        __m128i tails = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + length - 1));
+        unsigned int candidates = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(heads, first),
+                                                                  _mm_cmpeq_epi8(tails, final)));
+        while (candidates)
+        {
+            unsigned int bit = __builtin_ctz(candidates);
+            if (memcmp(data + i + bit + 1, pattern + 1, length - 2) == 0)
+                return data + i + bit;
+            candidates &= candidates - 1;
+        }
+    }
+#endif
+    for (; i <= last; i++)
+    {
+        if (data[i] == pattern[0] && data[i + length - 1] == pattern[length - 1] &&
+            memcmp(data + i + 1, pattern + 1, length - 2) == 0)
+            return data + i;
+    }
+    return NULL;
+}
+
+/*
+Display filter over the packets of a PacketStore.
+
+The expression uses the capture filter language (see filter_expr.h) plus
+"frame contains" and "payload contains" searches, and is evaluated against
+the PacketInfo the capture worker already filled in, so protocols are
+recognized behind VLAN tags and IPv6 extension headers. Matching packets are
+kept as an index of handles for the packet table. update() only evaluates the
+packets added since the previous call, a new expression or a large backlog
+is split in chunks evaluated on every core.
+*/
+class DisplayFilter
+{
+private:
+    FilterExpr expr;
+    std::string text;
+    std::vector<PacketHandle> handles; // Matching packets in store order
+    size_t evaluated; // Packets of the store already checked
+    unsigned int threads;
+    unsigned long long rangeStart; // Timestamps of the packets shown, rangeEnd 0 shows every time
+    unsigned long long rangeEnd;
+
+    static bool compare(const FilterNode &node, unsigned int value)
+    {
+        value &= node.mask;
+        switch (node.op)
+        {
+        case FilterOp::Eq:
+            return value == node.value;
+        case FilterOp::Ne:
+            return value != node.value;
+        case FilterOp::Lt:
+            return value < node.value;
+        case FilterOp::Le:
+            return value <= node.value;
+        case FilterOp::Gt:
+            return value > node.value;
+        case FilterOp::Ge:
+            return value >= node.value;
+        }
+        return false;
+    }
+
+    static unsigned int read32(const unsigned char *data)
+    {
+        return ((unsigned int)dissectRead16(data) << 16) | dissectRead16(data + 2);
+    }
+
+    // Port at offset 0 (source) or 2 (destination) of the transport header, false if there is none
+    static bool readPort(const Packet &packet, TransportLayer transport, unsigned int offset, unsigned int &port)
+    {
+        const PacketInfo &info = packet.info;
+        if (info.transport != transport || info.transportOffset + 4u > (unsigned int)packet.size)
+            return false;
+        port = dissectRead16(packet.data + info.transportOffset + offset);
+        return true;
+    }
+
+    static bool comparison(const FilterNode &node, const Packet &packet)
+    {
+        // As in the capture filter, "tcp.port != 443" means neither port is 443
+        if (node.op == FilterOp::Ne && (node.field == FilterField::IpAddr || node.field == FilterField::TcpPort ||
+                                        node.field == FilterField::UdpPort))
+        {
+            FilterNode positive = node;
+            positive.op = FilterOp::Eq;
+            return !comparison(positive, packet);
+        }
+
+        const PacketInfo &info = packet.info;
+        const unsigned char *ip = packet.data + info.networkOffset;
+        bool hasIp = info.network == NetworkLayer::IPv4 && info.networkOffset + 20u <= (unsigned int)packet.size;
+        unsigned int port;
+        switch (node.field)
+        {
+        case FilterField::FrameLen:
+            return compare(node, packet.wireLength);
+        case FilterField::EthType:
+            return compare(node, info.etherType);
+        case FilterField::VlanId:
+            return info.vlanCount && compare(node, info.vlanIds[0]);
+        case FilterField::IpSrc:
+            return hasIp && compare(node, read32(ip + 12));
+        case FilterField::IpDst:
+            return hasIp && compare(node, read32(ip + 16));
+        case FilterField::IpAddr:
+            return hasIp && (compare(node, read32(ip + 12)) || compare(node, read32(ip + 16)));
+        case FilterField::IpProto:
+            return hasIp && compare(node, ip[9]);
+        case FilterField::IpTtl:
+            return hasIp && compare(node, ip[8]);
+        case FilterField::IpLen:
+            return hasIp && compare(node, dissectRead16(ip + 2));
+        case FilterField::TcpSrcPort:
+            return readPort(packet, TransportLayer::Tcp, 0, port) && compare(node, port);
+        case FilterField::TcpDstPort:
+            return readPort(packet, TransportLayer::Tcp, 2, port) && compare(node, port);
+        case FilterField::TcpPort:
+            return (readPort(packet, TransportLayer::Tcp, 0, port) && compare(node, port)) ||
+                   (readPort(packet, TransportLayer::Tcp, 2, port) && compare(node, port));
+        case FilterField::UdpSrcPort:
+            return readPort(packet, TransportLayer::Udp, 0, port) && compare(node, port);
+        case FilterField::UdpDstPort:
+            return readPort(packet, TransportLayer::Udp, 2, port) && compare(node, port);
+        case FilterField::UdpPort:
+            return (readPort(packet, TransportLayer::Udp, 0, port) && compare(node, port)) ||
+                   (readPort(packet, TransportLayer::Udp, 2, port) && compare(node, port));
+        case FilterField::Frame:
+        case FilterField::Payload:
+            break; // Only searched
+        }
+        return false;
+    }
+
+    static bool protocol(FilterProtocol protocol, const PacketInfo &info)
+    {
+        bool isIp = info.network == NetworkLayer::IPv4 || info.network == NetworkLayer::IPv6;
+        switch (protocol)
+        {
+        case FilterProtocol::IPv4:
+            return info.network == NetworkLayer::IPv4;
+        case FilterProtocol::IPv6:
+            return info.network == NetworkLayer::IPv6;
+        case FilterProtocol::Arp:
+            return info.network == NetworkLayer::Arp;
+        case FilterProtocol::Tcp:
+            return isIp && info.ipProtocol == IPPROTO_TCP;
+        case FilterProtocol::Udp:
+            return isIp && info.ipProtocol == IPPROTO_UDP;
+        case FilterProtocol::Icmp:
+            return (info.network == NetworkLayer::IPv4 && info.ipProtocol == IPPROTO_ICMP) ||
+                   (info.network == NetworkLayer::IPv6 && info.ipProtocol == IPPROTO_ICMPV6);
+        case FilterProtocol::Vlan:
+            return info.vlanCount > 0;
+        }
+        return false;
+    }
+
+    bool search(const FilterNode &node, const Packet &packet) const
+    {
+        const std::string &pattern = expr.patterns[node.value];
+        unsigned int start = node.field == FilterField::Payload ? packet.info.payloadOffset : 0;
+        if (packet.size <= 0 || start >= (unsigned int)packet.size)
+            return false;
+        return findBytes(packet.data + start, packet.size - start,
+                         reinterpret_cast<const unsigned char *>(pattern.data()), pattern.size()) != NULL;
+    }
+
+    bool evaluate(int index, const Packet &packet) const
+    {
+        const FilterNode &node = expr.nodes[index];
+        switch (node.type)
+        {
+        case FilterNodeType::And:
+            return evaluate(node.left, packet) && evaluate(node.right, packet);
+        case FilterNodeType::Or:
+            return evaluate(node.left, packet) || evaluate(node.right, packet);
+        case FilterNodeType::Not:
+            return !evaluate(node.left, packet);
+        case FilterNodeType::Protocol:
+            return protocol(node.protocol, packet.info);
+        case FilterNodeType::Compare:
+            return comparison(node, packet);
+        case FilterNodeType::Contains:
+            return search(node, packet);
+        }
+        return false;
+    }
+
+    // Spilled segments outside the time range are skipped without reading them back
+    void evaluateRange(const PacketStore &store, size_t first, size_t end, std::vector<PacketHandle> &result) const
+    {
+        store.visit(first, end, [this, &result](PacketHandle handle, const Packet &packet)
+                    {
+                        if (matches(packet))
+                            result.push_back(handle); },
+                    rangeEnd ? rangeStart : 0, rangeEnd ? rangeEnd - 1 : ~0ULL);
+    }
+
+public:
+    // threadCount 0 evaluates large batches on every core
+    explicit DisplayFilter(unsigned int threadCount = 0)
+        : evaluated(0), threads(threadCount ? threadCount : std::thread::hardware_concurrency()), rangeStart(0),
+          rangeEnd(0) {}
+
+    /*
+    Parses expression and starts filtering again from the first packet, an empty expression
+    shows every packet. Returns false and fills error if the expression is invalid, the
+    previous filter then stays in place.
+    */
+    bool setExpression(const std::string &expression, std::string &error)
+    {
+        FilterExpr parsed;
+        FilterParser parser;
+        if (!parser.parse(expression, parsed, error))
+            return false;
+
+        expr = parsed;
+        text = expression;
+        clear();
+        return true;
+    }
+
+    const std::string &getExpression() const { return text; }
+
+    // Also limits the packets shown to timestamps in [start, end), end 0 removes the limit
+    void setTimeRange(unsigned long long start, unsigned long long end)
+    {
+        rangeStart = start;
+        rangeEnd = end;
+        clear();
+    }
+
+    bool hasTimeRange() const { return rangeEnd != 0; }
+
+    // False when every packet is shown, the index is then left empty
+    bool isActive() const { return !expr.empty() || rangeEnd != 0; }
+
+    bool matches(const Packet &packet) const
+    {
+        if (rangeEnd && (packet.timestamp < rangeStart || packet.timestamp >= rangeEnd))
+            return false;
+        return expr.empty() || evaluate(expr.root, packet);
+    }
+
+    // Evaluates the packets added to the store since the last call
+    void update(const PacketStore &store)
+    {
+        size_t first = evaluated;
+        size_t count = store.size();
+        if (!isActive() || count <= first)
+            return;
+        evaluated = count;
+
+        size_t chunks = (count - first + DISPLAY_FILTER_CHUNK - 1) / DISPLAY_FILTER_CHUNK;
+        size_t workers = threads < chunks ? threads : chunks;
+        if (workers <= 1)
+        {
+            evaluateRange(store, first, count, handles);
+            return;
+        }
+
+        // Threads take the next chunk until none is left, the results are joined in store order
+        std::vector<std::vector<PacketHandle>> results(chunks);
+        std::atomic<size_t> next(0);
+        auto work = [this, &store, &results, &next, first, count, chunks]()
+        {
+            for (size_t chunk = next++; chunk < chunks; chunk = next++)
+            {
+                size_t begin = first + chunk * DISPLAY_FILTER_CHUNK;
+                size_t end = begin + DISPLAY_FILTER_CHUNK < count ? begin + DISPLAY_FILTER_CHUNK : count;
+                evaluateRange(store, begin, end, results[chunk]);
+            }
+        };
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < workers; i++)
+            pool.push_back(std::thread(work));
+        work();
+        for (size_t i = 0; i < pool.size(); i++)
+            pool[i].join();
+
+        for (size_t i = 0; i < chunks; i++)
+            handles.insert(handles.end(), results[i].begin(), results[i].end());
+    }
+
+    // Forgets the evaluated packets, for when the store is cleared. The expression and time range are kept
+    void clear()
+    {
+        handles.clear();
+        evaluated = 0;
+    }
+
+    // Matching packets, in store order
+    size_t size() const { return handles.size(); }
+    PacketHandle operator[](size_t index) const { return handles[index]; }
+};
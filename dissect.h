@@ -0,0 +1,231 @@
+#pragma once
+
+#include <cstring>
+
+#define DISSECT_MAX_VLANS 2 // Tags recorded per frame, outer first, deeper tags are skipped
+
+// Flags of PacketInfo
+#define DISSECT_TRUNCATED 0x01 // A header ends past the captured bytes, later layers are missing
+#define DISSECT_FRAGMENT 0x02  // IP fragment, only the first one carries the transport header
+#define DISSECT_IPV6_EXT 0x04  // IPv6 extension headers precede the transport header
+
+enum class NetworkLayer : unsigned char
+{
+    None,
+    IPv4,
+    IPv6,
+    Arp,
+    Other
+};
+
+enum class TransportLayer : unsigned char
+{
+    None,
+    Tcp,
+    Udp,
+    Icmp,
+    Icmpv6,
+    Other
+};
+
+// Set by dissectApplication() in app_layer.h, None until it runs
+enum class ApplicationLayer : unsigned char
+{
+    None,
+    DnsQuery,
+    DnsResponse,
+    HttpRequest,
+    TlsClientHello
+};
+
+/*
+Fixed size description of where each layer of a frame starts.
+
+Filled once per packet by dissect() on the capture worker and carried along
+with the packet, so readers only need bounds that were already checked
+here. Offsets are from the start of the frame, an offset is only meaningful
+if the matching layer is not None.
+*/
+struct PacketInfo
+{
+    unsigned short etherType; // Innermost EtherType, host byte order, 0 for 802.3 length frames
+    unsigned short vlanIds[DISSECT_MAX_VLANS];
+    unsigned char vlanCount;
+    NetworkLayer network;
+    TransportLayer transport;
+    unsigned char ipProtocol; // IPv4 protocol or the last IPv6 next header
+    unsigned short networkOffset;
+    unsigned short transportOffset;
+    unsigned short payloadOffset; // First byte after the last decoded header
+    unsigned char flags;
+    ApplicationLayer application;
+    unsigned int name; // Host or query name interned in a StringPool, 0 for none
+};
+
+inline unsigned short dissectRead16(const unsigned char *data)
+{
+    return (unsigned short)((data[0] << 8) | data[1]);
+}
+
+// Decodes the transport header at offset, returns false if it was cut off
+inline bool dissectTransport(const unsigned char *data, unsigned int size, unsigned int offset, PacketInfo &info)
+{
+    unsigned int length;
+    info.transportOffset = (unsigned short)offset;
+    switch (info.ipProtocol)
+    {
+    case 6:
+        info.transport = TransportLayer::Tcp;
+        if (offset + 20 > size)
+            return false;
+        length = (data[offset + 12] >> 4) * 4;
+        if (length < 20)
+            length = 20;
+        break;
+    case 17:
+        info.transport = TransportLayer::Udp;
+        length = 8;
+        break;
+    case 1:
+        info.transport = TransportLayer::Icmp;
+        length = 8;
+        break;
+    case 58:
+        info.transport = TransportLayer::Icmpv6;
+        length = 8;
+        break;
+    default:
+        info.transport = TransportLayer::Other;
+        length = 0;
+        break;
+    }
+    info.payloadOffset = (unsigned short)(offset + length);
+    return offset + length <= size;
+}
+
+// Walks the IPv6 extension header chain, returns false if it was cut off
+inline bool dissectIpv6(const unsigned char *data, unsigned int size, unsigned int offset, PacketInfo &info)
+{
+    if (offset + 40 > size)
+        return false;
+
+    unsigned int next = data[offset + 6];
+    offset += 40;
+    info.payloadOffset = (unsigned short)offset;
+    while (true)
+    {
+        unsigned int length;
+        if (next == 0 || next == 43 || next == 60) // Hop-by-hop, routing, destination options
+        {
+            if (offset + 8 > size)
+                return false;
+            length = (data[offset + 1] + 1) * 8;
+        }
+        else if (next == 44) // Fragment
+        {
+            if (offset + 8 > size)
+                return false;
+            info.flags |= DISSECT_FRAGMENT;
+            if ((dissectRead16(data + offset + 2) & 0xfff8) != 0)
+            {
+                info.ipProtocol = data[offset];
+                info.payloadOffset = (unsigned short)(offset + 8);
+                return true; // Not the first fragment, no transport header
+            }
+            length = 8;
+        }
+        else if (next == 51) // Authentication header
+        {
+            if (offset + 8 > size)
+                return false;
+            length = (data[offset + 1] + 2) * 4;
+        }
+        else
+            break;
+
+        info.flags |= DISSECT_IPV6_EXT;
+        next = data[offset];
+        offset += length;
+        info.payloadOffset = (unsigned short)offset;
+        if (offset > size)
+            return false;
+    }
+
+    info.ipProtocol = (unsigned char)next;
+    if (next == 59) // No next header
+        return true;
+    return dissectTransport(data, size, offset, info);
+}
+
+// Fills info with the layers of an Ethernet frame
+inline void dissect(const unsigned char *data, unsigned int size, PacketInfo &info)
+{
+    memset(&info, 0, sizeof(info));
+    if (size < 14)
+    {
+        info.flags = DISSECT_TRUNCATED;
+        return;
+    }
+
+    unsigned int offset = 12;
+    unsigned int type = dissectRead16(data + offset);
+    while (type == 0x8100 || type == 0x88a8 || type == 0x9100) // 802.1Q, 802.1ad and the old QinQ type
+    {
+        if (offset + 6 > size)
+        {
+            info.flags = DISSECT_TRUNCATED;
+            return;
+        }
+        if (info.vlanCount < DISSECT_MAX_VLANS)
+            info.vlanIds[info.vlanCount++] = dissectRead16(data + offset + 2) & 0x0fff;
+        offset += 4;
+        type = dissectRead16(data + offset);
+    }
+    offset += 2;
+    info.payloadOffset = (unsigned short)offset;
+    if (type < 0x0600)
+        return; // 802.3 length field
+
+    info.etherType = (unsigned short)type;
+    info.networkOffset = (unsigned short)offset;
+    bool complete = true;
+    switch (type)
+    {
+    case 0x0800:
+    {
+        info.network = NetworkLayer::IPv4;
+        if (offset + 20 > size)
+        {
+            complete = false;
+            break;
+        }
+        unsigned int headerLength = (data[offset] & 0x0f) * 4;
+        if (headerLength < 20)
+            headerLength = 20;
+        unsigned int fragment = dissectRead16(data + offset + 6);
+        info.ipProtocol = data[offset + 9];
+        info.payloadOffset = (unsigned short)(offset + headerLength);
+        if (fragment & 0x3fff)
+            info.flags |= DISSECT_FRAGMENT;
+        if (offset + headerLength > size)
+            complete = false;
+        else if ((fragment & 0x1fff) == 0)
+            complete = dissectTransport(data, size, offset + headerLength, info);
+        break;
+    }
+    case 0x86dd:
+        info.network = NetworkLayer::IPv6;
+        complete = dissectIpv6(data, size, offset, info);
+        break;
+    case 0x0806:
+        info.network = NetworkLayer::Arp;
+        complete = offset + 28 <= size;
+        info.payloadOffset = (unsigned short)(offset + 28);
+        break;
+    default:
+        info.network = NetworkLayer::Other;
+        break;
+    }
+    if (!complete)
+        info.flags |= DISSECT_TRUNCATED;
+}
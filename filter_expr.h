@@ -0,0 +1,406 @@
+#pragma once
+
+#include <arpa/inet.h>
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/*
+Filter expression language shared by the capture filter compiler and the
+display filter.
+
+    expr       := or
+    or         := and ( "||" and )*
+    and        := unary ( "&&" unary )*
+    unary      := "!" unary | "(" expr ")" | protocol | comparison | search
+    protocol   := ip | ip6 | arp | tcp | udp | icmp | vlan
+    comparison := field op value
+    op         := == | != | < | <= | > | >=
+    value      := number | 0xhex | a.b.c.d[/prefix]
+    search     := ( frame | payload ) contains ( "text" | hex:hex:... )
+
+Example: ip.src == 10.0.0.0/8 && tcp.port == 443
+Searches only work in display filters, the capture filter compiler rejects them.
+*/
+
+enum class FilterNodeType
+{
+    And,
+    Or,
+    Not,
+    Protocol,
+    Compare,
+    Contains
+};
+
+enum class FilterProtocol
+{
+    IPv4,
+    IPv6,
+    Arp,
+    Tcp,
+    Udp,
+    Icmp,
+    Vlan
+};
+
+enum class FilterField
+{
+    FrameLen,
+    EthType,
+    VlanId,
+    IpSrc,
+    IpDst,
+    IpAddr, // Either address
+    IpProto,
+    IpTtl,
+    IpLen,
+    TcpSrcPort,
+    TcpDstPort,
+    TcpPort, // Either port
+    UdpSrcPort,
+    UdpDstPort,
+    UdpPort, // Either port
+    Frame,   // Searched by Contains only
+    Payload
+};
+
+enum class FilterOp
+{
+    Eq,
+    Ne,
+    Lt,
+    Le,
+    Gt,
+    Ge
+};
+
+struct FilterNode
+{
+    FilterNodeType type;
+    int left;  // Child of Not, left operand of And/Or
+    int right; // Right operand of And/Or
+    FilterProtocol protocol;
+    FilterField field;
+    FilterOp op;
+    unsigned int value; // Host byte order, already masked. Index in FilterExpr::patterns for Contains
+    unsigned int mask;  // Prefix mask for addresses, all ones otherwise
+};
+
+// Parsed expression, nodes refer to each other by index. An empty expression has root -1 and matches everything
+struct FilterExpr
+{
+    std::vector<FilterNode> nodes;
+    std::vector<std::string> patterns; // Byte strings searched by Contains nodes
+    int root;
+
+    FilterExpr() : root(-1) {}
+
+    bool empty() const { return root < 0; }
+};
+
+class FilterParser
+{
+private:
+    std::string text;
+    size_t pos;
+    std::string error;
+    FilterExpr *expr;
+
+    void skipSpaces()
+    {
+        while (pos < text.size() && isspace((unsigned char)text[pos]))
+            pos++;
+    }
+
+    bool accept(const char *token)
+    {
+        skipSpaces();
+        size_t len = strlen(token);
+        if (text.compare(pos, len, token) != 0)
+            return false;
+        pos += len;
+        return true;
+    }
+
+    std::string word()
+    {
+        skipSpaces();
+        size_t start = pos;
+        while (pos < text.size() && (isalnum((unsigned char)text[pos]) || text[pos] == '.' || text[pos] == '_' ||
+                                     text[pos] == '/'))
+            pos++;
+        return text.substr(start, pos - start);
+    }
+
+    int fail(const std::string &message)
+    {
+        if (error.empty())
+            error = message + " at position " + std::to_string(pos);
+        return -1;
+    }
+
+    int add(const FilterNode &node)
+    {
+        expr->nodes.push_back(node);
+        return (int)expr->nodes.size() - 1;
+    }
+
+    static FilterNode makeNode(FilterNodeType type)
+    {
+        FilterNode node;
+        node.type = type;
+        node.left = node.right = -1;
+        node.protocol = FilterProtocol::IPv4;
+        node.field = FilterField::FrameLen;
+        node.op = FilterOp::Eq;
+        node.value = 0;
+        node.mask = 0xffffffff;
+        return node;
+    }
+
+    static bool lookupProtocol(const std::string &name, FilterProtocol &protocol)
+    {
+        static const struct
+        {
+            const char *name;
+            FilterProtocol protocol;
+        } protocols[] = {{"ip", FilterProtocol::IPv4}, {"ip6", FilterProtocol::IPv6}, {"arp", FilterProtocol::Arp},
+                         {"tcp", FilterProtocol::Tcp}, {"udp", FilterProtocol::Udp}, {"icmp", FilterProtocol::Icmp},
+                         {"vlan", FilterProtocol::Vlan}};
+        for (size_t i = 0; i < sizeof(protocols) / sizeof(protocols[0]); i++)
+        {
+            if (name == protocols[i].name)
+            {
+                protocol = protocols[i].protocol;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool lookupField(const std::string &name, FilterField &field)
+    {
+        static const struct
+        {
+            const char *name;
+            FilterField field;
+        } fields[] = {{"frame.len", FilterField::FrameLen}, {"eth.type", FilterField::EthType},
+                      {"vlan.id", FilterField::VlanId}, {"ip.src", FilterField::IpSrc},
+                      {"ip.dst", FilterField::IpDst}, {"ip.addr", FilterField::IpAddr},
+                      {"ip.proto", FilterField::IpProto}, {"ip.ttl", FilterField::IpTtl},
+                      {"ip.len", FilterField::IpLen}, {"tcp.srcport", FilterField::TcpSrcPort},
+                      {"tcp.dstport", FilterField::TcpDstPort}, {"tcp.port", FilterField::TcpPort},
+                      {"udp.srcport", FilterField::UdpSrcPort}, {"udp.dstport", FilterField::UdpDstPort},
+                      {"udp.port", FilterField::UdpPort}};
+        for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+        {
+            if (name == fields[i].name)
+            {
+                field = fields[i].field;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool isAddressField(FilterField field)
+    {
+        return field == FilterField::IpSrc || field == FilterField::IpDst || field == FilterField::IpAddr;
+    }
+
+    bool parseValue(FilterNode &node)
+    {
+        std::string value = word();
+        if (value.empty())
+            return false;
+
+        if (isAddressField(node.field))
+        {
+            std::string address = value;
+            int prefix = 32;
+            size_t slash = value.find('/');
+            if (slash != std::string::npos)
+            {
+                address = value.substr(0, slash);
+                char *end;
+                prefix = (int)strtol(value.c_str() + slash + 1, &end, 10);
+                if (*end || prefix < 0 || prefix > 32)
+                    return false;
+            }
+
+            struct in_addr addr;
+            if (inet_pton(AF_INET, address.c_str(), &addr) != 1)
+                return false;
+            node.mask = prefix == 0 ? 0 : 0xffffffffu << (32 - prefix);
+            node.value = ntohl(addr.s_addr) & node.mask;
+            return true;
+        }
+
+        if (value.find('/') != std::string::npos)
+            return false;
+        char *end;
+        unsigned long number = strtoul(value.c_str(), &end, 0);
+        if (*end || number > 0xffffffffUL)
+            return false;
+        node.value = (unsigned int)number;
+        return true;
+    }
+
+    // Reads a quoted string, where a backslash escapes the next character, or colon separated hex bytes
+    bool parsePattern(std::string &pattern)
+    {
+        skipSpaces();
+        if (pos < text.size() && text[pos] == '"')
+        {
+            for (pos++; pos < text.size() && text[pos] != '"'; pos++)
+            {
+                if (text[pos] == '\\' && pos + 1 < text.size())
+                    pos++;
+                pattern += text[pos];
+            }
+            if (pos == text.size())
+                return false;
+            pos++;
+            return !pattern.empty();
+        }
+
+        while (pos + 1 < text.size() && isxdigit((unsigned char)text[pos]) && isxdigit((unsigned char)text[pos + 1]))
+        {
+            pattern += (char)strtol(text.substr(pos, 2).c_str(), NULL, 16);
+            pos += 2;
+            if (pos + 2 < text.size() && text[pos] == ':' && isxdigit((unsigned char)text[pos + 1]))
+                pos++;
+            else
+                break;
+        }
+        return !pattern.empty();
+    }
+
+    int parsePrimary()
+    {
+        if (accept("("))
+        {
+            int inner = parseOr();
+            if (inner < 0)
+                return -1;
+            if (!accept(")"))
+                return fail("Expected ')'");
+            return inner;
+        }
+
+        std::string name = word();
+        if (name.empty())
+            return fail("Expected a field or protocol");
+
+        if (name == "frame" || name == "payload")
+        {
+            FilterNode node = makeNode(FilterNodeType::Contains);
+            node.field = name == "frame" ? FilterField::Frame : FilterField::Payload;
+            std::string pattern;
+            if (!accept("contains"))
+                return fail("Expected 'contains' after '" + name + "'");
+            if (!parsePattern(pattern))
+                return fail("Expected a quoted string or hex bytes after 'contains'");
+            node.value = (unsigned int)expr->patterns.size();
+            expr->patterns.push_back(pattern);
+            return add(node);
+        }
+
+        FilterNode node = makeNode(FilterNodeType::Compare);
+        if (!lookupField(name, node.field))
+        {
+            node.type = FilterNodeType::Protocol;
+            if (!lookupProtocol(name, node.protocol))
+                return fail("Unknown field '" + name + "'");
+            return add(node);
+        }
+
+        if (accept("=="))
+            node.op = FilterOp::Eq;
+        else if (accept("!="))
+            node.op = FilterOp::Ne;
+        else if (accept("<="))
+            node.op = FilterOp::Le;
+        else if (accept(">="))
+            node.op = FilterOp::Ge;
+        else if (accept("<"))
+            node.op = FilterOp::Lt;
+        else if (accept(">"))
+            node.op = FilterOp::Gt;
+        else
+            return fail("Expected a comparison after '" + name + "'");
+
+        if (isAddressField(node.field) && node.op != FilterOp::Eq && node.op != FilterOp::Ne)
+            return fail("Addresses only support == and !=");
+        if (!parseValue(node))
+            return fail("Invalid value for '" + name + "'");
+        return add(node);
+    }
+
+    int parseUnary()
+    {
+        skipSpaces();
+        if (pos < text.size() && text[pos] == '!' && text.compare(pos, 2, "!=") != 0)
+        {
+            pos++;
+            int child = parseUnary();
+            if (child < 0)
+                return -1;
+            FilterNode node = makeNode(FilterNodeType::Not);
+            node.left = child;
+            return add(node);
+        }
+        return parsePrimary();
+    }
+
+    int parseBinary(FilterNodeType type, const char *token)
+    {
+        int left = type == FilterNodeType::Or ? parseBinary(FilterNodeType::And, "&&") : parseUnary();
+        while (left >= 0 && accept(token))
+        {
+            int right = type == FilterNodeType::Or ? parseBinary(FilterNodeType::And, "&&") : parseUnary();
+            if (right < 0)
+                return -1;
+            FilterNode node = makeNode(type);
+            node.left = left;
+            node.right = right;
+            left = add(node);
+        }
+        return left;
+    }
+
+    int parseOr() { return parseBinary(FilterNodeType::Or, "||"); }
+
+public:
+    // Parses text into result, returns false and fills message on syntax errors
+    bool parse(const std::string &source, FilterExpr &result, std::string &message)
+    {
+        text = source;
+        pos = 0;
+        error.clear();
+        result = FilterExpr();
+        expr = &result;
+
+        skipSpaces();
+        if (pos == text.size())
+            return true;
+
+        int root = parseOr();
+        skipSpaces();
+        if (root >= 0 && pos != text.size())
+            root = fail("Unexpected input");
+        if (root < 0)
+        {
+            message = error;
+            result = FilterExpr();
+            return false;
+        }
+
+        result.root = root;
+        return true;
+    }
+};
@@ -0,0 +1,927 @@
+#include "app_layer.h"
+#include "bpf_filter.h"
+#include "dissect.h"
+#include "display_filter.h"
+#include "hexdump.h"
+#include "lz_codec.h"
+#include "packet_store.h"
+#include "packet_summary.h"
+#include "pipeline.h"
+#include "tcp_reassembly.h"
+#include "timeline.h"
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+/*
+Used for testing the capture filter compiler and the dissector, runs without
+privileges. The compiled programs are executed by a small classic BPF
+interpreter against synthetic frames.
+*/
+
+struct Frame {
+  std::vector<unsigned char> bytes;
+  bool vlanOffloaded; // Tag delivered as ancillary data instead of in band
+  unsigned int vlanTag;
+};
+
+static unsigned int load(const Frame &frame, unsigned int offset, int size, bool &ok) {
+  if (offset >= (unsigned int)SKF_AD_OFF) {
+    if (offset == (unsigned int)(SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT))
+      return frame.vlanOffloaded;
+    if (offset == (unsigned int)(SKF_AD_OFF + SKF_AD_VLAN_TAG))
+      return frame.vlanTag;
+    ok = false;
+    return 0;
+  }
+  if (offset + size > frame.bytes.size()) {
+    ok = false; // The kernel rejects the packet on out of bounds loads
+    return 0;
+  }
+  unsigned int value = 0;
+  for (int i = 0; i < size; i++)
+    value = (value << 8) | frame.bytes[offset + i];
+  return value;
+}
+
+// Returns the number of bytes the program keeps, 0 when the packet is rejected
+static unsigned int run(const std::vector<struct sock_filter> &program, const Frame &frame) {
+  unsigned int a = 0, x = 0;
+  bool ok = true;
+  for (size_t pc = 0; pc < program.size(); pc++) {
+    const struct sock_filter &insn = program[pc];
+    int size = BPF_SIZE(insn.code) == BPF_W ? 4 : BPF_SIZE(insn.code) == BPF_H ? 2 : 1;
+    switch (BPF_CLASS(insn.code)) {
+    case BPF_LD:
+      if (BPF_MODE(insn.code) == BPF_ABS)
+        a = load(frame, insn.k, size, ok);
+      else if (BPF_MODE(insn.code) == BPF_IND)
+        a = load(frame, x + insn.k, size, ok);
+      else if (BPF_MODE(insn.code) == BPF_LEN)
+        a = frame.bytes.size();
+      else if (BPF_MODE(insn.code) == BPF_IMM)
+        a = insn.k;
+      else
+        assert(!"unsupported load");
+      break;
+    case BPF_LDX:
+      if (BPF_MODE(insn.code) == BPF_MSH)
+        x = (load(frame, insn.k, 1, ok) & 0xf) * 4;
+      else if (BPF_MODE(insn.code) == BPF_IMM)
+        x = insn.k;
+      else
+        assert(!"unsupported ldx");
+      break;
+    case BPF_ALU: {
+      unsigned int operand = BPF_SRC(insn.code) == BPF_X ? x : insn.k;
+      switch (BPF_OP(insn.code)) {
+      case BPF_AND: a &= operand; break;
+      case BPF_ADD: a += operand; break;
+      case BPF_SUB: a -= operand; break;
+      case BPF_MUL: a *= operand; break;
+      case BPF_RSH: a >>= operand; break;
+      case BPF_LSH: a <<= operand; break;
+      default: assert(!"unsupported alu");
+      }
+      break;
+    }
+    case BPF_MISC:
+      if (BPF_MISCOP(insn.code) == BPF_TAX)
+        x = a;
+      else
+        a = x;
+      break;
+    case BPF_JMP: {
+      bool taken = false;
+      switch (BPF_OP(insn.code)) {
+      case BPF_JA: pc += insn.k; continue;
+      case BPF_JEQ: taken = a == insn.k; break;
+      case BPF_JGT: taken = a > insn.k; break;
+      case BPF_JGE: taken = a >= insn.k; break;
+      case BPF_JSET: taken = (a & insn.k) != 0; break;
+      default: assert(!"unsupported jump");
+      }
+      pc += taken ? insn.jt : insn.jf;
+      break;
+    }
+    case BPF_RET:
+      return BPF_RVAL(insn.code) == BPF_A ? a : insn.k;
+    default:
+      assert(!"unsupported instruction");
+    }
+    if (!ok)
+      return 0;
+  }
+  assert(!"program fell off the end");
+  return 0;
+}
+
+static void put16(std::vector<unsigned char> &b, unsigned int v) {
+  b.push_back(v >> 8);
+  b.push_back(v & 0xff);
+}
+
+static void put32(std::vector<unsigned char> &b, unsigned int v) {
+  put16(b, v >> 16);
+  put16(b, v & 0xffff);
+}
+
+static void ethernet(Frame &frame, unsigned int type, int vlan = -1) {
+  frame.bytes.assign(12, 0x02); // Locally administered MACs
+  frame.vlanOffloaded = false;
+  frame.vlanTag = 0;
+  if (vlan >= 0) {
+    put16(frame.bytes, ETH_P_8021Q);
+    put16(frame.bytes, vlan);
+  }
+  put16(frame.bytes, type);
+}
+
+// Ethernet + IPv4 + TCP or UDP header + payload
+static Frame ipv4Frame(unsigned int protocol, unsigned int src, unsigned int dst, unsigned int sport,
+                       unsigned int dport, int payload = 10, unsigned int fragment = 0, int options = 0) {
+  Frame frame;
+  ethernet(frame, ETH_P_IP);
+  std::vector<unsigned char> &b = frame.bytes;
+  unsigned int l4 = protocol == IPPROTO_TCP ? 20 : 8;
+  b.push_back(0x45 + options);
+  b.push_back(0);
+  put16(b, 20 + options * 4 + l4 + payload);
+  put16(b, 1);
+  put16(b, fragment);
+  b.push_back(64);
+  b.push_back(protocol);
+  put16(b, 0);
+  put32(b, src);
+  put32(b, dst);
+  for (int i = 0; i < options * 4; i++)
+    b.push_back(1); // NOP options
+  put16(b, sport);
+  put16(b, dport);
+  b.resize(b.size() + l4 - 4, 0);
+  b.resize(b.size() + payload, 'p');
+  return frame;
+}
+
+static Frame ipv6Frame(unsigned int protocol, unsigned int sport, unsigned int dport) {
+  Frame frame;
+  ethernet(frame, ETH_P_IPV6);
+  std::vector<unsigned char> &b = frame.bytes;
+  put32(b, 0x60000000);
+  put16(b, 8);
+  b.push_back(protocol);
+  b.push_back(64);
+  b.resize(b.size() + 32, 0x20);
+  put16(b, sport);
+  put16(b, dport);
+  put32(b, 0);
+  return frame;
+}
+
+static Frame arpFrame() {
+  Frame frame;
+  ethernet(frame, ETH_P_ARP);
+  frame.bytes.resize(42, 0);
+  return frame;
+}
+
+static Packet dissected(const Frame &frame) {
+  Packet packet;
+  packet.data = frame.bytes.data();
+  packet.size = frame.bytes.size();
+  packet.wireLength = frame.bytes.size();
+  dissect(packet.data, packet.size, packet.info);
+  return packet;
+}
+
+static bool displayed(const std::string &expression, const Frame &frame) {
+  DisplayFilter filter;
+  std::string error;
+  bool parsed = filter.setExpression(expression, error);
+  assert(parsed);
+  return filter.matches(dissected(frame));
+}
+
+// Also checks that the display filter agrees with the kernel program, except for offloaded tags it cannot see
+static bool matches(const std::string &expression, const Frame &frame) {
+  BpfCompiler compiler;
+  std::vector<struct sock_filter> program;
+  std::string error;
+  bool compiled = compiler.compile(expression, program, error);
+  if (!compiled)
+    std::cerr << expression << ": " << error << std::endl;
+  assert(compiled);
+  bool accepted = run(program, frame) != 0;
+  assert(frame.vlanOffloaded || displayed(expression, frame) == accepted);
+  return accepted;
+}
+
+// IPv4 TCP segment carrying text, from local:51000 to remote:443 or back
+static Frame tcpSegment(bool fromClient, unsigned int seq, unsigned char flags, const std::string &text) {
+  const unsigned int client = 0x0a010203, server = 0xc0a80001;
+  Frame frame = fromClient ? ipv4Frame(IPPROTO_TCP, client, server, 51000, 443, text.size())
+                           : ipv4Frame(IPPROTO_TCP, server, client, 443, 51000, text.size());
+  std::vector<unsigned char> &b = frame.bytes;
+  for (int i = 0; i < 4; i++)
+    b[38 + i] = (unsigned char)(seq >> (24 - 8 * i));
+  b[46] = 0x50; // 20 byte header
+  b[47] = flags;
+  std::copy(text.begin(), text.end(), b.begin() + 54);
+  return frame;
+}
+
+static std::string streamText(const TcpStream &stream, int direction) {
+  const std::vector<unsigned char> &data = stream.directions[direction].data;
+  return std::string(data.begin(), data.end());
+}
+
+// Frame carrying payload after an IPv4 and TCP or UDP header
+static Frame payloadFrame(unsigned int protocol, unsigned int sport, unsigned int dport, const std::string &payload) {
+  Frame frame = ipv4Frame(protocol, 0x0a000001, 0x0a000002, sport, dport, payload.size());
+  frame.bytes.resize(frame.bytes.size() - payload.size());
+  frame.bytes.insert(frame.bytes.end(), payload.begin(), payload.end());
+  return frame;
+}
+
+static std::string named(StringPool &names, const Frame &frame, ApplicationLayer &application) {
+  Packet packet = dissected(frame);
+  dissectApplication(packet, names);
+  application = packet.info.application;
+  const char *name = names.lookup(packet.info.name);
+  return name ? name : "";
+}
+
+static bool rejected(const std::string &expression) {
+  BpfCompiler compiler;
+  std::vector<struct sock_filter> program;
+  std::string error;
+  return !compiler.compile(expression, program, error) && !error.empty();
+}
+
+int main() {
+  const unsigned int local = 0x0a010203;  // 10.1.2.3
+  const unsigned int remote = 0xc0a80001; // 192.168.0.1
+  Frame https = ipv4Frame(IPPROTO_TCP, local, remote, 51000, 443);
+  Frame dns = ipv4Frame(IPPROTO_UDP, remote, local, 53, 40000);
+  Frame fragment = ipv4Frame(IPPROTO_TCP, local, remote, 51000, 443, 10, 0x00b9); // Offset 185, no transport header
+  Frame withOptions = ipv4Frame(IPPROTO_TCP, local, remote, 51000, 443, 10, 0, 2);
+  Frame https6 = ipv6Frame(IPPROTO_TCP, 51000, 443);
+  Frame arp = arpFrame();
+
+  // Empty filter accepts everything with the full snaplen
+  {
+    BpfCompiler compiler;
+    std::vector<struct sock_filter> program;
+    std::string error;
+    assert(compiler.compile("", program, error));
+    assert(run(program, arp) == BPF_SNAPLEN);
+  }
+
+  // Protocols
+  assert(matches("ip", https));
+  assert(!matches("ip", https6));
+  assert(matches("ip6", https6));
+  assert(matches("arp", arp) && !matches("arp", dns));
+  assert(matches("tcp", https) && matches("tcp", https6) && !matches("tcp", dns));
+  assert(matches("udp", dns) && !matches("udp", arp));
+  assert(!matches("icmp", https));
+
+  // Addresses and prefixes
+  assert(matches("ip.src == 10.0.0.0/8", https));
+  assert(!matches("ip.src == 10.0.0.0/8", dns));
+  assert(matches("ip.dst == 10.1.2.3", dns));
+  assert(matches("ip.addr == 192.168.0.0/16", https) && matches("ip.addr == 192.168.0.0/16", dns));
+  assert(!matches("ip.addr != 192.168.0.1", https));
+  assert(matches("ip.src != 192.168.0.1", https));
+  assert(!matches("ip.src == 10.0.0.0/8", arp)); // Missing fields never match
+  assert(matches("ip.src == 0.0.0.0/0", https));
+
+  // Ports, with IPv4 options shifting the transport header
+  assert(matches("tcp.port == 443", https) && matches("tcp.port == 443", https6));
+  assert(matches("tcp.dstport == 443", withOptions));
+  assert(!matches("tcp.srcport == 443", https));
+  assert(!matches("udp.port == 443", https));
+  assert(matches("udp.srcport == 53", dns) && matches("udp.port == 40000", dns));
+  assert(!matches("tcp.port == 443", fragment));
+  assert(matches("tcp.dstport >= 443 && tcp.dstport <= 443", https));
+  assert(matches("tcp.srcport > 50000 && tcp.dstport < 1024", https));
+  assert(!matches("tcp.port != 443", https) && matches("tcp.port != 80", https));
+
+  // Other fields
+  assert(matches("ip.proto == 17", dns));
+  assert(matches("ip.ttl == 64", dns));
+  assert(matches("eth.type == 0x0806", arp));
+  assert(matches("frame.len == 42", arp) && matches("frame.len > 41", arp) && !matches("frame.len < 42", arp));
+
+  // Boolean operators and precedence
+  assert(matches("ip.src == 10.0.0.0/8 && tcp.port == 443", https));
+  assert(matches("ip.src == 10.0.0.0/8 && tcp.port == 443", withOptions));
+  assert(matches("udp || arp", arp) && matches("udp || arp", dns) && !matches("udp || arp", https));
+  assert(matches("!tcp", dns) && !matches("!tcp", https));
+  assert(matches("arp || tcp && tcp.port == 443", arp));
+  assert(!matches("(arp || tcp) && tcp.port == 443", arp));
+  assert(matches("!(udp || arp) && frame.len > 40", https));
+
+  // VLAN tags, in band and offloaded to ancillary data
+  {
+    Frame tagged;
+    ethernet(tagged, ETH_P_IP, 100);
+    assert(matches("vlan", tagged) && matches("vlan.id == 100", tagged) && !matches("vlan.id == 101", tagged));
+    Frame offloaded = https;
+    offloaded.vlanOffloaded = true;
+    offloaded.vlanTag = 0x2000 | 42; // Priority bits are masked off
+    assert(matches("vlan && vlan.id == 42", offloaded));
+    assert(!matches("vlan", https));
+  }
+
+  // Syntax errors
+  assert(rejected("tcp.port =="));
+  assert(rejected("tcp.port = 443"));
+  assert(rejected("ip.src == 10.0.0.0/33"));
+  assert(rejected("ip.src > 10.0.0.1"));
+  assert(rejected("foo"));
+  assert(rejected("(tcp"));
+  assert(rejected("tcp udp"));
+
+  // Dissector offsets
+  {
+    PacketInfo info;
+    dissect(https.bytes.data(), https.bytes.size(), info);
+    assert(info.etherType == ETH_P_IP && info.network == NetworkLayer::IPv4 && info.networkOffset == 14);
+    assert(info.transport == TransportLayer::Tcp && info.transportOffset == 34 && info.payloadOffset == 54);
+    assert(info.ipProtocol == IPPROTO_TCP && info.flags == 0);
+
+    dissect(withOptions.bytes.data(), withOptions.bytes.size(), info);
+    assert(info.transportOffset == 42 && info.payloadOffset == 62);
+
+    dissect(dns.bytes.data(), dns.bytes.size(), info);
+    assert(info.transport == TransportLayer::Udp && info.payloadOffset == 42);
+
+    dissect(fragment.bytes.data(), fragment.bytes.size(), info);
+    assert((info.flags & DISSECT_FRAGMENT) && info.transport == TransportLayer::None);
+
+    dissect(https6.bytes.data(), https6.bytes.size(), info);
+    assert(info.network == NetworkLayer::IPv6 && info.transport == TransportLayer::Tcp);
+    assert(info.transportOffset == 54 && (info.flags & DISSECT_TRUNCATED)); // Only the ports were built
+
+    dissect(arp.bytes.data(), arp.bytes.size(), info);
+    assert(info.network == NetworkLayer::Arp && info.transport == TransportLayer::None && info.flags == 0);
+
+    dissect(https.bytes.data(), 40, info); // Cut inside the TCP header
+    assert(info.transport == TransportLayer::Tcp && (info.flags & DISSECT_TRUNCATED));
+    dissect(https.bytes.data(), 10, info);
+    assert(info.network == NetworkLayer::None && (info.flags & DISSECT_TRUNCATED));
+
+    // QinQ with an IPv6 hop-by-hop header in front of UDP
+    Frame qinq;
+    ethernet(qinq, ETH_P_8021Q, 100);
+    qinq.bytes[12] = 0x88;
+    qinq.bytes[13] = 0xa8;
+    put16(qinq.bytes, 200);
+    put16(qinq.bytes, ETH_P_IPV6);
+    put32(qinq.bytes, 0x60000000);
+    put16(qinq.bytes, 16);
+    qinq.bytes.push_back(0); // Hop-by-hop
+    qinq.bytes.push_back(64);
+    qinq.bytes.resize(qinq.bytes.size() + 32, 0x20);
+    qinq.bytes.push_back(IPPROTO_UDP);
+    qinq.bytes.resize(qinq.bytes.size() + 7, 0);
+    put16(qinq.bytes, 53);
+    put16(qinq.bytes, 40000);
+    put32(qinq.bytes, 0);
+    dissect(qinq.bytes.data(), qinq.bytes.size(), info);
+    assert(info.vlanCount == 2 && info.vlanIds[0] == 100 && info.vlanIds[1] == 200);
+    assert(info.etherType == ETH_P_IPV6 && info.networkOffset == 22);
+    assert((info.flags & DISSECT_IPV6_EXT) && info.transport == TransportLayer::Udp);
+    assert(info.transportOffset == 70 && info.payloadOffset == 78 && info.flags == DISSECT_IPV6_EXT);
+  }
+
+  // Snaplen and headers only truncation, in the kernel program and in the store
+  {
+    Frame tcp = https;
+    tcp.bytes[14 + 20 + 12] = 0x50; // Data offset of 5 words
+    Frame tcpOptions = withOptions;
+    tcpOptions.bytes[14 + 28 + 12] = 0x80; // 8 words, 12 bytes of TCP options
+    tcpOptions.bytes.resize(tcpOptions.bytes.size() + 12, 0);
+    Frame shortTcp = https;
+    shortTcp.bytes.resize(14 + 20 + 10); // Ends before the data offset byte
+
+    BpfCompiler compiler;
+    std::vector<struct sock_filter> program;
+    std::string error;
+    assert(compiler.compile("", program, error, 96));
+    assert(run(program, tcp) == 96);
+
+    assert(compiler.compile("", program, error, BPF_SNAPLEN, true));
+    assert(run(program, tcp) == 54);
+    assert(run(program, tcpOptions) == 14 + 28 + 32);
+    assert(run(program, dns) == 42);
+    assert(run(program, shortTcp) == 34);
+    assert(run(program, https6) == BPF_HEADERS_SNAPLEN && run(program, arp) == BPF_HEADERS_SNAPLEN);
+
+    assert(compiler.compile("", program, error, 40, true));
+    assert(run(program, tcp) == 40 && run(program, https6) == 40);
+    assert(compiler.compile("udp", program, error, BPF_SNAPLEN, true));
+    assert(run(program, tcp) == 0 && run(program, dns) == 42);
+
+    PacketStore store;
+    store.setSnaplen(0, true);
+    assert(store.add(tcp.bytes.data(), tcp.bytes.size()));
+    assert(store[0].size == 54 && store[0].wireLength == tcp.bytes.size());
+    store.setSnaplen(20);
+    assert(store.add(https6.bytes.data(), https6.bytes.size()));
+    assert(store[1].size == 20 && store[1].wireLength == https6.bytes.size());
+  }
+
+  // Display filter searches, layers behind VLAN tags and incremental evaluation
+  {
+    const unsigned char text[] = "GET /index.html HTTP/1.1";
+    const unsigned char *get = reinterpret_cast<const unsigned char *>("GET");
+    assert(findBytes(text, 24, reinterpret_cast<const unsigned char *>("HTTP/1.1"), 8) == text + 16);
+    assert(findBytes(text, 24, get, 3) == text && findBytes(text + 1, 23, get, 3) == NULL);
+    assert(findBytes(text, 24, reinterpret_cast<const unsigned char *>("1.2"), 3) == NULL);
+
+    Frame tagged = ipv4Frame(IPPROTO_TCP, local, remote, 51000, 443);
+    tagged.bytes.insert(tagged.bytes.begin() + 12, {0x81, 0x00, 0x00, 0x64});
+    assert(displayed("tcp.port == 443 && vlan.id == 100", tagged)); // The kernel program only sees untagged layers
+    assert(displayed("payload contains \"pppp\"", https) && !displayed("payload contains 70:70:00", https));
+    assert(displayed("frame contains 01:bb", https) && !displayed("payload contains 01:bb", https));
+    assert(rejected("frame contains \"x\"") && rejected("payload contains") && rejected("frame == 1"));
+
+    PacketStore store;
+    for (int i = 0; i < 3 * DISPLAY_FILTER_CHUNK + 5; i++) {
+      const Frame &frame = i % 3 ? dns : https;
+      store.add(frame.bytes.data(), frame.bytes.size());
+    }
+    DisplayFilter filter(4);
+    std::string error;
+    assert(filter.setExpression("udp.srcport == 53", error));
+    filter.update(store);
+    assert(filter.size() == 2 * DISPLAY_FILTER_CHUNK + 3 && filter[0] == 1 && filter[1] == 2 && filter[2] == 4);
+    for (size_t i = 1; i < filter.size(); i++)
+      assert(filter[i] > filter[i - 1]);
+    store.add(dns.bytes.data(), dns.bytes.size());
+    filter.update(store);
+    assert(filter.size() == 2 * DISPLAY_FILTER_CHUNK + 4 && filter[filter.size() - 1] == store.size() - 1);
+    assert(!filter.setExpression("udp.port ==", error) && filter.getExpression() == "udp.srcport == 53");
+  }
+
+  // Flow table: deletion inside a wrapped probe run, idle and active expiry, the top flows heap
+  {
+    // UDP frames from port 1024 on, sorted by the home slot of their flow in an 8 slot table
+    std::vector<Frame> byHome[8];
+    for (unsigned int port = 1024; port < 2048; port++) {
+      Frame frame = ipv4Frame(IPPROTO_UDP, 0x0a000001, 0x0a000002, port, 53);
+      FlowKey key;
+      assert(FlowTable::makeKey(dissected(frame), key));
+      byHome[FlowTable::hashKey(key) & 7].push_back(frame);
+    }
+    assert(byHome[7].size() >= 2 && byHome[0].size() >= 1);
+    auto packetAt = [](const Frame &frame, unsigned long long timestamp) {
+      Packet packet = dissected(frame);
+      packet.timestamp = timestamp;
+      return packet;
+    };
+    auto packetsOf = [](const FlowTable &table, const Frame &frame) {
+      FlowKey key;
+      FlowTable::makeKey(dissected(frame), key);
+      std::vector<Flow> flows;
+      table.topFlows(flows);
+      for (size_t i = 0; i < flows.size(); i++)
+        if (FlowTable::sameKey(flows[i].key, key))
+          return flows[i].stats.packets;
+      return 0ULL;
+    };
+
+    // a sits in slot 7, b wraps around to slot 0 and pushes c from its home 0 to slot 1
+    const Frame &a = byHome[7][0], &b = byHome[7][1], &c = byHome[0][0];
+    unsigned long long half = FLOW_IDLE_TIMEOUT / 2;
+    FlowTable table(8);
+    table.update(packetAt(a, 1)); // Updates sweep one slot each, from slot 0 on once the table holds a flow
+    table.update(packetAt(b, 1));
+    table.update(packetAt(c, 1));
+    for (int i = 0; i < 5; i++) // Slots 2 to 6, b and c stay active
+      table.update(packetAt(i % 2 ? c : b, half));
+    assert(table.size() == 3 && table.expiredFlows() == 0);
+
+    // Slot 7 expires a, b and c shift back and are still found rather than added again
+    table.update(packetAt(b, FLOW_IDLE_TIMEOUT + 2));
+    assert(table.size() == 2 && table.expiredFlows() == 1 && packetsOf(table, a) == 0);
+    table.update(packetAt(c, FLOW_IDLE_TIMEOUT + 2));
+    assert(table.size() == 2 && packetsOf(table, b) == 5 && packetsOf(table, c) == 4);
+
+    // An expired flow shifted into the swept slot is checked by the next packet
+    FlowTable shifted(8);
+    shifted.update(packetAt(a, 1));
+    shifted.update(packetAt(b, 1));
+    for (int i = 0; i < 6; i++) // Slots 1 to 6
+      shifted.update(packetAt(c, half));
+    shifted.update(packetAt(c, FLOW_IDLE_TIMEOUT + 2));
+    assert(shifted.expiredFlows() == 1 && shifted.size() == 2);
+    shifted.update(packetAt(c, FLOW_IDLE_TIMEOUT + 2));
+    assert(shifted.expiredFlows() == 2 && shifted.size() == 1 && packetsOf(shifted, b) == 0);
+
+    // A flow busy past the active timeout starts over
+    FlowTable active(8);
+    unsigned long long now = 0;
+    while (active.expiredFlows() == 0 && now <= 2 * FLOW_ACTIVE_TIMEOUT) {
+      now += half;
+      active.update(packetAt(c, now));
+    }
+    assert(active.expiredFlows() == 1 && now > FLOW_ACTIVE_TIMEOUT && packetsOf(active, c) == 1);
+
+    // The top flows heap keeps the largest, a new flow replaces its smallest member
+    FlowTable ranked(1024);
+    for (unsigned int i = 0; i < FLOW_TOP_COUNT; i++) {
+      Packet packet = packetAt(ipv4Frame(IPPROTO_TCP, 0x0a000001, 0x0a000002, 2000 + i, 80), 0);
+      packet.wireLength = 100 + i;
+      ranked.update(packet);
+    }
+    Frame small = ipv4Frame(IPPROTO_TCP, 0x0a000001, 0x0a000002, 5000, 80);
+    Packet packet = packetAt(small, 0);
+    packet.wireLength = 50;
+    ranked.update(packet);
+    std::vector<Flow> flows;
+    ranked.topFlows(flows);
+    assert(flows.size() == FLOW_TOP_COUNT && flows.back().stats.bytes == 100 && flows[0].stats.bytes == 199);
+    packet.wireLength = 1000;
+    ranked.update(packet);
+    ranked.topFlows(flows);
+    assert(flows.size() == FLOW_TOP_COUNT && flows[0].stats.bytes == 1050 && flows.back().stats.bytes == 101);
+    assert(flows[0].key.portA == 5000 || flows[0].key.portB == 5000);
+    assert(ranked.size() == FLOW_TOP_COUNT + 1);
+  }
+
+  // TCP reassembly: handshake, reordering, retransmissions, sequence wraparound and eviction
+  {
+    TcpReassembler reassembler;
+    const unsigned int isn = 0xfffffff0; // Wraps after 15 bytes of client data
+    const std::string parts[] = {"GET /index.html", " HTTP/1.1\r\n", "Host: a\r\n\r\n"};
+    Frame syn = tcpSegment(true, isn, 0x02, "");
+    Frame first = tcpSegment(true, isn + 1, 0x18, parts[0]);
+    Frame second = tcpSegment(true, isn + 16, 0x18, parts[1]);
+    Frame third = tcpSegment(true, isn + 27, 0x19, parts[2]);
+    Frame reply = tcpSegment(false, 7000, 0x18, "HTTP/1.1 200 OK");
+    const Frame *order[] = {&syn, &first, &third, &reply, &first, &second, &third};
+    for (const Frame *frame : order)
+      reassembler.add(dissected(*frame));
+
+    FlowKey key;
+    assert(FlowTable::makeKey(dissected(first), key));
+    TcpStream stream;
+    assert(reassembler.copyStream(key, stream));
+    assert(streamText(stream, 0) == parts[0] + parts[1] + parts[2]);
+    assert(streamText(stream, 1) == "HTTP/1.1 200 OK" && stream.directions[0].finished);
+    assert(stream.retransmitted == parts[0].size() + parts[2].size() && stream.directions[0].missing == 0);
+    // Chunks keep the conversation order, the third part only completed after the reply
+    assert(stream.chunks.size() == 3 && stream.chunks[0].length == 15 && stream.chunks[1].direction == 1);
+
+    // A lost segment is skipped once enough data waits behind it
+    std::string block(60000, 'x');
+    reassembler.add(dissected(tcpSegment(false, 7015, 0x10, "lost")));
+    for (unsigned int i = 0; i * block.size() <= REASSEMBLY_PENDING_LIMIT; i++)
+      reassembler.add(dissected(tcpSegment(false, 7015 + 100 + i * block.size(), 0x10, block)));
+    assert(reassembler.copyStream(key, stream));
+    assert(stream.directions[1].missing == 96 && stream.chunks[4].missing && stream.chunks[4].length == 96);
+
+    // Closing the connection gives up on what is still missing before the last FIN
+    unsigned int blocks = REASSEMBLY_PENDING_LIMIT / block.size() + 1;
+    reassembler.add(dissected(tcpSegment(false, 7115 + blocks * block.size() + 50, 0x11, "bye")));
+    assert(reassembler.copyStream(key, stream));
+    assert(stream.directions[1].missing == 146 && stream.directions[1].finished);
+    assert(streamText(stream, 1).compare(streamText(stream, 1).size() - 3, 3, "bye") == 0);
+
+    // Streams beyond the budget are evicted oldest first and no shard goes over its part
+    TcpReassembler small(REASSEMBLY_SHARDS * 4096);
+    for (int port = 0; port < 40; port++) {
+      Frame frame = tcpSegment(true, 1, 0x18, block);
+      frame.bytes[34] = (unsigned char)(port >> 8);
+      frame.bytes[35] = (unsigned char)port;
+      small.add(dissected(frame));
+    }
+    size_t count, memory;
+    unsigned long long evicted;
+    small.getUsage(count, memory, evicted);
+    assert(count + evicted == 40 && memory <= REASSEMBLY_SHARDS * 4096);
+    small.clear();
+
+    // A single stream alone in its shard stays within it, in order, out of order or in tiny alternating segments
+    for (unsigned int i = 0; i < 8; i++)
+      small.add(dissected(tcpSegment(true, 1 + i * block.size(), 0x18, block)));
+    small.add(dissected(tcpSegment(false, 999, 0x12, "")));
+    for (unsigned int i = 0; i < 8; i++)
+      small.add(dissected(tcpSegment(false, 1000 + (8 - i) * block.size(), 0x18, block)));
+    for (unsigned int i = 0; i < 2000; i++) {
+      small.add(dissected(tcpSegment(true, 1 + 8 * block.size() + i, 0x18, "a")));
+      small.add(dissected(tcpSegment(false, 1000 + 9 * block.size() + 2 * i, 0x18, "b")));
+    }
+    small.getUsage(count, memory, evicted);
+    assert(count == 1 && evicted == 0 && memory <= 4096);
+    TcpStream alone;
+    assert(small.copyStream(key, alone) && alone.full);
+    assert(alone.directions[0].delivered == 8 * block.size() + 2000 && alone.directions[0].missing == 0);
+    small.clear();
+    small.getUsage(count, memory, evicted);
+    assert(count == 0 && memory == 0);
+  }
+
+  // Timeline: buckets per protocol, level choice, recycled buckets and the display filter time range
+  {
+    const unsigned long long ms = 1000000ULL;
+    const unsigned long long base = 28333334ULL * 60000000000ULL; // On a minute boundary
+    Frame tcp = ipv4Frame(IPPROTO_TCP, 0x0a000001, 0x0a000002, 1000, 80);
+    Frame udp = ipv4Frame(IPPROTO_UDP, 0x0a000001, 0x0a000002, 1000, 53);
+    Timeline timeline(2);
+    PacketStore store;
+    for (unsigned long long i = 0; i < 10; i++) {
+      Packet packet = dissected(tcp);
+      packet.timestamp = base + i * ms;
+      timeline.add(packet, 0);
+      store.add(tcp.bytes.data(), tcp.bytes.size(), packet.timestamp);
+    }
+    Packet packet = dissected(udp);
+    packet.timestamp = base + 5 * ms;
+    timeline.add(packet, 1);
+    store.add(udp.bytes.data(), udp.bytes.size(), packet.timestamp);
+
+    std::vector<TimelinePoint> points;
+    assert(timeline.query(base, base + 10 * ms, 10, points) == 0 && points.size() == 10);
+    for (int i = 0; i < 10; i++)
+      assert(points[i].packets[0] == 1 && points[i].bytes[0] == tcp.bytes.size() &&
+             points[i].packets[1] == (i == 5 ? 1u : 0u));
+    // Ten minutes are more 100 ms buckets than a ring holds, the 1 s level is read instead
+    assert(timeline.query(base, base + 600000 * ms, 2, points) == 2);
+    assert(points[0].packets[0] == 10 && points[0].packets[1] == 1 && points[1].packets[0] == 0);
+
+    // Three seconds later the 1 ms buckets of the first packets were recycled
+    packet = dissected(tcp);
+    packet.timestamp = base + 3000 * ms;
+    timeline.add(packet, 0);
+    assert(timeline.query(base, base + 10 * ms, 10, points) == 1 && points[0].packets[0] == 10);
+    unsigned long long first, last;
+    assert(timeline.getRange(first, last) && first == base && last == base + 3000 * ms);
+    timeline.clear();
+    assert(!timeline.getRange(first, last));
+
+    DisplayFilter filter;
+    std::string error;
+    filter.setTimeRange(base + 2 * ms, base + 6 * ms);
+    filter.update(store);
+    assert(filter.isActive() && filter.size() == 5);
+    assert(filter.setExpression("udp", error));
+    filter.update(store);
+    assert(filter.size() == 1 && filter[0] == 10);
+    filter.setTimeRange(0, 0);
+    filter.update(store);
+    assert(filter.size() == 1 && !filter.hasTimeRange());
+  }
+
+  // LZ codec: round trips, refuses small outputs and corrupt blocks
+  {
+    std::string text;
+    for (int i = 0; i < 2000; i++)
+      text += "GET /index.html HTTP/1.1\r\nHost: " + std::to_string(i % 37) + "\r\n";
+    const unsigned char *raw = (const unsigned char *)text.data();
+    std::vector<unsigned char> packed(lzCompressBound(text.size()));
+    size_t size = lzCompress(raw, text.size(), packed.data(), packed.size());
+    assert(size > 0 && size < text.size() / 4);
+    std::vector<unsigned char> unpacked(text.size());
+    assert(lzDecompress(packed.data(), size, unpacked.data(), unpacked.size()));
+    assert(memcmp(unpacked.data(), raw, text.size()) == 0);
+    assert(lzCompress(raw, text.size(), packed.data(), size - 1) == 0);
+    assert(!lzDecompress(packed.data(), size - 1, unpacked.data(), unpacked.size()));
+    packed[1] ^= 0xff;
+    assert(!lzDecompress(packed.data(), size, unpacked.data(), unpacked.size()) ||
+           memcmp(unpacked.data(), raw, text.size()) != 0);
+  }
+
+  // Spilling: memory stays flat, spilled packets read back, filtered and summarized
+  {
+    const unsigned long long ms = 1000000ULL;
+    PacketStore store(3 * 65536, 65536);
+    assert(store.setSpillDirectory("/tmp") && store.isSpilling());
+    size_t halfway = 0;
+    for (unsigned int i = 0; i < 5000; i++) {
+      if (i == 2500)
+        halfway = store.memoryUsage();
+      Frame frame = ipv4Frame(i % 2 ? IPPROTO_UDP : IPPROTO_TCP, 0x0a000001, i, 1000, 80);
+      frame.bytes.resize(frame.bytes.size() + i % 100, (unsigned char)i);
+      assert(store.add(frame.bytes.data(), frame.bytes.size(), i * ms));
+    }
+    assert(store.size() == 5000 && store.droppedPackets() == 0);
+    assert(store.firstResident() > 3000 && store.getSpillFile().segmentCount() > 1);
+    assert(store.memoryUsage() < halfway + halfway / 8);
+    assert(store.getSpillFile().storedBytes() < store.getSpillFile().rawBytes());
+    for (PacketHandle i = 0; i < 5000; i += 7) {
+      const Packet &packet = store[i];
+      assert(packet.timestamp == i * ms && packet.size == (int)((i % 2 ? 52 : 64) + i % 100));
+      assert(packet.info.ipProtocol == (i % 2 ? IPPROTO_UDP : IPPROTO_TCP));
+      assert(i % 100 == 0 || packet.data[packet.size - 1] == (unsigned char)i);
+    }
+
+    // Segments outside the time range are skipped without being read
+    unsigned long long hits, misses;
+    store.getSpillFile().getCacheStats(hits, misses);
+    unsigned long long before = hits + misses;
+    size_t visited = 0;
+    store.visit(0, store.size(), [&visited](PacketHandle, const Packet &) { visited++; }, 4000 * ms, 4999 * ms);
+    store.getSpillFile().getCacheStats(hits, misses);
+    assert(hits + misses == before && visited == 5000 - store.firstResident());
+
+    DisplayFilter filter(2);
+    std::string error;
+    assert(filter.setExpression("udp", error));
+    filter.setTimeRange(10 * ms, 20 * ms);
+    filter.update(store);
+    assert(filter.size() == 5 && filter[0] == 11);
+
+    PacketSummaries summaries;
+    summaries.update(store);
+    assert(summaries.size() == 5000 && summaries.packetSize(3) == store[3].wireLength);
+    assert(std::string(summaries.protocolName(1)) == std::string(summaries.protocolName(4999)));
+
+    store.clear();
+    assert(store.empty() && store.getSpillFile().segmentCount() == 0 && store.isSpilling());
+    assert(store.add(ipv4Frame(IPPROTO_TCP, 1, 2, 3, 4).bytes.data(), 64) && store[0].size == 64);
+    assert(store.setSpillDirectory("/nonexistent") == false);
+  }
+
+  // Application layer: DNS names with compression, HTTP Host headers, TLS server names
+  {
+    StringPool names;
+    ApplicationLayer application;
+    std::string query("\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00"
+                      "\x03www\x07" "Example\x03" "com\x00\x00\x01\x00\x01", 33);
+    assert(named(names, payloadFrame(IPPROTO_UDP, 40000, 53, query), application) == "www.example.com");
+    assert(application == ApplicationLayer::DnsQuery);
+    // Over TCP the message follows a length prefix
+    assert(named(names, payloadFrame(IPPROTO_TCP, 40000, 53, std::string("\x00\x21", 2) + query), application) ==
+           "www.example.com");
+    // A TCP header cut short has no payload, its bytes are not read as a message
+    // Cut anywhere, a 12 byte one included, even where the header would parse as a DNS query with an empty name
+    std::string header("\x00\x35\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x50\x02\x00\x00\x00\x00\x00", 19);
+    for (size_t cut = 2; cut <= header.size(); cut++) {
+      Frame frame = payloadFrame(IPPROTO_TCP, 0, 0, "");
+      frame.bytes.resize(frame.bytes.size() - 20);
+      frame.bytes.insert(frame.bytes.end(), header.begin(), header.begin() + cut);
+      assert(named(names, frame, application) == "" && application == ApplicationLayer::None);
+    }
+
+    // Response: the answer names the question by pointer, then a CNAME and an A record
+    std::string response = query;
+    response[2] = '\x81';
+    response[3] = '\x80';
+    response[7] = 2;
+    response += std::string("\xc0\x0c\x00\x05\x00\x01\x00\x00\x01\x00\x00\x06\x03" "cdn\xc0\x10", 18);
+    response += std::string("\xc0\x2d\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04\x5d\xb8\xd8\x22", 16);
+    assert(named(names, payloadFrame(IPPROTO_UDP, 53, 40000, response), application) == "www.example.com");
+    assert(application == ApplicationLayer::DnsResponse && names.size() == 1);
+    std::vector<std::string> answers;
+    const unsigned char *message = (const unsigned char *)response.data();
+    assert(parseDnsAnswers(message, response.size(), [&](const DnsRecord &record) {
+             char text[APP_NAME_SIZE];
+             size_t length, next;
+             if (record.type == 5 && parseDnsName(message, response.size(), record.dataOffset, text, length, next))
+               answers.push_back(std::string(record.name) + " CNAME " + text);
+             else
+               answers.push_back(std::string(record.name) + " A " + std::to_string(message[record.dataOffset]));
+           }) == 2);
+    assert(answers.size() == 2 && answers[0] == "www.example.com CNAME cdn.example.com" &&
+           answers[1] == "cdn.example.com A 93");
+    // A pointer loop or a name running past the packet is refused
+    std::string loop = query.substr(0, 12) + std::string("\xc0\x0c", 2);
+    assert(named(names, payloadFrame(IPPROTO_UDP, 40000, 53, loop), application) == "" &&
+           application == ApplicationLayer::None);
+    assert(named(names, payloadFrame(IPPROTO_UDP, 40000, 53, query.substr(0, 20)), application) == "");
+
+    std::string get = "GET /index.html HTTP/1.1\r\nUser-Agent: test\r\nHOST:  Example.COM:8080 \r\n\r\n";
+    assert(named(names, payloadFrame(IPPROTO_TCP, 40000, 8080, get), application) == "example.com");
+    assert(application == ApplicationLayer::HttpRequest);
+    HttpRequest request;
+    assert(parseHttpRequest((const unsigned char *)get.data(), get.size(), request) && request.minorVersion == 1);
+    assert(std::string((const char *)request.target, request.targetLength) == "/index.html");
+    assert(named(names, payloadFrame(IPPROTO_TCP, 40000, 443, "CONNECT [::1]:443 HTTP/1.1\r\n\r\n"), application) ==
+           "[::1]");
+    // Unknown methods, responses and a Host line cut by the capture give no name
+    assert(named(names, payloadFrame(IPPROTO_TCP, 40000, 80, "FETCH / HTTP/1.1\r\n"), application) == "" &&
+           application == ApplicationLayer::None);
+    assert(named(names, payloadFrame(IPPROTO_TCP, 80, 40000, "HTTP/1.1 200 OK\r\n"), application) == "");
+    assert(named(names, payloadFrame(IPPROTO_TCP, 40000, 80, "GET / HTTP/1.0\r\nHost: exam"), application) == "" &&
+           application == ApplicationLayer::HttpRequest);
+
+    // ClientHello with a session id, two cipher suites, a GREASE extension before server_name
+    std::string hello = std::string("\x03\x03", 2) + std::string(32, 'r') + std::string("\x04sess", 5) +
+                        std::string("\x00\x04\x13\x01\x13\x02\x01\x00", 8);
+    std::string sni = std::string("\x00\x00\x00\x11\x00\x0f\x00\x00\x0c", 9) + "Api.Test.ORG";
+    std::string extensions = std::string("\x0a\x0a\x00\x00", 4) + sni;
+    hello += std::string(1, (char)(extensions.size() >> 8)) + std::string(1, (char)extensions.size()) + extensions;
+    std::string handshake = std::string("\x01\x00", 2) + std::string(1, (char)(hello.size() >> 8)) +
+                            std::string(1, (char)hello.size()) + hello;
+    std::string record = std::string("\x16\x03\x01", 3) + std::string(1, (char)(handshake.size() >> 8)) +
+                         std::string(1, (char)handshake.size()) + handshake;
+    assert(named(names, payloadFrame(IPPROTO_TCP, 40000, 443, record), application) == "api.test.org");
+    assert(application == ApplicationLayer::TlsClientHello);
+    // Cut before the extension, still a ClientHello but without a name
+    assert(named(names, payloadFrame(IPPROTO_TCP, 40000, 443, record.substr(0, record.size() - 5)), application) ==
+               "" &&
+           application == ApplicationLayer::TlsClientHello);
+
+    // Interning returns one id per distinct string from every thread
+    StringPool pool;
+    std::vector<std::thread> threads;
+    std::vector<std::vector<unsigned int>> ids(4, std::vector<unsigned int>(1000));
+    for (int t = 0; t < 4; t++)
+      threads.push_back(std::thread([&pool, &ids, t]() {
+        for (int i = 0; i < 1000; i++) {
+          std::string text = "host" + std::to_string((i * 7 + t) % 1000);
+          ids[t][(i * 7 + t) % 1000] = pool.intern(text.data(), text.size());
+        }
+      }));
+    for (size_t t = 0; t < threads.size(); t++)
+      threads[t].join();
+    assert(pool.size() == 1000);
+    for (int i = 0; i < 1000; i++)
+      assert(ids[0][i] == ids[3][i] && std::string(pool.lookup(ids[0][i])) == "host" + std::to_string(i));
+    assert(pool.intern("", 0) == STRING_POOL_NONE && pool.lookup(STRING_POOL_NONE) == NULL);
+    pool.clear();
+    assert(pool.size() == 0 && pool.lookup(ids[0][0]) == NULL);
+
+    // Host totals per kind of message, ranked by the most seen
+    HostTable table;
+    Packet packet = dissected(payloadFrame(IPPROTO_TCP, 40000, 443, record));
+    dissectApplication(packet, names);
+    table.update(packet);
+    table.update(packet);
+    packet = dissected(payloadFrame(IPPROTO_UDP, 40000, 53, query));
+    dissectApplication(packet, names);
+    table.update(packet);
+    std::vector<HostStats> top;
+    table.topHosts(top);
+    assert(top.size() == 2 && std::string(names.lookup(top[0].name)) == "api.test.org" && top[0].handshakes == 2);
+    assert(top[1].lookups == 1 && table.size() == 2);
+  }
+
+  // Pipelines: dropped packets are compacted out, the static and dynamic pipelines agree
+  {
+    PacketStore input;
+    Frame frames[] = {ipv4Frame(IPPROTO_TCP, 0x0a000001, 0x0a000002, 40000, 443, 100), arpFrame(),
+                      ipv4Frame(IPPROTO_UDP, 0x0a000001, 0x0a000002, 40000, 53),
+                      ipv4Frame(IPPROTO_TCP, 0x0a000001, 0x0a000002, 40001, 80, 100)};
+    for (int i = 0; i < 4; i++)
+      input.add(frames[i].bytes.data(), frames[i].bytes.size(), 1000 + i);
+    DisplayFilter filter;
+    std::string error;
+    assert(filter.setExpression("tcp", error));
+
+    PacketStore kept;
+    auto pipeline = makePipeline(StoreSource(input), FilterStage(filter), SnaplenStage(40), StoreSink(kept), CountSink());
+    assert(pipeline.run() == 4 && pipeline.run() == 0);
+    assert(pipeline.stage<3>().packets == 2 && pipeline.stage<3>().bytes == 80);
+    assert(kept.size() == 2 && kept[0].timestamp == 1000 && kept[1].timestamp == 1003 && kept[1].size == 40);
+
+    PacketStore dynamicKept;
+    DynamicPipeline dynamic;
+    dynamic.add("filter", FilterStage(filter));
+    dynamic.add("snaplen", SnaplenStage(40));
+    dynamic.add("store", StoreSink(dynamicKept));
+    dynamic.add("recorder", CountSink());
+    assert(dynamic.remove("recorder") && !dynamic.remove("recorder") && dynamic.stageCount() == 3);
+    StoreSource source(input);
+    assert(dynamic.run(source) == 4);
+    assert(dynamicKept.size() == 2 && dynamicKept[1].timestamp == 1003 && dynamicKept[1].size == 40);
+
+    // A queue sink publishes once per batch
+    FrameQueue queue(1 << 16, 16);
+    auto producer = makePipeline(StoreSource(input), QueueSink(queue));
+    producer.run();
+    Packet packet;
+    assert(queue.pending() == 0 && queue.front(packet) && packet.timestamp == 1000);
+  }
+
+  // Hex dump, full lines and the partial last line must agree
+  {
+    unsigned char bytes[20];
+    for (int i = 0; i < 20; i++)
+      bytes[i] = (unsigned char)(i * 13 + 31);
+    char text[HEXDUMP_SIZE(20)];
+    std::string dump(text, hexdump(bytes, sizeof(bytes), text, sizeof(text)));
+    assert(dump == "000000  1f 2c 39 46 53 60 6d 7a  87 94 a1 ae bb c8 d5 e2  .,9FS`mz........\n"
+                   "000010  ef fc 09 16                                       ....\n");
+    assert(hexdump(bytes, sizeof(bytes), text, HEXDUMP_LINE_SIZE) == HEXDUMP_LINE_SIZE);
+  }
+
+  // Hex dump offsets past 64 KiB must not wrap back to 0000
+  {
+    std::vector<unsigned char> bytes(0x40000 + 4, 0x41);
+    std::vector<char> text(HEXDUMP_SIZE(bytes.size()));
+    size_t length = hexdump(bytes.data(), bytes.size(), text.data(), text.size());
+    std::string last(text.data() + length - (HEXDUMP_ASCII_COLUMN + 5), HEXDUMP_ASCII_COLUMN + 5);
+    assert(last == "040000  41 41 41 41                                       AAAA\n");
+    std::string line(text.data() + 0x1000 * HEXDUMP_LINE_SIZE, HEXDUMP_HEX_COLUMN);
+    assert(line == "010000  ");
+  }
+
+  std::cout << "All filter tests passed" << std::endl;
+  return 0;
+}
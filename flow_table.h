@@ -0,0 +1,348 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "packet_store.h"
+
+#define FLOW_TABLE_SLOTS (1 << 18)              // Slots in the hash table, a power of two
+#define FLOW_MAX_LOAD 0.75                      // Share of slots that may hold flows before new ones are refused
+#define FLOW_IDLE_TIMEOUT 60000000000ULL        // Nanoseconds without packets before a flow is removed
+#define FLOW_ACTIVE_TIMEOUT 1800000000000ULL    // Nanoseconds after which a long lived flow starts over
+#define FLOW_SWEEP_SLOTS 1                      // Slots checked for expired flows per packet
+#define FLOW_TOP_COUNT 100
+
+// Conversation identifier, endpoints are ordered so both directions map to the same key
+struct FlowKey
+{
+    unsigned char addressA[16]; // IPv4 addresses use the first 4 bytes
+    unsigned char addressB[16];
+    unsigned short portA;
+    unsigned short portB;
+    unsigned char protocol;
+    unsigned char version; // 4 or 6, 0 marks an empty slot
+    unsigned char padding[2];
+};
+
+struct FlowStats
+{
+    unsigned long long packets;
+    unsigned long long bytes;
+    unsigned long long firstSeen; // Packet timestamps in nanoseconds
+    unsigned long long lastSeen;
+    unsigned char tcpFlags; // Every TCP flag seen in either direction
+};
+
+struct Flow
+{
+    FlowKey key;
+    FlowStats stats;
+};
+
+/*
+Per conversation statistics keyed by the IP 5-tuple.
+
+Open addressing with linear probing over a fixed array of slots, so the
+memory use is decided up front and a lookup usually touches one or two
+cache lines. Each slot keeps the key hash, most probes are rejected without
+comparing keys. Removal shifts the following entries back instead of
+leaving tombstones, so probe sequences stay short under churn. Expired flows
+are found by sweeping a few slots per packet rather than scanning the table.
+
+The largest flows by bytes are kept in a small min heap as packets arrive:
+a flow only enters it once it outgrows the smallest member, so reading the
+top N never scans the table either.
+*/
+class FlowTable
+{
+private:
+    struct Slot
+    {
+        Flow flow;
+        unsigned int hash;
+        int topIndex; // Position in the top heap, -1 if the flow is not in it
+    };
+
+    std::vector<Slot> slots;
+    size_t mask;
+    size_t count;
+    size_t maxCount;
+    size_t sweepPos;
+    unsigned long long refused;
+    unsigned long long expired;
+    std::vector<size_t> top; // Min heap by bytes of the largest flows, holding slot indexes
+
+public:
+    // Mixes the key as five 64 bit words, every word is independent until the final fold
+    static unsigned int hashKey(const FlowKey &key)
+    {
+        unsigned long long words[5];
+        memcpy(words, &key, sizeof(words));
+        unsigned long long h = 0x9e3779b97f4a7c15ULL;
+        for (int i = 0; i < 5; i++)
+            h ^= words[i] * 0xff51afd7ed558ccdULL + i;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 29;
+        return (unsigned int)h ? (unsigned int)h : 1; // Never 0, which marks an empty slot
+    }
+
+    static bool sameKey(const FlowKey &a, const FlowKey &b) { return memcmp(&a, &b, sizeof(FlowKey)) == 0; }
+
+    /*
+    Builds the key of an IP packet, returns false for anything else. When reversed is given
+    it tells whether the packet goes from endpoint B to endpoint A of the key.
+    */
+    static bool makeKey(const Packet &packet, FlowKey &key, bool *reversed = NULL)
+    {
+        const PacketInfo &info = packet.info;
+        const unsigned char *data = packet.data;
+        unsigned int size = packet.size;
+        memset(&key, 0, sizeof(key));
+
+        unsigned int addressLength;
+        unsigned int sourceOffset;
+        if (info.network == NetworkLayer::IPv4 && info.networkOffset + 20u <= size)
+        {
+            key.version = 4;
+            addressLength = 4;
+            sourceOffset = info.networkOffset + 12;
+        }
+        else if (info.network == NetworkLayer::IPv6 && info.networkOffset + 40u <= size)
+        {
+            key.version = 6;
+            addressLength = 16;
+            sourceOffset = info.networkOffset + 8;
+        }
+        else
+            return false;
+
+        const unsigned char *source = data + sourceOffset;
+        const unsigned char *dest = source + addressLength;
+        unsigned short sourcePort = 0, destPort = 0;
+        key.protocol = info.ipProtocol;
+        if ((info.transport == TransportLayer::Tcp || info.transport == TransportLayer::Udp) &&
+            info.transportOffset + 4u <= size)
+        {
+            sourcePort = dissectRead16(data + info.transportOffset);
+            destPort = dissectRead16(data + info.transportOffset + 2);
+        }
+
+        int order = memcmp(source, dest, addressLength);
+        bool ordered = order < 0 || (order == 0 && sourcePort <= destPort);
+        if (reversed)
+            *reversed = !ordered;
+        if (ordered)
+        {
+            memcpy(key.addressA, source, addressLength);
+            memcpy(key.addressB, dest, addressLength);
+            key.portA = sourcePort;
+            key.portB = destPort;
+        }
+        else
+        {
+            memcpy(key.addressA, dest, addressLength);
+            memcpy(key.addressB, source, addressLength);
+            key.portA = destPort;
+            key.portB = sourcePort;
+        }
+        return true;
+    }
+
+private:
+    bool topLess(size_t a, size_t b) const
+    {
+        return slots[top[a]].flow.stats.bytes < slots[top[b]].flow.stats.bytes;
+    }
+
+    void topSwap(size_t a, size_t b)
+    {
+        std::swap(top[a], top[b]);
+        slots[top[a]].topIndex = (int)a;
+        slots[top[b]].topIndex = (int)b;
+    }
+
+    void topSiftUp(size_t i)
+    {
+        while (i > 0 && topLess(i, (i - 1) / 2))
+        {
+            topSwap(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void topSiftDown(size_t i)
+    {
+        while (true)
+        {
+            size_t smallest = i;
+            size_t left = 2 * i + 1;
+            if (left < top.size() && topLess(left, smallest))
+                smallest = left;
+            if (left + 1 < top.size() && topLess(left + 1, smallest))
+                smallest = left + 1;
+            if (smallest == i)
+                return;
+            topSwap(i, smallest);
+            i = smallest;
+        }
+    }
+
+    void removeFromTop(size_t i)
+    {
+        slots[top[i]].topIndex = -1;
+        top[i] = top.back();
+        top.pop_back();
+        if (i < top.size())
+        {
+            slots[top[i]].topIndex = (int)i;
+            topSiftDown(i);
+            topSiftUp(i);
+        }
+    }
+
+    // Called after the flow in slot index grew
+    void updateTop(size_t index)
+    {
+        Slot &slot = slots[index];
+        if (slot.topIndex >= 0)
+            topSiftDown(slot.topIndex);
+        else if (top.size() < FLOW_TOP_COUNT)
+        {
+            top.push_back(index);
+            slot.topIndex = (int)top.size() - 1;
+            topSiftUp(slot.topIndex);
+        }
+        else if (slot.flow.stats.bytes > slots[top[0]].flow.stats.bytes)
+        {
+            slots[top[0]].topIndex = -1;
+            top[0] = index;
+            slot.topIndex = 0;
+            topSiftDown(0);
+        }
+    }
+
+    // Removes the flow in slot index, moving later entries of the probe run back into the gap
+    void removeAt(size_t index)
+    {
+        if (slots[index].topIndex >= 0)
+            removeFromTop(slots[index].topIndex);
+
+        size_t gap = index;
+        for (size_t i = (index + 1) & mask; slots[i].hash != 0; i = (i + 1) & mask)
+        {
+            size_t home = slots[i].hash & mask;
+            // The entry may fill the gap if its home slot is not between the gap and itself
+            if (((i - home) & mask) >= ((i - gap) & mask))
+            {
+                slots[gap] = slots[i];
+                if (slots[gap].topIndex >= 0)
+                    top[slots[gap].topIndex] = gap;
+                gap = i;
+            }
+        }
+        slots[gap].hash = 0;
+        slots[gap].topIndex = -1;
+        count--;
+    }
+
+    // Checks a few slots for flows that went idle or ran past the active timeout
+    void sweep(unsigned long long now)
+    {
+        for (int i = 0; i < FLOW_SWEEP_SLOTS && count > 0; i++)
+        {
+            Slot &slot = slots[sweepPos];
+            if (slot.hash != 0 && (slot.flow.stats.lastSeen + FLOW_IDLE_TIMEOUT < now ||
+                                   slot.flow.stats.firstSeen + FLOW_ACTIVE_TIMEOUT < now))
+            {
+                removeAt(sweepPos);
+                expired++;
+                continue; // Another entry may have shifted into this slot
+            }
+            sweepPos = (sweepPos + 1) & mask;
+        }
+    }
+
+public:
+    explicit FlowTable(size_t slotCount = FLOW_TABLE_SLOTS)
+        : slots(slotCount), mask(slotCount - 1), count(0), maxCount((size_t)(slotCount * FLOW_MAX_LOAD)),
+          sweepPos(0), refused(0), expired(0)
+    {
+        clear();
+    }
+
+    // Accounts one packet to its flow, non IP packets are ignored
+    void update(const Packet &packet)
+    {
+        FlowKey key;
+        if (!makeKey(packet, key))
+            return;
+        sweep(packet.timestamp);
+
+        unsigned int hash = hashKey(key);
+        size_t i = hash & mask;
+        while (slots[i].hash != 0 && !(slots[i].hash == hash && sameKey(slots[i].flow.key, key)))
+            i = (i + 1) & mask;
+
+        Slot &slot = slots[i];
+        if (slot.hash == 0)
+        {
+            if (count >= maxCount)
+            {
+                refused++;
+                return;
+            }
+            slot.hash = hash;
+            slot.topIndex = -1;
+            slot.flow.key = key;
+            memset(&slot.flow.stats, 0, sizeof(slot.flow.stats));
+            slot.flow.stats.firstSeen = packet.timestamp;
+            count++;
+        }
+
+        FlowStats &stats = slot.flow.stats;
+        stats.packets++;
+        stats.bytes += packet.wireLength;
+        if (packet.timestamp > stats.lastSeen)
+            stats.lastSeen = packet.timestamp;
+        if (packet.info.transport == TransportLayer::Tcp && packet.info.transportOffset + 14u <= (unsigned int)packet.size)
+            stats.tcpFlags |= packet.data[packet.info.transportOffset + 13];
+        updateTop(i);
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            slots[i].hash = 0;
+            slots[i].topIndex = -1;
+        }
+        count = 0;
+        sweepPos = 0;
+        refused = 0;
+        expired = 0;
+        top.clear();
+    }
+
+    // Flows currently tracked
+    size_t size() const { return count; }
+
+    // Copies the largest flows by bytes into flows, largest first
+    void topFlows(std::vector<Flow> &flows) const
+    {
+        flows.clear();
+        for (size_t i = 0; i < top.size(); i++)
+            flows.push_back(slots[top[i]].flow);
+        std::sort(flows.begin(), flows.end(), [](const Flow &a, const Flow &b)
+                  { return a.stats.bytes > b.stats.bytes; });
+    }
+
+    // New flows not tracked because the table was full
+    unsigned long long refusedFlows() const { return refused; }
+
+    // Flows removed by the idle or active timeout
+    unsigned long long expiredFlows() const { return expired; }
+
+    size_t memoryUsage() const { return slots.size() * sizeof(Slot); }
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+
+#include "packet_store.h"
+#include "spsc_queue.h"
+
+#define QUEUE_BYTES (64 << 20)  // Payload bytes in flight between the capture thread and its consumer
+#define QUEUE_FRAMES (1 << 18)  // Descriptors in flight, bounds the queue for tiny frames
+#define QUEUE_READ_BATCH 256
+
+// Position of a frame in the byte ring
+struct FrameDesc
+{
+    unsigned long long end; // Absolute byte position right after the frame, released once it is consumed
+    unsigned int offset;
+    unsigned int size;
+    unsigned int wireLength;
+    unsigned long long timestamp;
+    PacketInfo info;
+    TimestampSource timestampSource;
+};
+
+/*
+Single-producer/single-consumer queue of captured frames.
+
+Frame bytes are copied into a byte ring and described by a FrameDesc pushed on
+a SpscQueue, both become visible to the consumer on publish(). Frames never
+wrap around the end of the ring, the producer skips the tail instead. Since
+frames are consumed in order the consumer frees bytes simply by publishing the
+end position of the last frame it handled. When either ring is full the frame
+is dropped and counted instead of blocking the capture thread.
+*/
+class FrameQueue
+{
+private:
+    std::unique_ptr<unsigned char[]> bytes; // Left uninitialized so untouched pages cost no memory
+    size_t byteCapacity;
+    SpscQueue<FrameDesc> descs;
+
+    // Producer side
+    unsigned long long writePos;
+    unsigned long long cachedReadPos;
+    std::atomic<unsigned long long> overflows;
+
+    // Consumer side
+    char consumerPadding[CACHE_LINE_SIZE];
+    std::atomic<unsigned long long> readPos;
+    unsigned long long taken; // End of the last frame removed by take(), its bytes are freed by release()
+
+public:
+    FrameQueue(size_t byteSize = QUEUE_BYTES, size_t frameCapacity = QUEUE_FRAMES)
+        : bytes(new unsigned char[byteSize]), byteCapacity(byteSize), descs(frameCapacity),
+          writePos(0), cachedReadPos(0), overflows(0), readPos(0), taken(0) {}
+
+    FrameQueue(const FrameQueue &) = delete;
+    FrameQueue &operator=(const FrameQueue &) = delete;
+
+    // Producer: copies a frame into the queue without publishing it, returns false on overflow
+    bool push(const Packet &packet)
+    {
+        unsigned int size = packet.size;
+        size_t capacity = byteCapacity;
+        unsigned long long pos = (writePos + STORE_ALIGNMENT - 1) & ~(unsigned long long)(STORE_ALIGNMENT - 1);
+        size_t offset = pos % capacity;
+        if (offset + size > capacity)
+        {
+            pos += capacity - offset;
+            offset = 0;
+        }
+
+        unsigned long long end = pos + size;
+        if (end - cachedReadPos > capacity)
+        {
+            cachedReadPos = readPos.load(std::memory_order_acquire);
+            if (end - cachedReadPos > capacity)
+            {
+                overflows.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+
+        FrameDesc desc;
+        desc.end = end;
+        desc.offset = (unsigned int)offset;
+        desc.size = size;
+        desc.wireLength = packet.wireLength;
+        desc.timestamp = packet.timestamp;
+        desc.info = packet.info;
+        desc.timestampSource = packet.timestampSource;
+        if (!descs.write(desc))
+        {
+            overflows.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        memcpy(&bytes[offset], packet.data, size);
+        writePos = end;
+        return true;
+    }
+
+    // Producer: makes every pushed frame visible to the consumer
+    void publish() { descs.publish(); }
+
+    // Producer: frames pushed but not yet published
+    size_t pending() const { return descs.pending(); }
+
+    /*
+    Consumer: hands up to max frames to handler(const Packet &packet) in capture order.
+    The packet data is only valid until the handler returns. Returns the number of frames.
+    */
+    template <typename Handler>
+    size_t consume(Handler handler, size_t max)
+    {
+        FrameDesc batch[QUEUE_READ_BATCH];
+        size_t total = 0;
+
+        while (total < max)
+        {
+            size_t want = max - total < QUEUE_READ_BATCH ? max - total : QUEUE_READ_BATCH;
+            size_t count = descs.read(batch, want);
+            if (count == 0)
+                break;
+
+            for (size_t i = 0; i < count; i++)
+            {
+                Packet packet;
+                packet.data = &bytes[batch[i].offset];
+                packet.size = (int)batch[i].size;
+                packet.wireLength = batch[i].wireLength;
+                packet.timestamp = batch[i].timestamp;
+                packet.timestampSource = batch[i].timestampSource;
+                packet.info = batch[i].info;
+                handler(packet);
+            }
+
+            taken = batch[count - 1].end;
+            release();
+            total += count;
+        }
+
+        return total;
+    }
+
+    // Consumer: oldest published frame without removing it, returns false when the queue is empty
+    bool front(Packet &packet)
+    {
+        const FrameDesc *desc = descs.front();
+        if (!desc)
+            return false;
+
+        packet.data = &bytes[desc->offset];
+        packet.size = (int)desc->size;
+        packet.wireLength = desc->wireLength;
+        packet.timestamp = desc->timestamp;
+        packet.timestampSource = desc->timestampSource;
+        packet.info = desc->info;
+        return true;
+    }
+
+    // Consumer: releases the frame returned by front()
+    void pop()
+    {
+        take();
+        release();
+    }
+
+    // Consumer: removes the frame returned by front() but keeps its bytes until release(), for batches
+    void take()
+    {
+        taken = descs.front()->end;
+        descs.pop();
+    }
+
+    // Consumer: frees the bytes of every frame taken so far
+    void release() { readPos.store(taken, std::memory_order_release); }
+
+    // Frames waiting for the consumer
+    size_t depth() const { return descs.size(); }
+
+    // Frames dropped because the queue was full
+    unsigned long long overflowCount() const { return overflows.load(std::memory_order_relaxed); }
+};
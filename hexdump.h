@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define HEXDUMP_LINE_BYTES 16
+#define HEXDUMP_OFFSET_DIGITS 6 // Offsets up to 16 MiB, beyond the largest snaplen a file or capture can have
+#define HEXDUMP_HEX_COLUMN 8    // Offset digits and two spaces
+#define HEXDUMP_ASCII_COLUMN 58 // Hex column, 16 "xx " groups, the extra space after the eighth byte and one more
+#define HEXDUMP_LINE_SIZE 75    // Up to and including the newline
+
+// Bytes needed to format size bytes with hexdump()
+#define HEXDUMP_SIZE(size) ((((size) + HEXDUMP_LINE_BYTES - 1) / HEXDUMP_LINE_BYTES) * HEXDUMP_LINE_SIZE)
+
+/*
+Hex and ASCII dump without allocations or streams.
+
+Each line looks like
+    000010  45 00 00 54 6a 2c 40 00  40 01 d2 79 7f 00 00 01  E..Tj,@.@..y....
+and is written straight into a caller provided buffer, so the same code
+serves the detail view, which formats only the lines on screen, and exports,
+which format whole packets. Full lines are converted 16 bytes at a time with
+SSE2 when the compiler targets it, the last partial line and other targets go
+through the nibble table. Bytes 32 to 126 are printed as is, everything else
+as a dot.
+*/
+
+// Column of the hex digits of byte i of a line, the ASCII column is HEXDUMP_ASCII_COLUMN + i
+inline size_t hexdumpColumn(size_t i)
+{
+    return HEXDUMP_HEX_COLUMN + i * 3 + (i >= 8);
+}
+
+inline void hexdumpOffset(size_t offset, char *out)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = HEXDUMP_OFFSET_DIGITS - 1; i >= 0; i--, offset >>= 4)
+        out[i] = digits[offset & 0xf];
+    out[HEXDUMP_OFFSET_DIGITS] = ' ';
+    out[HEXDUMP_OFFSET_DIGITS + 1] = ' ';
+}
+
+// Formats up to 16 bytes as one line into out, which needs HEXDUMP_LINE_SIZE bytes, returns the line length
+inline size_t hexdumpLine(const unsigned char *data, size_t count, size_t offset, char *out)
+{
+    static const char digits[] = "0123456789abcdef";
+    if (count > HEXDUMP_LINE_BYTES)
+        count = HEXDUMP_LINE_BYTES;
+
+    hexdumpOffset(offset, out);
+    std::memset(out + HEXDUMP_HEX_COLUMN, ' ', HEXDUMP_ASCII_COLUMN - HEXDUMP_HEX_COLUMN);
+
+#ifdef __SSE2__
+    if (count == HEXDUMP_LINE_BYTES)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+        __m128i mask = _mm_set1_epi8(0x0f);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+        __m128i low = _mm_and_si128(bytes, mask);
+
+        // '0' + nibble, plus the distance from '9' + 1 to 'a' for nibbles above 9
+        __m128i nine = _mm_set1_epi8(9);
+        __m128i zero = _mm_set1_epi8('0');
+        __m128i letters = _mm_set1_epi8('a' - '0' - 10);
+        high = _mm_add_epi8(_mm_add_epi8(high, zero), _mm_and_si128(_mm_cmpgt_epi8(high, nine), letters));
+        low = _mm_add_epi8(_mm_add_epi8(low, zero), _mm_and_si128(_mm_cmpgt_epi8(low, nine), letters));
+
+        char pairs[32];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pairs), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pairs + 16), _mm_unpackhi_epi8(high, low));
+        for (size_t i = 0; i < HEXDUMP_LINE_BYTES; i++)
+            std::memcpy(out + hexdumpColumn(i), pairs + i * 2, 2);
+
+        // Bytes above 127 are negative as signed chars and fail the first comparison
+        __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(31)),
+                                          _mm_cmplt_epi8(bytes, _mm_set1_epi8(127)));
+        __m128i ascii = _mm_or_si128(_mm_and_si128(printable, bytes),
+                                     _mm_andnot_si128(printable, _mm_set1_epi8('.')));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + HEXDUMP_ASCII_COLUMN), ascii);
+        out[HEXDUMP_ASCII_COLUMN + HEXDUMP_LINE_BYTES] = '\n';
+        return HEXDUMP_LINE_SIZE;
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++)
+    {
+        char *hex = out + hexdumpColumn(i);
+        hex[0] = digits[data[i] >> 4];
+        hex[1] = digits[data[i] & 0xf];
+        out[HEXDUMP_ASCII_COLUMN + i] = data[i] >= 32 && data[i] <= 126 ? (char)data[i] : '.';
+    }
+    out[HEXDUMP_ASCII_COLUMN + count] = '\n';
+    return HEXDUMP_ASCII_COLUMN + count + 1;
+}
+
+/*
+Formats size bytes into out, stopping before the first line that would not fit in capacity.
+Returns the number of characters written, out is not NUL terminated.
+*/
+inline size_t hexdump(const unsigned char *data, size_t size, char *out, size_t capacity)
+{
+    size_t written = 0;
+    for (size_t offset = 0; offset < size && written + HEXDUMP_LINE_SIZE <= capacity; offset += HEXDUMP_LINE_BYTES)
+        written += hexdumpLine(data + offset, size - offset, offset, out + written);
+    return written;
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 8 // Bytes at the end of a block always stored as literals
+
+// Worst case compressed size of size bytes, incompressible data grows by one byte per 255
+inline size_t lzCompressBound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+/*
+Byte oriented LZ77 block codec in the spirit of LZ4.
+
+A block is a list of sequences: a token byte holding the literal count in
+its high nibble and the match length minus LZ_MIN_MATCH in the low one, the
+literals, then a 2 byte little endian offset back into the output. Nibbles
+of 15 continue with bytes added to them until one is below 255. The last
+sequence only has literals. Matches are found through a hash table of the
+last position of every 4 byte prefix, and the search steps faster through
+data that keeps failing to match, so incompressible payloads cost little
+more than a copy. Packet headers, padding and text compress well, which is
+what the spilled capture segments are made of.
+*/
+
+inline unsigned int lzRead32(const unsigned char *p)
+{
+    unsigned int value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline unsigned int lzHash(unsigned int value)
+{
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the continuation bytes of a length whose nibble was 15
+inline unsigned char *lzWriteLength(unsigned char *out, size_t length)
+{
+    while (length >= 255)
+    {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+/*
+Compresses size bytes of src into dst, which holds capacity bytes. Returns the compressed
+size, or 0 if it would not fit, lzCompressBound(size) bytes are always enough.
+*/
+inline size_t lzCompress(const unsigned char *src, size_t size, unsigned char *dst, size_t capacity)
+{
+    std::vector<unsigned int> table(1u << LZ_HASH_BITS, 0);
+    unsigned char *out = dst;
+    unsigned char *outEnd = dst + capacity;
+    size_t anchor = 0; // First byte not written yet
+    size_t pos = 0;
+    size_t misses = 0;
+    size_t limit = size > LZ_LAST_LITERALS + LZ_MIN_MATCH ? size - LZ_LAST_LITERALS : 0;
+
+    while (pos + LZ_MIN_MATCH <= limit)
+    {
+        unsigned int prefix = lzRead32(src + pos);
+        unsigned int hash = lzHash(prefix);
+        size_t candidate = table[hash];
+        table[hash] = (unsigned int)pos;
+        if (candidate >= pos || pos - candidate > LZ_MAX_OFFSET || lzRead32(src + candidate) != prefix)
+        {
+            pos += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+
+        size_t length = LZ_MIN_MATCH;
+        while (pos + length < limit && src[candidate + length] == src[pos + length])
+            length++;
+
+        size_t literals = pos - anchor;
+        if (out + 1 + literals + literals / 255 + 2 + (length - LZ_MIN_MATCH) / 255 + 2 > outEnd)
+            return 0;
+        unsigned char *token = out++;
+        *token = (unsigned char)((literals < 15 ? literals : 15) << 4);
+        if (literals >= 15)
+            out = lzWriteLength(out, literals - 15);
+        memcpy(out, src + anchor, literals);
+        out += literals;
+        size_t offset = pos - candidate;
+        *out++ = (unsigned char)offset;
+        *out++ = (unsigned char)(offset >> 8);
+        size_t extra = length - LZ_MIN_MATCH;
+        *token |= (unsigned char)(extra < 15 ? extra : 15);
+        if (extra >= 15)
+            out = lzWriteLength(out, extra - 15);
+
+        pos += length;
+        anchor = pos;
+        if (pos >= 2 && pos + LZ_MIN_MATCH <= limit)
+            table[lzHash(lzRead32(src + pos - 2))] = (unsigned int)(pos - 2);
+    }
+
+    size_t literals = size - anchor;
+    if (out + 1 + literals + literals / 255 + 1 > outEnd)
+        return 0;
+    unsigned char *token = out++;
+    *token = (unsigned char)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15)
+        out = lzWriteLength(out, literals - 15);
+    memcpy(out, src + anchor, literals);
+    out += literals;
+    return out - dst;
+}
+
+// Reads the continuation bytes of a length whose nibble was 15, false past the end of the block
+inline bool lzReadLength(const unsigned char *&in, const unsigned char *end, size_t &length)
+{
+    unsigned char byte;
+    do
+    {
+        if (in >= end)
+            return false;
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/*
+Decompresses a block of size bytes into dst, which must become exactly expected bytes long.
+Returns false for corrupt input, nothing is read or written outside either buffer.
+*/
+inline bool lzDecompress(const unsigned char *src, size_t size, unsigned char *dst, size_t expected)
+{
+    const unsigned char *in = src;
+    const unsigned char *end = src + size;
+    unsigned char *out = dst;
+    unsigned char *outEnd = dst + expected;
+
+    while (in < end)
+    {
+        unsigned char token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !lzReadLength(in, end, literals))
+            return false;
+        if (literals > (size_t)(end - in) || literals > (size_t)(outEnd - out))
+            return false;
+        memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+        if (in == end)
+            break; // The last sequence has no match
+
+        if (end - in < 2)
+            return false;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15 && !lzReadLength(in, end, length))
+            return false;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(out - dst) || length > (size_t)(outEnd - out))
+            return false;
+
+        const unsigned char *match = out - offset;
+        if (offset >= length)
+            memcpy(out, match, length);
+        else if (offset >= 8)
+        {
+            // Overlapping, but each 8 byte step only reads bytes already written
+            size_t i = 0;
+            for (; i + 8 <= length; i += 8)
+                memcpy(out + i, match + i, 8);
+            for (; i < length; i++)
+                out[i] = match[i];
+        }
+        else
+        {
+            for (size_t i = 0; i < length; i++) // Repeats the last offset bytes
+                out[i] = match[i];
+        }
+        out += length;
+    }
+    return out == outEnd;
+}
@@ -15,32 +15,179 @@
 #include "imgui_impl_opengl3.h"
 #include <stdio.h>
 #define GL_SILENCE_DEPRECATION
+#define EXPORT_BATCH 65536 // Stored packets handed to the export writer per frame
 #if defined(IMGUI_IMPL_OPENGL_ES2)
 #include <GLES2/gl2.h>
 #endif
+#include "app_layer.h"
+#include "display_filter.h"
+#include "hexdump.h"
+#include "pcap_reader.h"
+#include "flow_table.h"
+#include "packet_summary.h"
+#include "pipeline.h"
+#include "pcap_writer.h"
+#include "tcp_reassembly.h"
+#include "timeline.h"
 #include "sniff.h"
+#include "stats.h"
 #include <GLFW/glfw3.h> // Will drag system OpenGL headers
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <utility>
 #include <vector>
-#include <fstream>
 
 static PacketSniffer sniffer;
-static std::vector<std::pair<int, unsigned char *>> capturedPackets;
-static std::pair<int, unsigned char *> selected;
+static PacketStore capturedPackets;
+static PacketSummaries summaries; // Table rows of capturedPackets
+static DisplayFilter displayFilter; // Rows shown when a display filter is set
+static FlowTable flows;
+static TcpReassembler streams; // Fed by the capture workers, read by the Follow Stream tab
+static FlowKey followKey;      // Connection picked for the Follow Stream tab
+static bool followRequested = false;
+static Timeline timeline; // Traffic per time bucket for the Timeline tab, counted as packets arrive
+static StringPool hostNames; // DNS, HTTP and TLS names interned by the capture workers
+static HostTable hosts;      // Per name totals for the Top Hosts tab
+static PacketHandle selected = 0; // Read from the store every frame, spilled packets have no stable address
+static bool hasSelection = false;
+static PcapngWriter recorder; // Streams packets to disk as they are drained while recording
+static PcapReader fileReader; // Feeds an opened capture file into the store a batch per frame
+static PcapngWriter exporter; // Writes the stored packets to a file a batch per frame, see exportPackets()
+static PacketHandle exportNext = 0;
+static PacketHandle exportEnd = 0;
+static DynamicPipeline livePipeline; // Stages the drained packets go through, the recorder joins while recording
+static DynamicPipeline filePipeline; // Stages the packets of an opened file go through
+static MetricsSnapshot metrics; // Refreshed once per second by sampleStats()
+static StatsHistory statsHistory;
+static std::string metricsPath; // Written after every sample when not empty
 
 static void glfw_error_callback(int error, const char *description)
 {
     fprintf(stderr, "GLFW Error %d: %s\n", error, description);
 }
 
+// Continues a running export, the disk writes happen on the writer thread
+static void exportPackets()
+{
+    if (!exporter.isOpen())
+        return;
+    PacketHandle end = exportNext + EXPORT_BATCH < exportEnd ? exportNext + EXPORT_BATCH : exportEnd;
+    capturedPackets.visit(exportNext, end, [](PacketHandle, const Packet &packet) { exporter.write(packet); });
+    exportNext = end;
+    if (exportNext < exportEnd)
+        return;
+    exporter.close();
+    if (exporter.hasFailed())
+        std::cerr << "Unable to write the exported packets" << std::endl;
+}
+
 void drawMain()
 {
     if (ImGui::BeginTabItem("Main"))
     {
         ImGui::Spacing();
+        static int backend = static_cast<int>(CaptureBackend::Ring);
+        ImGui::Text("Capture backend:");
+        ImGui::SameLine();
+        ImGui::RadioButton("recvfrom", &backend, static_cast<int>(CaptureBackend::RecvFrom));
+        ImGui::SameLine();
+        ImGui::RadioButton("TPACKET_V3 ring", &backend, static_cast<int>(CaptureBackend::Ring));
+        ImGui::SameLine();
+        ImGui::RadioButton("recvmmsg", &backend, static_cast<int>(CaptureBackend::RecvMmsg));
+        static int workers = 1;
+        static int fanoutMode = 0;
+        const char *fanoutModes[] = {"Flow hash", "CPU", "Load balance"};
+        const FanoutMode fanoutValues[] = {FanoutMode::Hash, FanoutMode::Cpu, FanoutMode::LoadBalance};
+        ImGui::SliderInt("Capture workers", &workers, 1, 16);
+        if (workers > 1)
+            ImGui::Combo("Fanout mode", &fanoutMode, fanoutModes, IM_ARRAYSIZE(fanoutModes));
+
+        static std::vector<CaptureInterface> interfaces = PacketSniffer::listInterfaces();
+        static int interface = 0; // 0 is every interface, then interfaces[i - 1]
+        const char *interfaceName = interface == 0 ? "All interfaces" : interfaces[interface - 1].name.c_str();
+        if (ImGui::BeginCombo("Interface", interfaceName))
+        {
+            if (ImGui::Selectable("All interfaces", interface == 0) && sniffer.setInterface(""))
+                interface = 0;
+            for (size_t i = 0; i < interfaces.size(); i++)
+            {
+                char label[64];
+                snprintf(label, sizeof(label), "%s%s", interfaces[i].name.c_str(), interfaces[i].up ? "" : " (down)");
+                if (ImGui::Selectable(label, interface == (int)i + 1) && sniffer.setInterface(interfaces[i].name))
+                    interface = (int)i + 1;
+            }
+            ImGui::EndCombo();
+        }
+        static bool promiscuous = false;
+        if (ImGui::Checkbox("Promiscuous mode", &promiscuous))
+            sniffer.setPromiscuous(promiscuous);
+        ImGui::SameLine();
+        static bool hardwareTimestamps = false;
+        if (ImGui::Checkbox("Hardware timestamps", &hardwareTimestamps))
+            sniffer.setTimestampMode(hardwareTimestamps ? TimestampMode::Hardware : TimestampMode::Software);
+        if (sniffer.isCapturing())
+            ImGui::TextDisabled("Interface and modes apply from the next capture");
+
+        static char filter[256] = "";
+        static std::string filterError;
+        bool applyFilter = ImGui::InputText("Capture filter", filter, sizeof(filter),
+                                            ImGuiInputTextFlags_EnterReturnsTrue);
+        ImGui::SameLine();
+        if (ImGui::Button("Apply filter") || applyFilter)
+        {
+            if (sniffer.setFilter(filter, filterError))
+                filterError.clear();
+        }
+
+        static int snaplen = 0;
+        static bool headersOnly = false;
+        bool applySnaplen = ImGui::InputInt("Snaplen (0 keeps whole packets)", &snaplen);
+        applySnaplen |= ImGui::Checkbox("Headers only", &headersOnly);
+        if (applySnaplen)
+        {
+            if (snaplen < 0)
+                snaplen = 0;
+            sniffer.setSnaplen(snaplen, headersOnly);
+        }
+        if (!filterError.empty())
+            ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "%s", filterError.c_str());
+        else if (!sniffer.getFilter().empty())
+            ImGui::TextDisabled("Filtering in the kernel: %s", sniffer.getFilter().c_str());
+
+        static int memoryMegabytes = (int)(STORE_MEMORY_LIMIT >> 20);
+        if (ImGui::InputInt("Packet memory limit (MiB)", &memoryMegabytes))
+        {
+            if (memoryMegabytes < 8)
+                memoryMegabytes = 8; // Two chunks, the one being filled and the one spilled next
+            capturedPackets.setMemoryLimit((size_t)memoryMegabytes << 20);
+        }
+        static char spillDirectory[256] = "/tmp";
+        static bool spilling = false;
+        static std::string spillError;
+        ImGui::InputText("Spill directory", spillDirectory, sizeof(spillDirectory));
+        ImGui::SameLine();
+        if (ImGui::Checkbox("Spill to disk at the limit", &spilling))
+        {
+            // The file only takes over empty stores, handles of packets already dropped cannot be recovered
+            if (!capturedPackets.setSpillDirectory(spilling ? spillDirectory : ""))
+            {
+                spillError = capturedPackets.empty() ? "Unable to create a spill file in " + std::string(spillDirectory)
+                                                     : "Clear the captured packets before changing spilling";
+                spilling = capturedPackets.isSpilling();
+            }
+            else
+            {
+                spillError.clear();
+            }
+        }
+        if (!spillError.empty())
+            ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "%s", spillError.c_str());
+
         if (ImGui::Button("Begin capture"))
         {
-            sniffer.startCapture(capturedPackets);
+            if (!sniffer.startCapture(static_cast<CaptureBackend>(backend), workers, fanoutValues[fanoutMode]))
+                std::cerr << "Unable to start capture" << std::endl;
         }
         ImGui::SameLine();
         if (ImGui::Button("Stop capture"))
@@ -50,30 +197,45 @@ void drawMain()
         ImGui::SameLine();
         if (ImGui::Button("Clear captured packets"))
         {
-            // Since captured packets contain pointers to unsigned char arrays,
-            // we delete[] each array to free the dynamically allocated memory
-            for (auto packet : capturedPackets)
-            {
-                delete[] packet.second;
-            }
+            // The store owns the packet data, the selection points into it
+            hasSelection = false;
+            exporter.close();
+            fileReader.close();
             capturedPackets.clear();
+            summaries.clear();
+            displayFilter.clear();
+            flows.clear();
+            streams.clear();
+            timeline.clear();
+            hosts.clear();
+            if (!sniffer.isCapturing())
+                hostNames.clear(); // Queued packets of a running capture still refer to the names
         }
         ImGui::Separator();
         ImGui::Spacing();
-        ImGui::Text("Writes the data of ALL captured packets to the file");
+        ImGui::Text("Writes ALL captured packets to a pcapng file");
         static std::string filename(256, '\0');
+        static int rotateMegabytes = 0;
+        static int rotateSeconds = 0;
+        static bool directIo = false;
 
         ImGui::InputText("Filename", &filename[0], filename.size());
-        if (ImGui::Button("Write to file"))
+        if (exporter.isOpen())
         {
-            std::ofstream file(filename);
-            if (file.is_open())
+            // Packets stored after the button was pressed are not exported
+            ImGui::Text("Writing %llu of %llu packets", (unsigned long long)exportNext,
+                        (unsigned long long)exportEnd);
+            ImGui::SameLine();
+            if (ImGui::Button("Cancel"))
+                exporter.close();
+        }
+        else if (ImGui::Button("Write to file"))
+        {
+            if (exporter.open(filename.c_str()))
             {
-                for (auto p : capturedPackets)
-                {
-                    file << sniffer.printData(p);
-                }
-                file.close();
+                exportNext = 0;
+                exportEnd = capturedPackets.size();
+                exportPackets();
             }
             else
             {
@@ -81,9 +243,90 @@ void drawMain()
             }
         }
 
+        ImGui::SameLine();
+        static std::string openError;
+        if (ImGui::Button("Open file"))
+        {
+            // Replaces the captured packets with the contents of a pcap or pcapng file
+            sniffer.stopCapture();
+            exporter.close();
+            hasSelection = false;
+            capturedPackets.clear();
+            summaries.clear();
+            displayFilter.clear();
+            flows.clear();
+            streams.clear();
+            timeline.clear();
+            hosts.clear();
+            hostNames.clear();
+            if (fileReader.open(filename.c_str(), openError))
+            {
+                openError.clear();
+                if (fileReader.linkType() != LINKTYPE_ETHERNET)
+                    openError = "Only Ethernet frames are decoded, the file uses link type " +
+                                std::to_string(fileReader.linkType());
+                else if (fileReader.isTruncated())
+                    openError = "The file is truncated, the last packet was skipped";
+            }
+        }
+        if (!openError.empty())
+            ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "%s", openError.c_str());
+
+        ImGui::Spacing();
+        ImGui::Text("Streams new packets to the file while they are captured");
+        ImGui::InputInt("Rotate after MiB (0 = never)", &rotateMegabytes);
+        ImGui::InputInt("Rotate after seconds (0 = never)", &rotateSeconds);
+        ImGui::Checkbox("Direct I/O (bypass the page cache)", &directIo);
+        if (!recorder.isOpen())
+        {
+            if (ImGui::Button("Start recording"))
+            {
+                PcapWriterOptions options;
+                options.rotateBytes = rotateMegabytes > 0 ? (unsigned long long)rotateMegabytes << 20 : 0;
+                options.rotateSeconds = rotateSeconds > 0 ? rotateSeconds : 0;
+                options.directIo = directIo;
+                if (recorder.open(filename.c_str(), options))
+                    livePipeline.add("recorder", WriterSink(recorder));
+                else
+                    std::cerr << "Unable to open file" << std::endl;
+            }
+        }
+        else
+        {
+            if (ImGui::Button("Stop recording"))
+            {
+                livePipeline.remove("recorder");
+                recorder.close();
+            }
+            ImGui::SameLine();
+            ImGui::Text("%llu packets, %.1f MiB in %u files%s", recorder.packetsWritten(),
+                        recorder.getBytesWritten() / (1024.0 * 1024.0), recorder.getFilesWritten(),
+                        recorder.hasFailed() ? ", write errors" : "");
+        }
+
         ImGui::Spacing();
         long packetQuantity = capturedPackets.size();
         ImGui::Text("Captured Packets: %ld", packetQuantity);
+        std::string stages;
+        for (size_t i = 0; i < livePipeline.stageCount(); i++)
+            stages += (i ? ", " : "") + livePipeline.stageName(i);
+        ImGui::Text("Drained packets go through: %s", stages.c_str());
+        ImGui::Text("Packet memory: %.1f MiB, %llu packets dropped at the memory limit",
+                    capturedPackets.memoryUsage() / (1024.0 * 1024.0),
+                    capturedPackets.droppedPackets());
+        if (capturedPackets.isSpilling())
+        {
+            const SpillFile &spill = capturedPackets.getSpillFile();
+            unsigned long long hits, misses;
+            spill.getCacheStats(hits, misses);
+            ImGui::Text("Spilled: %llu packets in %zu segments, %.1f MiB on disk for %.1f MiB, cache %llu hits, %llu misses",
+                        (unsigned long long)capturedPackets.firstResident(), spill.segmentCount(),
+                        spill.storedBytes() / (1024.0 * 1024.0), spill.rawBytes() / (1024.0 * 1024.0), hits, misses);
+        }
+        CaptureStats stats = sniffer.getKernelStats();
+        ImGui::Text("Kernel: %llu received, %llu dropped", stats.packets, stats.drops);
+        ImGui::Text("Queue: %zu waiting, %llu dropped on overflow",
+                    sniffer.queueDepth(), sniffer.queueOverflows());
 
         ImGui::EndTabItem();
     }
@@ -96,131 +339,935 @@ void drawUpperPane()
                              ImGui::GetWindowHeight() / 2),
                       ImGuiWindowFlags_NoScrollbar |
                           ImGuiWindowFlags_NoScrollWithMouse);
-    if (ImGui::BeginTable("tab1", 4,
+    if (ImGui::BeginTable("tab1", 6,
                           ImGuiTableFlags_BordersOuter |
                               ImGuiTableFlags_BordersV |
                               ImGuiTableFlags_Resizable |
-                              ImGuiTableFlags_SizingStretchSame))
+                              ImGuiTableFlags_SizingStretchSame |
+                              ImGuiTableFlags_ScrollY))
     {
+        ImGui::TableSetupScrollFreeze(0, 1); // Keep the header visible
         ImGui::TableSetupColumn("Source");
         ImGui::TableSetupColumn("Destination");
         ImGui::TableSetupColumn("Protocol");
         ImGui::TableSetupColumn("Size");
+        ImGui::TableSetupColumn("Application");
+        ImGui::TableSetupColumn("Host");
         ImGui::TableHeadersRow();
 
-        for (long unsigned int i = 0; i < capturedPackets.size(); i++)
-        {
-            const auto &data = capturedPackets[i];
-
-            struct ethhdr *eth =
-                reinterpret_cast<struct ethhdr *>(data.second);
-
-            char source[64];
-            char dest[64];
-            char proto[16];
-            char size[64];
-            snprintf(source, sizeof(source), "%.2X:%.2X:%.2X:%.2X:%.2X:%.2X",
-                     eth->h_source[0], eth->h_source[1], eth->h_source[2],
-                     eth->h_source[3], eth->h_source[4], eth->h_source[5]);
-            snprintf(dest, sizeof(dest), "%.2X:%.2X:%.2X:%.2X:%.2X:%.2X",
-                     eth->h_dest[0], eth->h_dest[1], eth->h_dest[2],
-                     eth->h_dest[3], eth->h_dest[4], eth->h_dest[5]);
-            snprintf(proto, sizeof(proto), "%u",
-                     static_cast<unsigned short>(eth->h_proto));
-            snprintf(size, sizeof(size), "%d", (data.first));
-            ImGui::TableNextRow();
-            ImGui::TableSetColumnIndex(0);
-            if (ImGui::Selectable(source, selected == capturedPackets[i],
-                                  ImGuiSelectableFlags_AllowDoubleClick |
-                                      ImGuiSelectableFlags_SpanAllColumns))
-                selected = capturedPackets[i];
-            ImGui::TableSetColumnIndex(1);
-            if (ImGui::Selectable(dest, selected == capturedPackets[i],
-                                  ImGuiSelectableFlags_AllowDoubleClick |
-                                      ImGuiSelectableFlags_SpanAllColumns))
-                selected = capturedPackets[i];
-            ImGui::TableSetColumnIndex(2);
-            if (ImGui::Selectable(proto, selected == capturedPackets[i],
-                                  ImGuiSelectableFlags_AllowDoubleClick |
-                                      ImGuiSelectableFlags_SpanAllColumns))
-                selected = capturedPackets[i];
-            ImGui::TableSetColumnIndex(3);
-            if (ImGui::Selectable(size, selected == capturedPackets[i],
-                                  ImGuiSelectableFlags_AllowDoubleClick |
-                                      ImGuiSelectableFlags_SpanAllColumns))
-                selected = capturedPackets[i];
-            ImGui::TableNextRow();
+        // Only the visible rows are formatted, from the summaries decoded when the packets arrived
+        ImGuiListClipper clipper;
+        // With a display filter the rows are the matching packets of its index
+        bool filtered = displayFilter.isActive();
+        clipper.Begin((int)(filtered ? displayFilter.size() : summaries.size()));
+        while (clipper.Step())
+        {
+            for (int row = clipper.DisplayStart; row < clipper.DisplayEnd; row++)
+            {
+                PacketHandle i = filtered ? displayFilter[row] : row;
+
+                char source[24];
+                char dest[24];
+                PacketSummaries::formatMac(summaries.source(i), source, sizeof(source));
+                PacketSummaries::formatMac(summaries.destination(i), dest, sizeof(dest));
+
+                ImGui::TableNextRow();
+                ImGui::TableSetColumnIndex(0);
+                ImGui::PushID(row);
+                if (ImGui::Selectable(source, hasSelection && selected == i,
+                                      ImGuiSelectableFlags_AllowDoubleClick |
+                                          ImGuiSelectableFlags_SpanAllColumns))
+                {
+                    selected = i;
+                    hasSelection = true;
+                }
+                ImGui::PopID();
+                ImGui::TableSetColumnIndex(1);
+                ImGui::TextUnformatted(dest);
+                ImGui::TableSetColumnIndex(2);
+                const char *protocol = summaries.protocolName(i);
+                if (protocol)
+                    ImGui::TextUnformatted(protocol);
+                else
+                    ImGui::Text("0x%.4X", summaries.etherType(i));
+                ImGui::TableSetColumnIndex(3);
+                ImGui::Text("%u", summaries.packetSize(i));
+                const char *application = applicationName(summaries.application(i));
+                if (application)
+                {
+                    const char *name = hostNames.lookup(summaries.hostName(i));
+                    ImGui::TableSetColumnIndex(4);
+                    ImGui::TextUnformatted(application);
+                    ImGui::TableSetColumnIndex(5);
+                    ImGui::TextUnformatted(name ? name : "");
+                }
+            }
         }
+        clipper.End();
         ImGui::EndTable();
     }
     ImGui::EndChild();
 }
 
+// Bytes of the header under the mouse, highlighted in the hex view
+static unsigned int highlightStart = 0;
+static unsigned int highlightEnd = 0;
+
+static void highlightIfHovered(unsigned int start, unsigned int end)
+{
+    if (ImGui::IsItemHovered())
+    {
+        highlightStart = start;
+        highlightEnd = end;
+    }
+}
+
+// Tree node of a header, hovering it highlights the bytes from start to end
+static bool headerNode(const char *label, unsigned int start, unsigned int end)
+{
+    bool open = ImGui::TreeNode(label);
+    highlightIfHovered(start, end);
+    return open;
+}
+
+// Hex and ASCII dump of the selected packet, only the lines on screen are formatted
+static void drawHexView(const unsigned char *data, unsigned int size)
+{
+    ImGui::BeginChild("hex view", ImVec2(0, 0), ImGuiChildFlags_Border);
+    float charWidth = ImGui::CalcTextSize("0").x;
+    float lineHeight = ImGui::GetTextLineHeight();
+    ImU32 highlight = ImGui::GetColorU32(ImGuiCol_TextSelectedBg);
+    ImGuiListClipper clipper;
+    clipper.Begin((int)((size + HEXDUMP_LINE_BYTES - 1) / HEXDUMP_LINE_BYTES));
+    while (clipper.Step())
+    {
+        for (int line = clipper.DisplayStart; line < clipper.DisplayEnd; line++)
+        {
+            unsigned int offset = line * HEXDUMP_LINE_BYTES;
+            char text[HEXDUMP_LINE_SIZE];
+            size_t length = hexdumpLine(data + offset, size - offset, offset, text);
+
+            ImVec2 origin = ImGui::GetCursorScreenPos();
+            unsigned int first = highlightStart > offset ? highlightStart : offset;
+            unsigned int last = highlightEnd < offset + HEXDUMP_LINE_BYTES ? highlightEnd : offset + HEXDUMP_LINE_BYTES;
+            if (first < last)
+            {
+                ImDrawList *drawList = ImGui::GetWindowDrawList();
+                size_t from = first - offset;
+                size_t to = last - offset;
+                drawList->AddRectFilled(ImVec2(origin.x + hexdumpColumn(from) * charWidth, origin.y),
+                                        ImVec2(origin.x + (hexdumpColumn(to - 1) + 2) * charWidth, origin.y + lineHeight),
+                                        highlight);
+                drawList->AddRectFilled(ImVec2(origin.x + (HEXDUMP_ASCII_COLUMN + from) * charWidth, origin.y),
+                                        ImVec2(origin.x + (HEXDUMP_ASCII_COLUMN + to) * charWidth, origin.y + lineHeight),
+                                        highlight);
+            }
+            ImGui::TextUnformatted(text, text + length - 1); // Without the newline
+        }
+    }
+    clipper.End();
+    ImGui::EndChild();
+}
+
+// Names found by dissectApplication(), with the request line or answers parsed again from the captured bytes
+static void drawApplicationLayer(const Packet &packet)
+{
+    const PacketInfo &info = packet.info;
+    const char *application = applicationName(info.application);
+    unsigned int size = packet.size;
+    if (!application || info.payloadOffset >= size || !headerNode(application, info.payloadOffset, size))
+        return;
+
+    const char *name = hostNames.lookup(info.name);
+    const unsigned char *payload = packet.data + info.payloadOffset;
+    size_t length = size - info.payloadOffset;
+    HttpRequest request;
+    switch (info.application)
+    {
+    case ApplicationLayer::DnsQuery:
+    case ApplicationLayer::DnsResponse:
+    {
+        if (info.transport == TransportLayer::Tcp && length >= 2)
+        {
+            payload += 2;
+            length -= 2;
+        }
+        ImGui::Text("Query: %s", name ? name : "");
+        if (info.application == ApplicationLayer::DnsQuery)
+            break;
+        unsigned int answers = parseDnsAnswers(payload, length, [payload, length](const DnsRecord &record)
+                                               {
+                                                   char text[APP_NAME_SIZE];
+                                                   size_t textLength, next;
+                                                   bool named = record.type == 2 || record.type == 5 || record.type == 12; // NS, CNAME, PTR
+                                                   if (record.type == 1 && record.dataLength == 4)
+                                                       inet_ntop(AF_INET, payload + record.dataOffset, text, sizeof(text));
+                                                   else if (record.type == 28 && record.dataLength == 16)
+                                                       inet_ntop(AF_INET6, payload + record.dataOffset, text, sizeof(text));
+                                                   else if (!named || !parseDnsName(payload, length, record.dataOffset, text, textLength, next))
+                                                       snprintf(text, sizeof(text), "%u bytes", record.dataLength);
+                                                   ImGui::Text("%s: type %u, TTL %u, %s", record.name, record.type, record.ttl, text);
+                                               });
+        ImGui::Text("Answers: %u, rcode %u", answers, length >= 4 ? payload[3] & 0x0fu : 0u);
+        break;
+    }
+    case ApplicationLayer::HttpRequest:
+        if (parseHttpRequest(payload, length, request))
+            ImGui::Text("Request: %.*s %.*s HTTP/1.%u", (int)request.methodLength, request.method,
+                        (int)request.targetLength, request.target, request.minorVersion);
+        ImGui::Text("Host: %s", name ? name : "");
+        break;
+    case ApplicationLayer::TlsClientHello:
+        ImGui::Text("Server Name: %s", name ? name : "(none captured)");
+        break;
+    default:
+        break;
+    }
+    ImGui::TreePop();
+}
+
+// Layers come from the PacketInfo filled by the capture worker, each one is only shown if its header was captured
 void drawLowerPane()
 {
     ImGui::BeginChild("bottom pane",
                       ImVec2(ImGui::GetWindowWidth() - 15,
                              ImGui::GetWindowHeight() / 2),
                       ImGuiChildFlags_Border);
-    if (ImGui::TreeNode("Data Link Header"))
+    if (!hasSelection || selected >= capturedPackets.size())
     {
-        if (selected.first)
-        {
-            struct ethhdr *eth = reinterpret_cast<struct ethhdr *>(selected.second);
-            ImGui::Text("Destination Address: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X",
-                        eth->h_source[0], eth->h_source[1], eth->h_source[2],
-                        eth->h_source[3], eth->h_source[4], eth->h_source[5]);
-            ImGui::Text("Source Address: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X",
-                        eth->h_dest[0], eth->h_dest[1], eth->h_dest[2],
-                        eth->h_dest[3], eth->h_dest[4], eth->h_dest[5]);
-            ImGui::Text("Protocol: %u",
-                        static_cast<unsigned short>(eth->h_proto));
-        }
-        else
-            ImGui::Text("No packet selected");
+        ImGui::Text("No packet selected");
+        ImGui::EndChild();
+        return;
+    }
+
+    const Packet &packet = capturedPackets[selected];
+    const PacketInfo &info = packet.info;
+    const unsigned char *data = packet.data;
+    unsigned int size = packet.size;
+    highlightStart = highlightEnd = 0;
+    unsigned int networkEnd = info.transport != TransportLayer::None ? info.transportOffset : info.payloadOffset;
+    if (info.flags & DISSECT_TRUNCATED)
+        ImGui::TextDisabled("Frame truncated, %u bytes captured", size);
+
+    const char *timestampSources[] = {"unknown clock", "user space clock", "kernel clock", "hardware clock"};
+    time_t seconds = (time_t)(packet.timestamp / 1000000000ULL);
+    struct tm local;
+    char arrival[32];
+    localtime_r(&seconds, &local);
+    strftime(arrival, sizeof(arrival), "%Y-%m-%d %H:%M:%S", &local);
+    ImGui::Text("Arrival Time: %s.%09llu (%s)", arrival, packet.timestamp % 1000000000ULL,
+                timestampSources[static_cast<int>(packet.timestampSource)]);
+    if (packet.wireLength > size)
+        ImGui::Text("Frame Length: %u bytes on wire, %u bytes captured", packet.wireLength, size);
+    else
+        ImGui::Text("Frame Length: %u bytes", size);
+
+    if (size >= 14 && headerNode("Data Link Header", 0, info.network != NetworkLayer::None ? info.networkOffset : info.payloadOffset))
+    {
+        const struct ethhdr *eth = reinterpret_cast<const struct ethhdr *>(data);
+        ImGui::Text("Destination Address: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X",
+                    eth->h_dest[0], eth->h_dest[1], eth->h_dest[2],
+                    eth->h_dest[3], eth->h_dest[4], eth->h_dest[5]);
+        ImGui::Text("Source Address: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X",
+                    eth->h_source[0], eth->h_source[1], eth->h_source[2],
+                    eth->h_source[3], eth->h_source[4], eth->h_source[5]);
+        for (int i = 0; i < info.vlanCount; i++)
+            ImGui::Text("VLAN ID: %u", info.vlanIds[i]);
+        ImGui::Text("Protocol: 0x%.4X", info.etherType);
         ImGui::TreePop();
     }
-    if (ImGui::TreeNode("IP Header"))
+
+    if (info.network == NetworkLayer::IPv4 && info.networkOffset + sizeof(struct iphdr) <= size &&
+        headerNode("IP Header", info.networkOffset, networkEnd))
     {
-        if (selected.first)
-        {
-            struct iphdr *iph =
-                (struct iphdr *)(selected.second +
-                                 sizeof(struct ethhdr));
-            struct sockaddr_in source, dest;
-            source.sin_addr.s_addr = iph->saddr;
-            dest.sin_addr.s_addr = iph->daddr;
-            ImGui::Text("IP Version: %d", iph->version);
-            ImGui::Text("IP Header Length: %d bytes\n",
-                        ((unsigned int)(iph->ihl)) * 4);
-            ImGui::Text("Type Of Service: %d\n", (unsigned int)iph->tos);
-            ImGui::Text("IP Total Length: %d  bytes (Size of Packet)\n",
-                        ntohs(iph->tot_len));
-            ImGui::Text("Identification: %d\n", ntohs(iph->id));
-            ImGui::Text("TTL: %d\n", (unsigned int)iph->ttl);
-            ImGui::Text("Protocol: %d\n", (unsigned int)iph->protocol);
-            ImGui::Text("Checksum: %d\n", ntohs(iph->check));
-            ImGui::Text("Source IP: %s\n", inet_ntoa(source.sin_addr));
-            ImGui::Text("Destination IP: %s\n", inet_ntoa(dest.sin_addr));
-        }
-        else
-            ImGui::Text("No packet selected");
+        const struct iphdr *iph = reinterpret_cast<const struct iphdr *>(data + info.networkOffset);
+        struct in_addr source, dest;
+        source.s_addr = iph->saddr;
+        dest.s_addr = iph->daddr;
+        char sourceText[INET_ADDRSTRLEN], destText[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &source, sourceText, sizeof(sourceText));
+        inet_ntop(AF_INET, &dest, destText, sizeof(destText));
+        ImGui::Text("IP Version: %d", iph->version);
+        ImGui::Text("IP Header Length: %d bytes", ((unsigned int)(iph->ihl)) * 4);
+        ImGui::Text("Type Of Service: %d", (unsigned int)iph->tos);
+        ImGui::Text("IP Total Length: %d  bytes (Size of Packet)", ntohs(iph->tot_len));
+        ImGui::Text("Identification: %d", ntohs(iph->id));
+        if (info.flags & DISSECT_FRAGMENT)
+            ImGui::Text("Fragment Offset: %d bytes", (ntohs(iph->frag_off) & 0x1fff) * 8);
+        ImGui::Text("TTL: %d", (unsigned int)iph->ttl);
+        ImGui::Text("Protocol: %d", (unsigned int)iph->protocol);
+        ImGui::Text("Checksum: 0x%.4X", ntohs(iph->check));
+        ImGui::Text("Source IP: %s", sourceText);
+        ImGui::Text("Destination IP: %s", destText);
         ImGui::TreePop();
     }
+
+    if (info.network == NetworkLayer::IPv6 && info.networkOffset + sizeof(struct ip6_hdr) <= size &&
+        headerNode("IPv6 Header", info.networkOffset, networkEnd))
+    {
+        const struct ip6_hdr *ip6 = reinterpret_cast<const struct ip6_hdr *>(data + info.networkOffset);
+        char sourceText[INET6_ADDRSTRLEN], destText[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &ip6->ip6_src, sourceText, sizeof(sourceText));
+        inet_ntop(AF_INET6, &ip6->ip6_dst, destText, sizeof(destText));
+        ImGui::Text("Traffic Class: %u", (ntohl(ip6->ip6_flow) >> 20) & 0xff);
+        ImGui::Text("Flow Label: 0x%.5X", ntohl(ip6->ip6_flow) & 0xfffff);
+        ImGui::Text("Payload Length: %d bytes", ntohs(ip6->ip6_plen));
+        ImGui::Text("Next Header: %u", ip6->ip6_nxt);
+        ImGui::Text("Hop Limit: %u", ip6->ip6_hlim);
+        ImGui::Text("Source IP: %s", sourceText);
+        ImGui::Text("Destination IP: %s", destText);
+        if (info.flags & DISSECT_IPV6_EXT)
+            ImGui::Text("Extension headers: %u bytes, upper layer %u",
+                        info.transportOffset ? info.transportOffset - info.networkOffset - 40 : 0, info.ipProtocol);
+        ImGui::TreePop();
+    }
+
+    if (info.network == NetworkLayer::Arp && info.networkOffset + 28u <= size && headerNode("ARP", info.networkOffset, networkEnd))
+    {
+        const unsigned char *arp = data + info.networkOffset;
+        ImGui::Text("Operation: %s", dissectRead16(arp + 6) == 1 ? "Request" : dissectRead16(arp + 6) == 2 ? "Reply" : "Other");
+        ImGui::Text("Sender: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X %u.%u.%u.%u", arp[8], arp[9], arp[10], arp[11],
+                    arp[12], arp[13], arp[14], arp[15], arp[16], arp[17]);
+        ImGui::Text("Target: %.2X:%.2X:%.2X:%.2X:%.2X:%.2X %u.%u.%u.%u", arp[18], arp[19], arp[20], arp[21],
+                    arp[22], arp[23], arp[24], arp[25], arp[26], arp[27]);
+        ImGui::TreePop();
+    }
+
+    if (info.transport == TransportLayer::Tcp && info.transportOffset + sizeof(struct tcphdr) <= size &&
+        headerNode("TCP Header", info.transportOffset, info.payloadOffset))
+    {
+        const struct tcphdr *tcp = reinterpret_cast<const struct tcphdr *>(data + info.transportOffset);
+        ImGui::Text("Source Port: %u", ntohs(tcp->source));
+        ImGui::Text("Destination Port: %u", ntohs(tcp->dest));
+        ImGui::Text("Sequence Number: %u", ntohl(tcp->seq));
+        ImGui::Text("Acknowledgement Number: %u", ntohl(tcp->ack_seq));
+        ImGui::Text("Header Length: %u bytes", tcp->doff * 4u);
+        ImGui::Text("Flags:%s%s%s%s%s%s", tcp->syn ? " SYN" : "", tcp->ack ? " ACK" : "", tcp->fin ? " FIN" : "",
+                    tcp->rst ? " RST" : "", tcp->psh ? " PSH" : "", tcp->urg ? " URG" : "");
+        ImGui::Text("Window: %u", ntohs(tcp->window));
+        ImGui::Text("Checksum: 0x%.4X", ntohs(tcp->check));
+        ImGui::TreePop();
+    }
+
+    if (info.transport == TransportLayer::Udp && info.transportOffset + sizeof(struct udphdr) <= size &&
+        headerNode("UDP Header", info.transportOffset, info.payloadOffset))
+    {
+        const struct udphdr *udp = reinterpret_cast<const struct udphdr *>(data + info.transportOffset);
+        ImGui::Text("Source Port: %u", ntohs(udp->source));
+        ImGui::Text("Destination Port: %u", ntohs(udp->dest));
+        ImGui::Text("Length: %u bytes", ntohs(udp->len));
+        ImGui::Text("Checksum: 0x%.4X", ntohs(udp->check));
+        ImGui::TreePop();
+    }
+
+    if ((info.transport == TransportLayer::Icmp || info.transport == TransportLayer::Icmpv6) &&
+        info.transportOffset + 4u <= size &&
+        headerNode(info.transport == TransportLayer::Icmp ? "ICMP Header" : "ICMPv6 Header", info.transportOffset,
+                   info.payloadOffset))
+    {
+        const unsigned char *icmp = data + info.transportOffset;
+        ImGui::Text("Type: %u", icmp[0]);
+        ImGui::Text("Code: %u", icmp[1]);
+        ImGui::Text("Checksum: 0x%.4X", dissectRead16(icmp + 2));
+        ImGui::TreePop();
+    }
+
+    if (info.payloadOffset < size)
+    {
+        ImGui::Text("Payload: %u bytes", size - info.payloadOffset);
+        highlightIfHovered(info.payloadOffset, size);
+    }
+    drawApplicationLayer(packet);
+    if (info.transport == TransportLayer::Tcp && ImGui::Button("Follow TCP stream"))
+        followRequested = FlowTable::makeKey(packet, followKey);
+    drawHexView(data, size);
     ImGui::EndChild();
 }
 
+static void drawDisplayFilter()
+{
+    static char expression[256] = "";
+    static std::string error;
+    bool apply = ImGui::InputText("Display filter", expression, sizeof(expression),
+                                  ImGuiInputTextFlags_EnterReturnsTrue);
+    ImGui::SameLine();
+    if (ImGui::Button("Apply") || apply)
+    {
+        if (displayFilter.setExpression(expression, error))
+        {
+            error.clear();
+            displayFilter.update(capturedPackets);
+        }
+    }
+    if (!error.empty())
+        ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "%s", error.c_str());
+    else if (displayFilter.isActive())
+        ImGui::TextDisabled("%zu of %zu packets shown%s", displayFilter.size(), capturedPackets.size(),
+                            displayFilter.hasTimeRange() ? ", limited to the range selected in the Timeline tab" : "");
+}
+
 void drawCapturedPackets()
 {
     if (ImGui::BeginTabItem("Capture Packets"))
     {
         ImGui::Spacing();
+        drawDisplayFilter();
         drawUpperPane();
         drawLowerPane();
         ImGui::EndTabItem();
     }
 }
 
+static void formatEndpoint(const FlowKey &key, const unsigned char *address, unsigned short port, char *text,
+                           size_t length)
+{
+    char host[INET6_ADDRSTRLEN];
+    inet_ntop(key.version == 4 ? AF_INET : AF_INET6, address, host, sizeof(host));
+    if (key.protocol == IPPROTO_TCP || key.protocol == IPPROTO_UDP)
+        snprintf(text, length, key.version == 4 ? "%s:%u" : "[%s]:%u", host, port);
+    else
+        snprintf(text, length, "%s", host);
+}
+
+void drawFlows()
+{
+    if (ImGui::BeginTabItem("Flows"))
+    {
+        ImGui::Spacing();
+        ImGui::Text("Active flows: %zu, %llu expired, %llu not tracked because the table was full",
+                    flows.size(), flows.expiredFlows(), flows.refusedFlows());
+
+        // Only the top list is copied and sorted, the table itself is never scanned
+        static std::vector<Flow> topFlows;
+        flows.topFlows(topFlows);
+        if (ImGui::BeginTable("flows", 7,
+                              ImGuiTableFlags_BordersOuter | ImGuiTableFlags_BordersV |
+                                  ImGuiTableFlags_Resizable | ImGuiTableFlags_RowBg | ImGuiTableFlags_ScrollY))
+        {
+            ImGui::TableSetupScrollFreeze(0, 1);
+            ImGui::TableSetupColumn("Protocol");
+            ImGui::TableSetupColumn("Endpoint A");
+            ImGui::TableSetupColumn("Endpoint B");
+            ImGui::TableSetupColumn("Packets");
+            ImGui::TableSetupColumn("Bytes");
+            ImGui::TableSetupColumn("Duration");
+            ImGui::TableSetupColumn("TCP flags");
+            ImGui::TableHeadersRow();
+
+            for (size_t i = 0; i < topFlows.size(); i++)
+            {
+                const Flow &flow = topFlows[i];
+                char endpointA[64], endpointB[64];
+                formatEndpoint(flow.key, flow.key.addressA, flow.key.portA, endpointA, sizeof(endpointA));
+                formatEndpoint(flow.key, flow.key.addressB, flow.key.portB, endpointB, sizeof(endpointB));
+
+                ImGui::TableNextRow();
+                ImGui::TableSetColumnIndex(0);
+                if (flow.key.protocol == IPPROTO_TCP)
+                {
+                    // Clicking a TCP row follows its stream
+                    ImGui::PushID((int)i);
+                    if (ImGui::Selectable("TCP", false, ImGuiSelectableFlags_SpanAllColumns))
+                    {
+                        followKey = flow.key;
+                        followRequested = true;
+                    }
+                    ImGui::PopID();
+                }
+                else if (flow.key.protocol == IPPROTO_UDP)
+                    ImGui::TextUnformatted("UDP");
+                else
+                    ImGui::Text("%u", flow.key.protocol);
+                ImGui::TableSetColumnIndex(1);
+                ImGui::TextUnformatted(endpointA);
+                ImGui::TableSetColumnIndex(2);
+                ImGui::TextUnformatted(endpointB);
+                ImGui::TableSetColumnIndex(3);
+                ImGui::Text("%llu", flow.stats.packets);
+                ImGui::TableSetColumnIndex(4);
+                ImGui::Text("%llu", flow.stats.bytes);
+                ImGui::TableSetColumnIndex(5);
+                ImGui::Text("%.3f s", (flow.stats.lastSeen - flow.stats.firstSeen) / 1e9);
+                ImGui::TableSetColumnIndex(6);
+                unsigned char f = flow.stats.tcpFlags;
+                ImGui::Text("%s%s%s%s", f & 0x02 ? "SYN " : "", f & 0x10 ? "ACK " : "", f & 0x01 ? "FIN " : "",
+                            f & 0x04 ? "RST" : "");
+            }
+            ImGui::EndTable();
+        }
+        ImGui::EndTabItem();
+    }
+}
+
+void drawTopHosts()
+{
+    if (ImGui::BeginTabItem("Top Hosts"))
+    {
+        ImGui::Spacing();
+        ImGui::Text("Names seen: %zu, %zu interned in %.1f KiB, %llu not kept because the pool was full",
+                    hosts.size(), hostNames.size(), hostNames.memoryUsage() / 1024.0, hostNames.refusedStrings());
+
+        // Ranking scans every name, so the list is refreshed once per second
+        static std::vector<HostStats> topHosts;
+        static unsigned long long ranked = 0;
+        if (statsClock() - ranked >= 1000000000ULL || topHosts.size() > hosts.size())
+        {
+            hosts.topHosts(topHosts);
+            ranked = statsClock();
+        }
+        if (ImGui::BeginTable("hosts", 6,
+                              ImGuiTableFlags_BordersOuter | ImGuiTableFlags_BordersV |
+                                  ImGuiTableFlags_Resizable | ImGuiTableFlags_RowBg | ImGuiTableFlags_ScrollY))
+        {
+            ImGui::TableSetupScrollFreeze(0, 1);
+            ImGui::TableSetupColumn("Host");
+            ImGui::TableSetupColumn("DNS");
+            ImGui::TableSetupColumn("HTTP requests");
+            ImGui::TableSetupColumn("TLS handshakes");
+            ImGui::TableSetupColumn("First seen");
+            ImGui::TableSetupColumn("Last seen");
+            ImGui::TableHeadersRow();
+
+            for (size_t i = 0; i < topHosts.size(); i++)
+            {
+                const HostStats &host = topHosts[i];
+                const char *name = hostNames.lookup(host.name);
+                char first[32], last[32];
+                time_t seconds = (time_t)(host.firstSeen / 1000000000ULL);
+                struct tm local;
+                localtime_r(&seconds, &local);
+                strftime(first, sizeof(first), "%H:%M:%S", &local);
+                seconds = (time_t)(host.lastSeen / 1000000000ULL);
+                localtime_r(&seconds, &local);
+                strftime(last, sizeof(last), "%H:%M:%S", &local);
+
+                ImGui::TableNextRow();
+                ImGui::TableSetColumnIndex(0);
+                ImGui::TextUnformatted(name ? name : "");
+                ImGui::TableSetColumnIndex(1);
+                ImGui::Text("%llu", host.lookups);
+                ImGui::TableSetColumnIndex(2);
+                ImGui::Text("%llu", host.requests);
+                ImGui::TableSetColumnIndex(3);
+                ImGui::Text("%llu", host.handshakes);
+                ImGui::TableSetColumnIndex(4);
+                ImGui::TextUnformatted(first);
+                ImGui::TableSetColumnIndex(5);
+                ImGui::TextUnformatted(last);
+            }
+            ImGui::EndTable();
+        }
+        ImGui::EndTabItem();
+    }
+}
+
+// Time range shown by the Timeline tab, viewEnd 0 shows the whole capture
+static unsigned long long viewStart = 0;
+static unsigned long long viewEnd = 0;
+// Range selected by dragging over the graph, brushEnd 0 when nothing is selected
+static unsigned long long brushStart = 0;
+static unsigned long long brushEnd = 0;
+
+void drawTimeline()
+{
+    if (ImGui::BeginTabItem("Timeline"))
+    {
+        ImGui::Spacing();
+        static int metric = 0; // 0 counts packets, 1 bytes
+        ImGui::RadioButton("Packets", &metric, 0);
+        ImGui::SameLine();
+        ImGui::RadioButton("Bytes", &metric, 1);
+        ImGui::SameLine();
+        if (ImGui::Button("Show everything"))
+            viewEnd = 0;
+
+        unsigned long long first, last;
+        if (!timeline.getRange(first, last))
+        {
+            ImGui::TextDisabled("No packets yet");
+            ImGui::EndTabItem();
+            return;
+        }
+        unsigned long long start = viewEnd ? viewStart : first;
+        unsigned long long end = viewEnd ? viewEnd : last + 1;
+        if (end - start < Timeline::width(0))
+            end = start + Timeline::width(0);
+        unsigned long long span = end - start;
+
+        // One bar every 3 pixels, each summing the buckets of its time range
+        ImVec2 size(ImGui::GetContentRegionAvail().x, 240.0f);
+        unsigned int bars = size.x > 3.0f ? (unsigned int)(size.x / 3.0f) : 1;
+        static std::vector<TimelinePoint> points;
+        int level = timeline.query(start, end, bars, points);
+        static std::vector<float> heights;
+        heights.assign(bars * TIMELINE_PROTOCOLS, 0.0f);
+        float peak = 0.0f;
+        for (unsigned int i = 0; i < bars; i++)
+        {
+            float total = 0.0f;
+            for (int j = 0; j < TIMELINE_PROTOCOLS; j++)
+            {
+                heights[i * TIMELINE_PROTOCOLS + j] = (float)(metric ? points[i].bytes[j] : points[i].packets[j]);
+                total += heights[i * TIMELINE_PROTOCOLS + j];
+            }
+            if (total > peak)
+                peak = total;
+        }
+
+        const char *protocols[TIMELINE_PROTOCOLS] = {"TCP", "UDP", "ICMP", "Other"};
+        const ImU32 colors[TIMELINE_PROTOCOLS] = {IM_COL32(80, 140, 230, 255), IM_COL32(90, 190, 110, 255),
+                                                  IM_COL32(230, 160, 60, 255), IM_COL32(150, 150, 150, 255)};
+        ImVec2 origin = ImGui::GetCursorScreenPos();
+        ImGui::InvisibleButton("timeline", size);
+        bool hovered = ImGui::IsItemHovered();
+        ImDrawList *draw = ImGui::GetWindowDrawList();
+        draw->AddRectFilled(origin, ImVec2(origin.x + size.x, origin.y + size.y), IM_COL32(25, 25, 30, 255));
+        float barWidth = size.x / bars;
+        for (unsigned int i = 0; i < bars && peak > 0.0f; i++)
+        {
+            // Protocols are stacked from the bottom in enum order
+            float bottom = origin.y + size.y;
+            for (int j = 0; j < TIMELINE_PROTOCOLS; j++)
+            {
+                float height = heights[i * TIMELINE_PROTOCOLS + j] / peak * (size.y - 4.0f);
+                if (height <= 0.0f)
+                    continue;
+                draw->AddRectFilled(ImVec2(origin.x + i * barWidth, bottom - height),
+                                    ImVec2(origin.x + (i + 1) * barWidth - 1.0f, bottom), colors[j]);
+                bottom -= height;
+            }
+        }
+
+        ImGuiIO &io = ImGui::GetIO();
+        float mouse = io.MousePos.x - origin.x;
+        if (mouse < 0.0f)
+            mouse = 0.0f;
+        if (mouse > size.x)
+            mouse = size.x;
+        unsigned long long mouseTime = start + (unsigned long long)(mouse / size.x * span);
+
+        // Dragging selects a range, the wheel zooms around the mouse, dragging with the right button pans
+        static unsigned long long anchor = 0;
+        if (hovered && ImGui::IsMouseClicked(ImGuiMouseButton_Left))
+            anchor = mouseTime;
+        if (ImGui::IsItemActive() && ImGui::IsMouseDragging(ImGuiMouseButton_Left))
+        {
+            brushStart = anchor < mouseTime ? anchor : mouseTime;
+            brushEnd = anchor < mouseTime ? mouseTime : anchor;
+        }
+        if (hovered && io.MouseWheel != 0.0f)
+        {
+            double factor = io.MouseWheel > 0.0f ? 0.8 : 1.25;
+            unsigned long long zoomed = (unsigned long long)(span * factor);
+            if (zoomed < Timeline::width(0))
+                zoomed = Timeline::width(0);
+            unsigned long long before = (unsigned long long)((mouseTime - start) * ((double)zoomed / span));
+            viewStart = mouseTime > before ? mouseTime - before : 0;
+            viewEnd = viewStart + zoomed;
+        }
+        if (hovered && ImGui::IsMouseDragging(ImGuiMouseButton_Right) && io.MouseDelta.x != 0.0f)
+        {
+            long long shift = (long long)(-io.MouseDelta.x / size.x * span);
+            viewStart = shift < 0 && (unsigned long long)-shift > start ? 0 : start + shift;
+            viewEnd = viewStart + span;
+        }
+
+        if (brushEnd > brushStart && brushEnd > start && brushStart < end)
+        {
+            float left = brushStart > start ? (float)((brushStart - start) / (double)span * size.x) : 0.0f;
+            float right = brushEnd < end ? (float)((brushEnd - start) / (double)span * size.x) : size.x;
+            draw->AddRectFilled(ImVec2(origin.x + left, origin.y), ImVec2(origin.x + right, origin.y + size.y),
+                                IM_COL32(255, 255, 255, 40));
+            draw->AddRect(ImVec2(origin.x + left, origin.y), ImVec2(origin.x + right, origin.y + size.y),
+                          IM_COL32(255, 255, 255, 120));
+        }
+
+        if (hovered)
+        {
+            unsigned int bar = (unsigned int)(mouse / barWidth);
+            if (bar >= bars)
+                bar = bars - 1;
+            const TimelinePoint &point = points[bar];
+            ImGui::SetTooltip("%.3f s\nTCP: %llu packets, %llu bytes\nUDP: %llu packets, %llu bytes\n"
+                              "ICMP: %llu packets, %llu bytes\nOther: %llu packets, %llu bytes",
+                              (mouseTime - first) / 1e9, point.packets[0], point.bytes[0], point.packets[1],
+                              point.bytes[1], point.packets[2], point.bytes[2], point.packets[3], point.bytes[3]);
+        }
+
+        // Times are shown relative to the first packet
+        const char *resolutions[TIMELINE_LEVELS] = {"1 ms", "100 ms", "1 s", "1 min"};
+        ImGui::Text("%.3f s to %.3f s, %s buckets, peak %.0f %s per bar", (start - first) / 1e9,
+                    (end - first) / 1e9, resolutions[level], peak, metric ? "bytes" : "packets");
+        for (int j = 0; j < TIMELINE_PROTOCOLS; j++)
+        {
+            ImGui::SameLine();
+            ImGui::PushStyleColor(ImGuiCol_Text, colors[j]);
+            ImGui::TextUnformatted(protocols[j]);
+            ImGui::PopStyleColor();
+        }
+        ImGui::TextDisabled("Drag to select a range, scroll to zoom, drag with the right button to pan");
+
+        if (brushEnd > brushStart)
+        {
+            ImGui::Text("Selected %.3f s to %.3f s", (brushStart - first) / 1e9, (brushEnd - first) / 1e9);
+            ImGui::SameLine();
+            if (ImGui::Button("Zoom to selection"))
+            {
+                viewStart = brushStart;
+                viewEnd = brushEnd;
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Filter packet table"))
+            {
+                displayFilter.setTimeRange(brushStart, brushEnd);
+                displayFilter.update(capturedPackets);
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Clear selection"))
+                brushStart = brushEnd = 0;
+        }
+        if (displayFilter.hasTimeRange())
+        {
+            if (ImGui::Button("Show packets of every time"))
+            {
+                displayFilter.setTimeRange(0, 0);
+                displayFilter.update(capturedPackets);
+            }
+        }
+
+        ImGui::EndTabItem();
+    }
+}
+
+// Takes a metrics snapshot once per second for the Stats tab and the export file
+static void sampleStats()
+{
+    unsigned long long now = statsClock();
+    if (now - metrics.timestamp < 1000000000ULL)
+        return;
+
+    sniffer.getMetrics(metrics);
+    metrics.storePackets = capturedPackets.size();
+    metrics.storeMemory = capturedPackets.memoryUsage();
+    metrics.storeDrops = capturedPackets.droppedPackets();
+    statsHistory.sample(metrics);
+    if (!metricsPath.empty())
+    {
+        bool json = metricsPath.size() >= 5 && metricsPath.compare(metricsPath.size() - 5, 5, ".json") == 0;
+        if (!writeMetricsFile(metricsPath, json ? formatJson(metrics) : formatPrometheus(metrics)))
+            std::cerr << "Error writing " << metricsPath << std::endl;
+    }
+}
+
+static void drawLatency(const char *name, const HistogramSnapshot &histogram)
+{
+    ImGui::Text("%s: %llu samples, mean %.0f ns, p50 < %llu ns, p99 < %llu ns, p99.9 < %llu ns", name,
+                histogram.count, histogram.mean(), histogram.quantile(0.5), histogram.quantile(0.99),
+                histogram.quantile(0.999));
+}
+
+// Line of the followed stream, start indexes followText
+struct FollowLine
+{
+    size_t start;
+    unsigned int length;
+    int direction; // -1 for bytes that were never captured
+};
+
+static TcpStream followed;
+static bool followValid = false;
+static std::string followText; // Printable copy of the shown directions, split into followLines
+static std::vector<FollowLine> followLines;
+
+// Splits the chunks of the followed stream into lines of at most 128 printable characters
+static void buildFollowLines(int shown)
+{
+    followText.clear();
+    followLines.clear();
+    for (size_t i = 0; followValid && i < followed.chunks.size(); i++)
+    {
+        const StreamChunk &chunk = followed.chunks[i];
+        if (shown >= 0 && chunk.direction != shown)
+            continue;
+
+        FollowLine line;
+        line.start = followText.size();
+        line.direction = chunk.missing ? -1 : chunk.direction;
+        if (chunk.missing)
+        {
+            char gap[48];
+            line.length = snprintf(gap, sizeof(gap), "[%u bytes missing]", chunk.length);
+            followText += gap;
+            followLines.push_back(line);
+            continue;
+        }
+
+        const unsigned char *bytes = &followed.directions[chunk.direction].data[chunk.offset];
+        line.length = 0;
+        for (unsigned int j = 0; j < chunk.length; j++)
+        {
+            unsigned char c = bytes[j];
+            if (c != '\n')
+            {
+                followText += c >= 32 && c <= 126 ? (char)c : '.';
+                line.length++;
+            }
+            if (c == '\n' || line.length == 128 || j + 1 == chunk.length)
+            {
+                followLines.push_back(line);
+                line.start = followText.size();
+                line.length = 0;
+            }
+        }
+    }
+}
+
+void drawFollowStream()
+{
+    static bool following = false;
+    static int shown = -1; // Both directions, or 0 and 1 for one of them
+    static char path[256] = "stream.bin";
+    static bool open = true;
+    if (followRequested)
+    {
+        following = open = true;
+        followValid = streams.copyStream(followKey, followed);
+        buildFollowLines(shown);
+    }
+    if (!following)
+        return;
+
+    if (ImGui::BeginTabItem("Follow Stream", &open, followRequested ? ImGuiTabItemFlags_SetSelected : 0))
+    {
+        ImGui::Spacing();
+        char endpointA[64], endpointB[64];
+        formatEndpoint(followKey, followKey.addressA, followKey.portA, endpointA, sizeof(endpointA));
+        formatEndpoint(followKey, followKey.addressB, followKey.portB, endpointB, sizeof(endpointB));
+        size_t streamCount, memory;
+        unsigned long long evicted;
+        streams.getUsage(streamCount, memory, evicted);
+        ImGui::Text("%s <-> %s", endpointA, endpointB);
+        ImGui::TextDisabled("Reassembling %zu streams in %.1f MiB, %llu evicted", streamCount, memory / 1048576.0,
+                            evicted);
+
+        bool changed = ImGui::RadioButton("Both directions", &shown, -1);
+        ImGui::SameLine();
+        changed |= ImGui::RadioButton("A to B", &shown, 0);
+        ImGui::SameLine();
+        changed |= ImGui::RadioButton("B to A", &shown, 1);
+        ImGui::SameLine();
+        if (ImGui::Button("Refresh"))
+        {
+            followValid = streams.copyStream(followKey, followed);
+            changed = true;
+        }
+        if (changed)
+            buildFollowLines(shown);
+        ImGui::InputText("Export file", path, sizeof(path));
+        ImGui::SameLine();
+        if (ImGui::Button("Save") && followValid)
+            TcpReassembler::saveStream(followed, shown, path);
+
+        if (!followValid)
+            ImGui::TextDisabled("No data reassembled for this connection, or it was evicted");
+        else
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                const StreamDirection &side = followed.directions[i];
+                ImGui::Text("%s: %llu bytes, %llu missing%s", i == 0 ? "A to B" : "B to A", side.delivered,
+                            side.missing, side.finished ? ", closed" : "");
+            }
+            ImGui::Text("Retransmitted: %llu bytes%s", followed.retransmitted, followed.reset ? ", reset" : "");
+        }
+
+        // Only the lines on screen are drawn, A to B in red and B to A in blue like other analyzers
+        ImGui::BeginChild("stream text", ImVec2(0, 0), ImGuiChildFlags_Border);
+        const ImVec4 colors[] = {ImVec4(1.0f, 0.55f, 0.55f, 1.0f), ImVec4(0.55f, 0.7f, 1.0f, 1.0f)};
+        ImGuiListClipper clipper;
+        clipper.Begin((int)followLines.size());
+        while (clipper.Step())
+        {
+            for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++)
+            {
+                const FollowLine &line = followLines[i];
+                const char *text = followText.data() + line.start;
+                if (line.direction < 0)
+                    ImGui::TextDisabled("%.*s", (int)line.length, text);
+                else
+                {
+                    ImGui::PushStyleColor(ImGuiCol_Text, colors[line.direction]);
+                    ImGui::TextUnformatted(text, text + line.length);
+                    ImGui::PopStyleColor();
+                }
+            }
+        }
+        clipper.End();
+        ImGui::EndChild();
+        ImGui::EndTabItem();
+    }
+    followRequested = false;
+    if (!open)
+        following = false;
+}
+
+void drawStats()
+{
+    if (ImGui::BeginTabItem("Stats"))
+    {
+        ImGui::Spacing();
+        ImGui::Text("Packets: %llu (%.0f/s), %.1f MiB (%.2f Mbit/s)", metrics.packets,
+                    statsHistory.latest(StatsSeries::PacketsPerSecond), metrics.bytes / (1024.0 * 1024.0),
+                    statsHistory.latest(StatsSeries::BitsPerSecond) / 1e6);
+        for (size_t i = 0; i < metrics.workerPackets.size(); i++)
+        {
+            ImGui::SameLine();
+            ImGui::Text("| worker %zu: %llu", i, metrics.workerPackets[i]);
+        }
+        ImGui::Text("Drops: %llu kernel, %llu queue overflow, %llu store limit, %llu ring freezes",
+                    metrics.kernelDrops, metrics.queueOverflows, metrics.storeDrops, metrics.kernelFreezes);
+        ImGui::Text("Store: %llu packets in %.1f MiB", metrics.storePackets, metrics.storeMemory / (1024.0 * 1024.0));
+        drawLatency("Worker time per packet", metrics.processing);
+        drawLatency("Kernel to consumer", metrics.delivery);
+        ImGui::Separator();
+
+        // One sample per second, the last STATS_HISTORY seconds
+        const struct
+        {
+            StatsSeries series;
+            const char *label;
+            const char *format;
+            float scale;
+        } graphs[] = {
+            {StatsSeries::PacketsPerSecond, "Packets/s", "%.0f packets/s", 1.0f},
+            {StatsSeries::BitsPerSecond, "Mbit/s", "%.2f Mbit/s", 1e-6f},
+            {StatsSeries::DropsPerSecond, "Drops/s", "%.0f drops/s", 1.0f},
+            {StatsSeries::QueueDepth, "Queue depth", "%.0f queued", 1.0f},
+        };
+        float width = ImGui::GetContentRegionAvail().x;
+        for (size_t i = 0; i < sizeof(graphs) / sizeof(graphs[0]); i++)
+        {
+            char overlay[64];
+            snprintf(overlay, sizeof(overlay), graphs[i].format, statsHistory.latest(graphs[i].series) * graphs[i].scale);
+            float peak = statsHistory.peak(graphs[i].series);
+            ImGui::PlotLines(graphs[i].label, statsHistory.values(graphs[i].series), STATS_HISTORY,
+                             statsHistory.offset(), overlay, 0.0f, peak > 0.0f ? peak * 1.1f : 1.0f,
+                             ImVec2(width * 0.85f, 70.0f));
+        }
+        ImGui::Separator();
+
+        static char path[256] = "csniff.prom";
+        static bool exporting = false;
+        ImGui::InputText("Metrics file", path, sizeof(path));
+        ImGui::SameLine();
+        if (ImGui::Checkbox("Export every second", &exporting))
+            metricsPath = exporting ? path : "";
+        ImGui::TextDisabled("Prometheus text format, JSON when the name ends in .json");
+
+        ImGui::EndTabItem();
+    }
+}
+
 void drawAbout()
 {
     if (ImGui::BeginTabItem("About"))
@@ -240,6 +1287,19 @@ void drawAbout()
 int main(int, char **)
 {
     glfwSetErrorCallback(glfw_error_callback);
+    sniffer.setReassembler(&streams);
+    sniffer.setTimeline(&timeline);
+    sniffer.setNamePool(&hostNames);
+    livePipeline.add("store", StoreSink(capturedPackets));
+    livePipeline.add("flows", FlowStage(flows));
+    livePipeline.add("hosts", HostStage(hosts));
+    // Live packets were already named, reassembled and counted on the capture workers
+    filePipeline.add("names", ApplicationStage(&hostNames));
+    filePipeline.add("store", ViewSink(capturedPackets));
+    filePipeline.add("flows", FlowStage(flows));
+    filePipeline.add("hosts", HostStage(hosts));
+    filePipeline.add("streams", ReassemblyStage(&streams));
+    filePipeline.add("timeline", TimelineStage(&timeline));
     if (!glfwInit())
         return 1;
 
@@ -347,6 +1407,23 @@ int main(int, char **)
         // and hide them from your application based on those two flags.
         glfwPollEvents();
 
+        // The capture thread only queues packets, the store is filled here so
+        // the GUI thread is its only user
+        static SnifferSource liveSource(sniffer);
+        livePipeline.run(liveSource);
+        // Packets of an opened file are added as views of the mapped file
+        if (fileReader.isOpen())
+        {
+            capturedPackets.retain(fileReader.getMapping());
+            PcapFileSource fileSource(fileReader);
+            if (filePipeline.run(fileSource) == 0)
+                fileReader.close();
+        }
+        exportPackets();
+        summaries.update(capturedPackets);
+        displayFilter.update(capturedPackets);
+        sampleStats();
+
         // Start the Dear ImGui frame
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
@@ -366,6 +1443,11 @@ int main(int, char **)
             {
                 drawMain();
                 drawCapturedPackets();
+                drawFlows();
+                drawTopHosts();
+                drawFollowStream();
+                drawTimeline();
+                drawStats();
                 drawAbout();
                 ImGui::EndTabBar();
             }
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "dissect.h"
+
+// Handles stay valid until the store is cleared
+typedef size_t PacketHandle;
+
+// Clock a packet timestamp was taken from
+enum class TimestampSource : unsigned char
+{
+    Unknown,  // Read from a file or added without a source
+    User,     // clock_gettime() after the packet was read, the kernel gave none
+    Software, // Kernel receive time
+    Hardware  // NIC receive time
+};
+
+// Captured packet, data points into one of the store chunks or into memory the store retains
+struct Packet
+{
+    const unsigned char *data;
+    int size;                // Bytes captured
+    unsigned int wireLength; // Bytes on the wire, larger than size when a snaplen cut the packet
+    TimestampSource timestampSource;
+    unsigned long long timestamp; // Nanoseconds since the epoch
+    PacketInfo info;              // Layers found by dissect()
+};
+
+/*
+Bytes of packet kept under a snaplen, 0 keeps everything. In headers only mode the
+packet is cut right after the last header found by dissect(), so the offsets in
+PacketInfo stay valid while the payload is dropped.
+*/
+inline int truncatedLength(const Packet &packet, unsigned int snaplen, bool headersOnly)
+{
+    unsigned int size = packet.size > 0 ? packet.size : 0;
+    if (headersOnly && packet.info.payloadOffset < size)
+        size = packet.info.payloadOffset;
+    if (snaplen && snaplen < size)
+        size = snaplen;
+    return (int)size;
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dissect.h"
+#include "packet.h"
+#include "spill_file.h"
+
+#define STORE_CHUNK_SIZE (4 << 20)            // 4 MiB chunks, holds ~2800 full sized ethernet frames
+#define STORE_MEMORY_LIMIT (1024ULL << 20)    // Default cap of 1 GiB for packet data
+#define STORE_ALIGNMENT 8
+
+/*
+Arena for captured packets.
+
+Frames are copied back to back into large chunks, so each packet costs its
+captured size plus a small index entry instead of a BUFFSIZE allocation.
+Chunks are never moved or reallocated, pointers into them stay valid until
+clear() releases everything at once. Packets can also be added as views of
+memory owned elsewhere, such as a mapped capture file, which the store then
+keeps alive through retain().
+
+With a spill directory set, reaching the memory limit no longer drops
+packets: the oldest chunk and the records of its packets are compressed
+into a SpillFile and the chunk is reused, so memory stays flat however long
+the capture runs. Handles keep working, spilled packets are read back
+through the cache of decompressed segments.
+*/
+class PacketStore
+{
+private:
+    std::vector<unsigned char *> chunks;
+    std::vector<PacketHandle> chunkStarts; // Handle of the first packet copied into each chunk
+    std::deque<Packet> packets;            // Packets still in memory, from handle spilled on
+    PacketHandle spilled;                  // Packets moved to the spill file
+    SpillFile spill;
+    Packet unreadable; // Returned for spilled packets that cannot be read back
+    std::vector<std::shared_ptr<const void>> owners; // Keep the memory behind views alive
+    size_t chunkSize;
+    size_t chunkUsed;
+    size_t memoryLimit;
+    unsigned int snaplen; // 0 stores whole packets
+    bool headersOnly;
+    unsigned long long dropped;
+
+    /*
+    Moves the packets of the oldest chunk to the spill file and returns the chunk for reuse,
+    NULL if there is nothing to spill or the file cannot be written, which turns spilling off.
+    */
+    unsigned char *spillOldest()
+    {
+        if (!spill.isOpen() || chunks.size() < 2)
+            return NULL;
+
+        size_t count = chunkStarts[1] - chunkStarts[0];
+        unsigned char *chunk = chunks[0];
+        size_t used = 0;
+        if (count)
+        {
+            const Packet &last = packets[count - 1];
+            used = last.data + last.size - chunk;
+        }
+        if (count && !spill.append(packets, count, spilled, chunk, used))
+        {
+            std::cerr << "Spilling stopped, packets are dropped at the memory limit" << std::endl;
+            spill.close();
+            return NULL;
+        }
+        packets.erase(packets.begin(), packets.begin() + count);
+        spilled += count;
+        chunks.erase(chunks.begin());
+        chunkStarts.erase(chunkStarts.begin());
+        return chunk;
+    }
+
+    unsigned char *allocate(size_t size)
+    {
+        size_t aligned = (size + STORE_ALIGNMENT - 1) & ~(size_t)(STORE_ALIGNMENT - 1);
+
+        if (chunks.empty() || chunkUsed + aligned > chunkSize)
+        {
+            unsigned char *chunk = NULL;
+            if ((chunks.size() + 1) * chunkSize > memoryLimit)
+            {
+                chunk = spillOldest();
+                if (!chunk)
+                    return NULL;
+            }
+            else
+            {
+                chunk = (unsigned char *)malloc(chunkSize);
+                if (!chunk)
+                    return NULL;
+            }
+            chunks.push_back(chunk);
+            chunkStarts.push_back(spilled + packets.size());
+            chunkUsed = 0;
+        }
+
+        unsigned char *ptr = chunks.back() + chunkUsed;
+        chunkUsed += aligned;
+        return ptr;
+    }
+
+public:
+    explicit PacketStore(size_t limit = STORE_MEMORY_LIMIT, size_t chunk = STORE_CHUNK_SIZE)
+        : spilled(0), chunkSize(chunk), chunkUsed(0), memoryLimit(limit), snaplen(0), headersOnly(false), dropped(0)
+    {
+        memset(&unreadable, 0, sizeof(unreadable));
+    }
+
+    ~PacketStore()
+    {
+        for (size_t i = 0; i < chunks.size(); i++)
+            free(chunks[i]);
+    }
+
+    PacketStore(const PacketStore &) = delete;
+    PacketStore &operator=(const PacketStore &) = delete;
+
+    /*
+    Copies the packet data into the store, cut to the snaplen, returns false and counts a
+    drop once the memory cap is reached.
+    */
+    bool add(const Packet &packet)
+    {
+        int size = truncatedLength(packet, snaplen, headersOnly);
+        if (size <= 0 || (size_t)size > chunkSize)
+        {
+            dropped++;
+            return false;
+        }
+
+        unsigned char *ptr = allocate(size);
+        if (!ptr)
+        {
+            dropped++;
+            return false;
+        }
+
+        memcpy(ptr, packet.data, size);
+        packets.push_back(packet);
+        packets.back().data = ptr;
+        packets.back().size = size;
+        if (packets.back().wireLength < (unsigned int)packet.size)
+            packets.back().wireLength = packet.size;
+        return true;
+    }
+
+    // Dissects and copies a raw frame
+    bool add(const unsigned char *data, int size, unsigned long long timestamp = 0)
+    {
+        Packet packet;
+        packet.data = data;
+        packet.size = size;
+        packet.wireLength = size > 0 ? size : 0;
+        packet.timestampSource = TimestampSource::Unknown;
+        packet.timestamp = timestamp;
+        dissect(data, size > 0 ? size : 0, packet.info);
+        return add(packet);
+    }
+
+    // Adds a packet without copying, the data must stay valid until clear(), see retain(). Copied while spilling
+    void addView(const Packet &packet)
+    {
+        if (spill.isOpen())
+        {
+            add(packet);
+            return;
+        }
+        packets.push_back(packet);
+        packets.back().size = truncatedLength(packet, snaplen, headersOnly);
+        if (packets.back().wireLength < (unsigned int)packet.size)
+            packets.back().wireLength = packet.size;
+    }
+
+    // Keeps owner alive until clear(), for memory referenced by views
+    void retain(const std::shared_ptr<const void> &owner)
+    {
+        if (owners.empty() || owners.back() != owner)
+            owners.push_back(owner);
+    }
+
+    // Releases every packet, the first chunk is kept for the next capture
+    void clear()
+    {
+        for (size_t i = 1; i < chunks.size(); i++)
+            free(chunks[i]);
+        if (chunks.size() > 1)
+            chunks.resize(1);
+        chunkStarts.assign(chunks.size(), 0);
+        chunkUsed = 0;
+        packets.clear();
+        spilled = 0;
+        spill.clear();
+        owners.clear();
+        dropped = 0;
+    }
+
+    /*
+    Spilled packets are read from a cached segment, the reference then stays valid until
+    SPILL_CACHE_BLOCKS other segments were loaded, copy the packet to keep it longer.
+    */
+    const Packet &operator[](PacketHandle handle) const
+    {
+        if (handle >= spilled)
+            return packets[handle - spilled];
+
+        size_t segment = spill.find(handle);
+        std::shared_ptr<const SpillBlock> block = spill.load(segment);
+        if (!block)
+            return unreadable;
+        return block->packets[handle - spill.segment(segment).first];
+    }
+
+    /*
+    Calls visitor(handle, packet) for the packets from first up to end, holding each spilled
+    segment for as long as its packets are visited, so several threads can visit at once.
+    Spilled segments without packets between the timestamps from and to are skipped unread.
+    */
+    template <typename Visitor>
+    void visit(PacketHandle first, PacketHandle end, Visitor visitor, unsigned long long from = 0,
+               unsigned long long to = ~0ULL) const
+    {
+        PacketHandle handle = first;
+        while (handle < end && handle < spilled)
+        {
+            size_t index = spill.find(handle);
+            const SpillSegment &segment = spill.segment(index);
+            PacketHandle stop = segment.first + segment.count < end ? segment.first + segment.count : end;
+            std::shared_ptr<const SpillBlock> block;
+            if (segment.lastTime >= from && segment.firstTime <= to)
+                block = spill.load(index);
+            for (; block && handle < stop; handle++)
+                visitor(handle, block->packets[handle - segment.first]);
+            handle = stop;
+        }
+        for (; handle < end; handle++)
+            visitor(handle, packets[handle - spilled]);
+    }
+
+    size_t size() const { return spilled + packets.size(); }
+
+    bool empty() const { return size() == 0; }
+
+    // Bytes held by chunks, the packet index and the spill cache
+    size_t memoryUsage() const
+    {
+        return chunks.size() * chunkSize + packets.size() * sizeof(Packet) + spill.memoryUsage();
+    }
+
+    size_t getMemoryLimit() const { return memoryLimit; }
+
+    void setMemoryLimit(size_t limit) { memoryLimit = limit; }
+
+    // Cuts packets added from now on to length bytes, 0 keeps them whole, or to their headers
+    void setSnaplen(unsigned int length, bool headers = false)
+    {
+        snaplen = length;
+        headersOnly = headers;
+    }
+
+    unsigned int getSnaplen() const { return snaplen; }
+
+    bool isHeadersOnly() const { return headersOnly; }
+
+    // Packets refused because the memory cap was reached
+    unsigned long long droppedPackets() const { return dropped; }
+
+    /*
+    Spills the oldest packets to a file created in directory once the memory limit is reached,
+    an empty directory turns spilling off. Only allowed while the store is empty, returns false
+    otherwise or if the file cannot be created.
+    */
+    bool setSpillDirectory(const std::string &directory)
+    {
+        if (!empty())
+            return false;
+        if (directory.empty())
+        {
+            spill.close();
+            return true;
+        }
+        return spill.open(directory);
+    }
+
+    bool isSpilling() const { return spill.isOpen(); }
+
+    // Packets below this handle are read back from the spill file
+    PacketHandle firstResident() const { return spilled; }
+
+    const SpillFile &getSpillFile() const { return spill; }
+};
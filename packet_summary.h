@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstdio>
+#include <vector>
+
+#include "packet_store.h"
+
+/*
+Per packet row data for the packet table.
+
+Each column is kept in its own array and filled once when packets reach the
+store, so drawing the table never touches the raw frames and a row costs 31
+bytes. Only the rows on screen are formatted into text. Rows of packets the
+store spilled to disk are dropped and decoded again from the packet when
+they are scrolled to, so the arrays only cover the packets in memory.
+*/
+class PacketSummaries
+{
+private:
+    std::vector<unsigned long long> sources; // MAC addresses packed into the low 48 bits
+    std::vector<unsigned long long> destinations;
+    std::vector<unsigned short> etherTypes; // Innermost EtherType in host byte order, see PacketInfo
+    std::vector<unsigned int> sizes;
+    std::vector<NetworkLayer> networks;
+    std::vector<TransportLayer> transports;
+    std::vector<ApplicationLayer> applications;
+    std::vector<unsigned int> names; // Ids in the StringPool the capture workers interned into
+    PacketHandle first; // Handle of the first row kept
+    const PacketStore *store; // Read for the rows before first
+
+    template <typename T>
+    static void dropFront(std::vector<T> &column, size_t count)
+    {
+        column.erase(column.begin(), column.begin() + count);
+    }
+
+    static const char *name(NetworkLayer network, TransportLayer transport)
+    {
+        switch (transport)
+        {
+        case TransportLayer::Tcp:
+            return "TCP";
+        case TransportLayer::Udp:
+            return "UDP";
+        case TransportLayer::Icmp:
+            return "ICMP";
+        case TransportLayer::Icmpv6:
+            return "ICMPv6";
+        default:
+            break;
+        }
+        switch (network)
+        {
+        case NetworkLayer::IPv4:
+            return "IPv4";
+        case NetworkLayer::IPv6:
+            return "IPv6";
+        case NetworkLayer::Arp:
+            return "ARP";
+        default:
+            return NULL;
+        }
+    }
+
+    static unsigned long long readMac(const unsigned char *mac)
+    {
+        unsigned long long value = 0;
+        for (int i = 0; i < 6; i++)
+            value = (value << 8) | mac[i];
+        return value;
+    }
+
+public:
+    PacketSummaries() : first(0), store(NULL) {}
+
+    // Decodes the packets added to the store since the last call
+    void update(const PacketStore &packets)
+    {
+        store = &packets;
+        // Rows of spilled packets go once they are half of the arrays, so erasing stays amortized
+        PacketHandle resident = packets.firstResident();
+        if (resident > first && resident - first >= sizes.size() / 2)
+        {
+            size_t count = resident - first < sizes.size() ? resident - first : sizes.size();
+            dropFront(sources, count);
+            dropFront(destinations, count);
+            dropFront(etherTypes, count);
+            dropFront(sizes, count);
+            dropFront(networks, count);
+            dropFront(transports, count);
+            dropFront(applications, count);
+            dropFront(names, count);
+            first += count;
+        }
+        if (sizes.empty() && resident > first)
+            first = resident; // Packets spilled before they were decoded are read from the store
+
+        size_t next = first + sizes.size();
+        size_t count = packets.size();
+        if (count <= next)
+            return;
+
+        for (PacketHandle i = next; i < count; i++)
+        {
+            const Packet &packet = packets[i];
+            if (packet.size >= 14)
+            {
+                destinations.push_back(readMac(packet.data));
+                sources.push_back(readMac(packet.data + 6));
+            }
+            else
+            {
+                destinations.push_back(0);
+                sources.push_back(0);
+            }
+            etherTypes.push_back(packet.info.etherType);
+            sizes.push_back(packet.wireLength); // Length on the wire, even when the capture was cut
+            networks.push_back(packet.info.network);
+            transports.push_back(packet.info.transport);
+            applications.push_back(packet.info.application);
+            names.push_back(packet.info.name);
+        }
+    }
+
+    void clear()
+    {
+        sources.clear();
+        destinations.clear();
+        etherTypes.clear();
+        sizes.clear();
+        networks.clear();
+        transports.clear();
+        applications.clear();
+        names.clear();
+        first = 0;
+    }
+
+    size_t size() const { return first + sizes.size(); }
+
+    unsigned long long source(PacketHandle handle) const
+    {
+        if (handle < first)
+        {
+            const Packet &packet = (*store)[handle];
+            return packet.size >= 14 ? readMac(packet.data + 6) : 0;
+        }
+        return sources[handle - first];
+    }
+
+    unsigned long long destination(PacketHandle handle) const
+    {
+        if (handle < first)
+        {
+            const Packet &packet = (*store)[handle];
+            return packet.size >= 14 ? readMac(packet.data) : 0;
+        }
+        return destinations[handle - first];
+    }
+
+    unsigned short etherType(PacketHandle handle) const
+    {
+        return handle < first ? (*store)[handle].info.etherType : etherTypes[handle - first];
+    }
+
+    unsigned int packetSize(PacketHandle handle) const
+    {
+        return handle < first ? (*store)[handle].wireLength : sizes[handle - first];
+    }
+
+    // Name of the innermost protocol found by the dissector, NULL if only the EtherType is known
+    const char *protocolName(PacketHandle handle) const
+    {
+        if (handle < first)
+        {
+            const PacketInfo &info = (*store)[handle].info;
+            return name(info.network, info.transport);
+        }
+        return name(networks[handle - first], transports[handle - first]);
+    }
+
+    ApplicationLayer application(PacketHandle handle) const
+    {
+        return handle < first ? (*store)[handle].info.application : applications[handle - first];
+    }
+
+    // Id of the host or query name found by dissectApplication(), 0 for none
+    unsigned int hostName(PacketHandle handle) const
+    {
+        return handle < first ? (*store)[handle].info.name : names[handle - first];
+    }
+
+    // Writes a packed MAC address as XX:XX:XX:XX:XX:XX
+    static void formatMac(unsigned long long mac, char *text, size_t length)
+    {
+        snprintf(text, length, "%.2X:%.2X:%.2X:%.2X:%.2X:%.2X", (unsigned int)(mac >> 40) & 0xff,
+                 (unsigned int)(mac >> 32) & 0xff, (unsigned int)(mac >> 24) & 0xff,
+                 (unsigned int)(mac >> 16) & 0xff, (unsigned int)(mac >> 8) & 0xff, (unsigned int)mac & 0xff);
+    }
+};
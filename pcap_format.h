@@ -0,0 +1,21 @@
+#pragma once
+
+// On-disk constants of the pcap and pcapng capture file formats
+
+#define PCAP_MAGIC_MICRO 0xA1B2C3D4 // Classic pcap, microsecond timestamps
+#define PCAP_MAGIC_NANO 0xA1B23C4D  // Classic pcap, nanosecond timestamps
+#define PCAP_FILE_HEADER_SIZE 24
+#define PCAP_RECORD_HEADER_SIZE 16
+
+#define PCAPNG_SHB 0x0A0D0D0A // Section header block
+#define PCAPNG_IDB 0x00000001 // Interface description block
+#define PCAPNG_PB 0x00000002  // Packet block, obsolete
+#define PCAPNG_SPB 0x00000003 // Simple packet block
+#define PCAPNG_EPB 0x00000006 // Enhanced packet block
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+
+#define PCAPNG_OPT_ENDOFOPT 0
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_OPT_IF_TSOFFSET 14
+
+#define LINKTYPE_ETHERNET 1
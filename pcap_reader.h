@@ -0,0 +1,421 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "packet_store.h"
+#include "pcap_format.h"
+
+#define READER_BATCH 65536 // Packets handed over per consume() call by default
+
+/*
+Offline capture source for pcap and pcapng files.
+
+open() maps the whole file and makes one sequential pass over it, keeping
+only the file offset of every packet record. Record headers are decoded
+when a packet is requested, and packet data points straight into the
+mapping, so opening a large trace costs 8 bytes per packet and no copies.
+The mapping is reference counted: stores fed by drain() keep it alive after
+the reader is closed or reopened.
+*/
+class PcapReader
+{
+private:
+    struct Mapping
+    {
+        const unsigned char *data;
+        size_t size;
+
+        Mapping(const unsigned char *mapped, size_t length) : data(mapped), size(length) {}
+
+        ~Mapping() { munmap(const_cast<unsigned char *>(data), size); }
+    };
+
+    struct Interface
+    {
+        unsigned int linkType;
+        unsigned int snaplen;
+        unsigned int resolution; // Exponent of the timestamp unit
+        bool binaryResolution;   // Unit is 2^-resolution instead of 10^-resolution
+        long long offset;        // Seconds added to every timestamp
+    };
+
+    // Run of packets sharing a byte order and interface table, pcap files have a single one
+    struct Section
+    {
+        size_t firstPacket;
+        bool swapped;
+        std::vector<Interface> interfaces;
+    };
+
+    std::shared_ptr<Mapping> mapping;
+    bool pcapng;
+    std::vector<unsigned long long> offsets; // Start of each packet record
+    std::vector<Section> sections;
+    size_t cursor;
+    bool truncated;
+
+    static unsigned int swap32(unsigned int value, bool swapped)
+    {
+        return swapped ? __builtin_bswap32(value) : value;
+    }
+
+    unsigned int read32(unsigned long long offset, bool swapped) const
+    {
+        unsigned int value;
+        memcpy(&value, mapping->data + offset, 4);
+        return swap32(value, swapped);
+    }
+
+    unsigned short read16(unsigned long long offset, bool swapped) const
+    {
+        unsigned short value;
+        memcpy(&value, mapping->data + offset, 2);
+        return swapped ? __builtin_bswap16(value) : value;
+    }
+
+    static unsigned long long toNanoseconds(unsigned long long ticks, const Interface &interface)
+    {
+        unsigned long long nanoseconds;
+        if (interface.binaryResolution)
+        {
+            unsigned long long seconds = ticks >> interface.resolution;
+            unsigned long long fraction = ticks & ((1ULL << interface.resolution) - 1);
+            nanoseconds = seconds * 1000000000ULL +
+                          (unsigned long long)(((unsigned __int128)fraction * 1000000000ULL) >> interface.resolution);
+        }
+        else
+        {
+            unsigned long long scale = 1;
+            for (unsigned int i = interface.resolution; i < 9; i++)
+                scale *= 10;
+            for (unsigned int i = 9; i < interface.resolution; i++)
+                ticks /= 10;
+            nanoseconds = ticks * scale;
+        }
+        return nanoseconds + interface.offset * 1000000000LL;
+    }
+
+    const Section &sectionOf(size_t index) const
+    {
+        size_t i = sections.size() - 1;
+        while (i > 0 && sections[i].firstPacket > index)
+            i--;
+        return sections[i];
+    }
+
+    bool indexPcap(std::string &error)
+    {
+        const unsigned char *data = mapping->data;
+        size_t size = mapping->size;
+
+        unsigned int magic;
+        memcpy(&magic, data, 4);
+        Section section;
+        section.firstPacket = 0;
+        section.swapped = magic == __builtin_bswap32(PCAP_MAGIC_MICRO) || magic == __builtin_bswap32(PCAP_MAGIC_NANO);
+        bool nano = swap32(magic, section.swapped) == PCAP_MAGIC_NANO;
+        if (size < PCAP_FILE_HEADER_SIZE)
+        {
+            error = "Truncated pcap header";
+            return false;
+        }
+
+        Interface interface;
+        interface.snaplen = read32(16, section.swapped);
+        interface.linkType = read32(20, section.swapped) & 0xffff;
+        interface.resolution = nano ? 9 : 6;
+        interface.binaryResolution = false;
+        interface.offset = 0;
+        section.interfaces.push_back(interface);
+        sections.push_back(section);
+
+        unsigned long long offset = PCAP_FILE_HEADER_SIZE;
+        while (offset + PCAP_RECORD_HEADER_SIZE <= size)
+        {
+            unsigned long long end = offset + PCAP_RECORD_HEADER_SIZE + read32(offset + 8, section.swapped);
+            if (end > size)
+                break;
+            offsets.push_back(offset);
+            offset = end;
+        }
+        truncated = offset != size;
+        return true;
+    }
+
+    void parseInterface(unsigned long long offset, unsigned int length, Section &section)
+    {
+        Interface interface;
+        interface.linkType = read16(offset + 8, section.swapped);
+        interface.snaplen = read32(offset + 12, section.swapped);
+        interface.resolution = 6;
+        interface.binaryResolution = false;
+        interface.offset = 0;
+
+        unsigned long long option = offset + 16;
+        unsigned long long end = offset + length - 4;
+        while (option + 4 <= end)
+        {
+            unsigned int code = read16(option, section.swapped);
+            unsigned int optionLength = read16(option + 2, section.swapped);
+            if (code == PCAPNG_OPT_ENDOFOPT || option + 4 + optionLength > end)
+                break;
+            if (code == PCAPNG_OPT_IF_TSRESOL && optionLength >= 1)
+            {
+                interface.resolution = mapping->data[option + 4] & 0x7f;
+                interface.binaryResolution = (mapping->data[option + 4] & 0x80) != 0;
+                if (interface.binaryResolution && interface.resolution > 63)
+                    interface.resolution = 63;
+            }
+            else if (code == PCAPNG_OPT_IF_TSOFFSET && optionLength >= 8)
+            {
+                unsigned long long value;
+                memcpy(&value, mapping->data + option + 4, 8);
+                interface.offset = (long long)(section.swapped ? __builtin_bswap64(value) : value);
+            }
+            option += 4 + ((optionLength + 3) & ~3u);
+        }
+        section.interfaces.push_back(interface);
+    }
+
+    bool indexPcapng(std::string &error)
+    {
+        size_t size = mapping->size;
+        unsigned long long offset = 0;
+        while (offset + 12 <= size)
+        {
+            unsigned int type = read32(offset, false);
+            bool swapped = sections.empty() ? false : sections.back().swapped;
+            if (type == PCAPNG_SHB)
+            {
+                // The byte order magic decides how the rest of the section is read
+                unsigned int magic = read32(offset + 8, false);
+                if (magic != PCAPNG_BYTE_ORDER_MAGIC && magic != __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC))
+                {
+                    error = "Invalid pcapng section header";
+                    return false;
+                }
+                swapped = magic != PCAPNG_BYTE_ORDER_MAGIC;
+            }
+            else
+                type = swap32(type, swapped);
+
+            unsigned int length = read32(offset + 4, swapped);
+            if (length < 12 || length % 4 != 0 || offset + length > size)
+                break;
+
+            if (type == PCAPNG_SHB)
+            {
+                Section section;
+                section.firstPacket = offsets.size();
+                section.swapped = swapped;
+                sections.push_back(section);
+            }
+            else if (sections.empty())
+            {
+                error = "Missing pcapng section header";
+                return false;
+            }
+            else if (type == PCAPNG_IDB && length >= 20)
+                parseInterface(offset, length, sections.back());
+            else if ((type == PCAPNG_EPB && length >= 32) || (type == PCAPNG_PB && length >= 32) ||
+                     (type == PCAPNG_SPB && length >= 16))
+                offsets.push_back(offset);
+            offset += length;
+        }
+        truncated = offset != size;
+        return true;
+    }
+
+    // Decodes the record header of a packet, the data points into the mapping, the layers are left unset
+    Packet record(size_t index) const
+    {
+        const Section &section = sectionOf(index);
+        unsigned long long offset = offsets[index];
+        Packet packet;
+        packet.timestampSource = TimestampSource::Unknown;
+
+        if (!pcapng)
+        {
+            const Interface &interface = section.interfaces[0];
+            unsigned long long seconds = read32(offset, section.swapped);
+            unsigned long long fraction = read32(offset + 4, section.swapped);
+            unsigned long long unit = interface.resolution == 9 ? 1 : 1000;
+            packet.data = mapping->data + offset + PCAP_RECORD_HEADER_SIZE;
+            packet.size = read32(offset + 8, section.swapped);
+            packet.wireLength = read32(offset + 12, section.swapped);
+            packet.timestamp = seconds * 1000000000ULL + fraction * unit;
+            return packet;
+        }
+
+        unsigned int type = read32(offset, section.swapped);
+        unsigned int length = read32(offset + 4, section.swapped);
+        if (type == PCAPNG_SPB)
+        {
+            // No interface id, timestamp or captured length, the length is the smaller of both limits
+            unsigned int size = read32(offset + 8, section.swapped);
+            if (!section.interfaces.empty() && section.interfaces[0].snaplen && size > section.interfaces[0].snaplen)
+                size = section.interfaces[0].snaplen;
+            packet.data = mapping->data + offset + 12;
+            packet.size = std::min(size, length - 16);
+            packet.wireLength = read32(offset + 8, section.swapped);
+            packet.timestamp = 0;
+            return packet;
+        }
+
+        // Enhanced and obsolete packet blocks share the layout, the latter has a 16 bit interface id
+        unsigned int interfaceId = type == PCAPNG_PB ? read16(offset + 8, section.swapped)
+                                                     : read32(offset + 8, section.swapped);
+        unsigned long long ticks = ((unsigned long long)read32(offset + 12, section.swapped) << 32) |
+                                   read32(offset + 16, section.swapped);
+        packet.data = mapping->data + offset + 28;
+        packet.size = std::min(read32(offset + 20, section.swapped), length - 32);
+        packet.wireLength = read32(offset + 24, section.swapped);
+        packet.timestamp = interfaceId < section.interfaces.size()
+                               ? toNanoseconds(ticks, section.interfaces[interfaceId])
+                               : 0;
+        return packet;
+    }
+
+public:
+    PcapReader() : pcapng(false), cursor(0), truncated(false) {}
+
+    PcapReader(const PcapReader &) = delete;
+    PcapReader &operator=(const PcapReader &) = delete;
+
+    // Maps and indexes a pcap or pcapng file, returns false and fills error if it cannot be read
+    bool open(const std::string &path, std::string &error)
+    {
+        close();
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            error = "Unable to open " + path + ": " + strerror(errno);
+            return false;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) < 0 || info.st_size < 4)
+        {
+            ::close(fd);
+            error = "Not a capture file";
+            return false;
+        }
+
+        void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); // The mapping stays valid without the descriptor
+        if (data == MAP_FAILED)
+        {
+            error = "Unable to map " + path + ": " + strerror(errno);
+            return false;
+        }
+        mapping = std::make_shared<Mapping>(static_cast<const unsigned char *>(data), (size_t)info.st_size);
+
+        unsigned int magic;
+        memcpy(&magic, data, 4);
+        bool ok;
+        madvise(data, info.st_size, MADV_SEQUENTIAL);
+        if (magic == PCAPNG_SHB)
+        {
+            pcapng = true;
+            ok = indexPcapng(error);
+        }
+        else if (magic == PCAP_MAGIC_MICRO || magic == PCAP_MAGIC_NANO ||
+                 magic == __builtin_bswap32(PCAP_MAGIC_MICRO) || magic == __builtin_bswap32(PCAP_MAGIC_NANO))
+        {
+            pcapng = false;
+            ok = indexPcap(error);
+        }
+        else
+        {
+            error = "Not a pcap or pcapng file";
+            ok = false;
+        }
+        madvise(data, info.st_size, MADV_NORMAL); // Browsing jumps around the file
+
+        if (!ok)
+            close();
+        return ok;
+    }
+
+    // Drops the index and this reader's reference to the mapping
+    void close()
+    {
+        mapping.reset();
+        offsets.clear();
+        sections.clear();
+        cursor = 0;
+        truncated = false;
+    }
+
+    bool isOpen() const { return static_cast<bool>(mapping); }
+
+    // Number of packets in the file
+    size_t size() const { return offsets.size(); }
+
+    // Decodes the record header and the layers of a packet
+    Packet operator[](size_t index) const
+    {
+        Packet packet = record(index);
+        dissect(packet.data, packet.size, packet.info);
+        return packet;
+    }
+
+    // Link type of the first interface, the GUI only decodes LINKTYPE_ETHERNET
+    unsigned int linkType() const
+    {
+        if (sections.empty() || sections[0].interfaces.empty())
+            return 0;
+        return sections[0].interfaces[0].linkType;
+    }
+
+    // True if the file ends in the middle of a record, everything before it is indexed
+    bool isTruncated() const { return truncated; }
+
+    // Keeps the file mapped for as long as the returned reference exists
+    std::shared_ptr<const void> getMapping() const { return mapping; }
+
+    /*
+    Hands up to maxPackets packets to handler(const Packet &packet), continuing where the
+    previous call stopped, the same way PacketSniffer::consume() hands over live packets.
+    Returns 0 once the whole file was read.
+    */
+    template <typename Handler>
+    size_t consume(Handler handler, size_t maxPackets = READER_BATCH)
+    {
+        size_t count = 0;
+        while (count < maxPackets && cursor < offsets.size())
+        {
+            handler((*this)[cursor++]);
+            count++;
+        }
+        return count;
+    }
+
+    // Adds up to maxPackets packets to the store as views of the mapping, without copying
+    size_t drain(PacketStore &store, size_t maxPackets = READER_BATCH)
+    {
+        if (cursor >= offsets.size())
+            return 0;
+        store.retain(mapping);
+        return consume([&store](const Packet &packet)
+                       { store.addView(packet); },
+                       maxPackets);
+    }
+
+    // Starts handing out packets from the beginning again
+    void rewind() { cursor = 0; }
+
+    // Packets handed out so far
+    size_t position() const { return cursor; }
+};
@@ -0,0 +1,400 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "packet_store.h"
+#include "pcap_format.h"
+
+#define WRITER_BUFFER_SIZE (4 << 20) // Bytes handed to the writer thread per write()
+#define WRITER_BUFFER_COUNT 4
+#define WRITER_ALIGNMENT 4096       // Buffer address and write size alignment required by O_DIRECT
+#define WRITER_SNAPLEN 262144
+
+struct PcapWriterOptions
+{
+    unsigned long long rotateBytes; // Start a new file once this many bytes were written, 0 to disable
+    unsigned int rotateSeconds;     // Start a new file once packets span this many seconds, 0 to disable
+    bool directIo;                  // Bypass the page cache with O_DIRECT when the filesystem supports it
+    unsigned int snaplen;           // Recorded in the interface description
+
+    PcapWriterOptions() : rotateBytes(0), rotateSeconds(0), directIo(false), snaplen(WRITER_SNAPLEN) {}
+};
+
+/*
+Streaming pcapng writer with nanosecond timestamps.
+
+write() only serializes the packet into the current buffer, full buffers are
+handed to a background thread that does the actual write() calls, so the
+caller never waits on the disk unless every buffer is in flight. Buffers are
+page aligned and always written in multiples of WRITER_ALIGNMENT: the
+unaligned tail of a full buffer is carried over to the next one, so the file
+can be opened with O_DIRECT. Only the very last write of a file can be
+unaligned, O_DIRECT is switched off for it.
+*/
+class PcapngWriter
+{
+private:
+    struct Buffer
+    {
+        unsigned char *data;
+        size_t used;
+        bool endsFile;
+        std::string startsFile; // Path of the file this buffer starts, empty when it continues one
+    };
+
+    PcapWriterOptions options;
+    std::string basePath;
+    bool active;
+
+    // Producer side
+    Buffer *current;
+    unsigned long long fileBytes;
+    unsigned long long fileStart; // Timestamp of the first packet in the current file
+    unsigned int fileIndex;
+    unsigned long long packets;
+
+    // Shared with the writer thread
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<Buffer> buffers;
+    std::deque<Buffer *> freeBuffers;
+    std::deque<Buffer *> filledBuffers;
+    bool stopping;
+    std::thread writerThread;
+    std::atomic<unsigned long long> bytesWritten;
+    std::atomic<unsigned int> filesWritten;
+    std::atomic<bool> failed;
+
+    static size_t pad4(size_t size) { return (size + 3) & ~(size_t)3; }
+
+    void put32(unsigned int value)
+    {
+        memcpy(current->data + current->used, &value, 4);
+        current->used += 4;
+    }
+
+    void put16(unsigned short value)
+    {
+        memcpy(current->data + current->used, &value, 2);
+        current->used += 2;
+    }
+
+    std::string fileName(unsigned int index) const
+    {
+        if (options.rotateBytes == 0 && options.rotateSeconds == 0)
+            return basePath;
+
+        size_t dot = basePath.rfind('.');
+        size_t slash = basePath.rfind('/');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+            dot = basePath.size();
+
+        char number[16];
+        snprintf(number, sizeof(number), "_%05u", index);
+        return basePath.substr(0, dot) + number + basePath.substr(dot);
+    }
+
+    Buffer *acquire()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [this]
+                     { return !freeBuffers.empty(); });
+        Buffer *buffer = freeBuffers.front();
+        freeBuffers.pop_front();
+        buffer->used = 0;
+        buffer->endsFile = false;
+        buffer->startsFile.clear();
+        return buffer;
+    }
+
+    void submit(Buffer *buffer)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            filledBuffers.push_back(buffer);
+        }
+        changed.notify_all();
+    }
+
+    // Hands the current buffer over while keeping its unaligned tail for the next write
+    void submitAligned()
+    {
+        Buffer *full = current;
+        size_t tail = full->used % WRITER_ALIGNMENT;
+        current = acquire();
+        memcpy(current->data, full->data + full->used - tail, tail);
+        current->used = tail;
+        full->used -= tail;
+        submit(full);
+    }
+
+    void beginFile(unsigned long long timestamp)
+    {
+        current = acquire();
+        current->startsFile = fileName(fileIndex++);
+        fileBytes = 0;
+        fileStart = timestamp;
+
+        // Section header block, little endian on every platform this runs on
+        put32(PCAPNG_SHB);
+        put32(28);
+        put32(PCAPNG_BYTE_ORDER_MAGIC);
+        put16(1); // Major version
+        put16(0); // Minor version
+        put32(0xffffffff); // Section length unknown, 64 bits
+        put32(0xffffffff);
+        put32(28);
+
+        // Interface description block with nanosecond resolution
+        put32(PCAPNG_IDB);
+        put32(32);
+        put16(LINKTYPE_ETHERNET);
+        put16(0);
+        put32(options.snaplen);
+        put16(PCAPNG_OPT_IF_TSRESOL);
+        put16(1);
+        put32(9); // 10^-9, the three padding bytes are zero
+        put16(PCAPNG_OPT_ENDOFOPT);
+        put16(0);
+        put32(32);
+
+        fileBytes += current->used;
+    }
+
+    void endFile()
+    {
+        current->endsFile = true;
+        submit(current);
+        current = NULL;
+    }
+
+    static bool writeAll(int fd, const unsigned char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t written = ::write(fd, data, size);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    int openFile(const std::string &path)
+    {
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        int fd = -1;
+        if (options.directIo)
+            fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+        if (fd < 0) // Also the fallback for filesystems without O_DIRECT such as tmpfs
+            fd = ::open(path.c_str(), flags, 0644);
+        if (fd < 0)
+            std::cerr << "Unable to open " << path << std::endl;
+        else
+            filesWritten++;
+        return fd;
+    }
+
+    void writerThreadFunc()
+    {
+        int fd = -1;
+        while (true)
+        {
+            Buffer *buffer;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [this]
+                             { return stopping || !filledBuffers.empty(); });
+                if (filledBuffers.empty())
+                    break;
+                buffer = filledBuffers.front();
+                filledBuffers.pop_front();
+            }
+
+            if (!buffer->startsFile.empty())
+            {
+                if (fd >= 0)
+                    ::close(fd);
+                fd = openFile(buffer->startsFile);
+            }
+
+            if (fd >= 0)
+            {
+                size_t aligned = buffer->used - buffer->used % WRITER_ALIGNMENT;
+                bool ok = writeAll(fd, buffer->data, aligned);
+                if (ok && aligned < buffer->used)
+                {
+                    // Only the end of a file is unaligned, O_DIRECT would reject it
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                    ok = writeAll(fd, buffer->data + aligned, buffer->used - aligned);
+                }
+                if (!ok)
+                {
+                    std::cerr << "Error writing capture file" << std::endl;
+                    failed = true;
+                }
+                bytesWritten += buffer->used;
+            }
+            else
+                failed = true;
+
+            if (buffer->endsFile && fd >= 0)
+            {
+                ::close(fd);
+                fd = -1;
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                freeBuffers.push_back(buffer);
+            }
+            changed.notify_all();
+        }
+
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+public:
+    PcapngWriter()
+        : active(false), current(NULL), fileBytes(0), fileStart(0), fileIndex(0), packets(0), stopping(false),
+          bytesWritten(0), filesWritten(0), failed(false) {}
+
+    ~PcapngWriter()
+    {
+        close();
+        for (size_t i = 0; i < buffers.size(); i++)
+            free(buffers[i].data);
+    }
+
+    PcapngWriter(const PcapngWriter &) = delete;
+    PcapngWriter &operator=(const PcapngWriter &) = delete;
+
+    // Starts the writer thread, the first file is only created once the first packet arrives
+    bool open(const std::string &path, const PcapWriterOptions &writerOptions = PcapWriterOptions())
+    {
+        close();
+        if (path.empty())
+            return false;
+
+        if (buffers.empty())
+        {
+            buffers.resize(WRITER_BUFFER_COUNT);
+            for (size_t i = 0; i < buffers.size(); i++)
+            {
+                void *data = NULL;
+                if (posix_memalign(&data, WRITER_ALIGNMENT, WRITER_BUFFER_SIZE) != 0)
+                {
+                    std::cerr << "Error allocating writer buffers" << std::endl;
+                    buffers.resize(i);
+                    return false;
+                }
+                buffers[i].data = static_cast<unsigned char *>(data);
+            }
+        }
+
+        freeBuffers.clear();
+        filledBuffers.clear();
+        for (size_t i = 0; i < buffers.size(); i++)
+            freeBuffers.push_back(&buffers[i]);
+
+        options = writerOptions;
+        basePath = path;
+        fileIndex = 0;
+        packets = 0;
+        bytesWritten = 0;
+        filesWritten = 0;
+        failed = false;
+        stopping = false;
+        active = true;
+        writerThread = std::thread(&PcapngWriter::writerThreadFunc, this);
+        return true;
+    }
+
+    /*
+    Appends a packet as an enhanced packet block. Blocks only when every buffer is waiting
+    for the disk. Returns false if the writer is not open.
+    */
+    bool write(const Packet &packet)
+    {
+        if (!active)
+            return false;
+
+        size_t block = 32 + pad4(packet.size);
+        if (current)
+        {
+            bool bySize = options.rotateBytes && fileBytes + block > options.rotateBytes;
+            bool byTime = options.rotateSeconds &&
+                          packet.timestamp >= fileStart + options.rotateSeconds * 1000000000ULL;
+            if ((bySize || byTime) && fileBytes > 60) // Never rotate a file holding only headers
+                endFile();
+        }
+        if (!current)
+            beginFile(packet.timestamp);
+        if (current->used + block > WRITER_BUFFER_SIZE)
+            submitAligned();
+
+        put32(PCAPNG_EPB);
+        put32((unsigned int)block);
+        put32(0); // Interface id
+        put32((unsigned int)(packet.timestamp >> 32));
+        put32((unsigned int)packet.timestamp);
+        put32(packet.size);
+        put32(packet.wireLength > (unsigned int)packet.size ? packet.wireLength : packet.size);
+        memcpy(current->data + current->used, packet.data, packet.size);
+        memset(current->data + current->used + packet.size, 0, pad4(packet.size) - packet.size);
+        current->used += pad4(packet.size);
+        put32((unsigned int)block);
+
+        fileBytes += block;
+        packets++;
+        return true;
+    }
+
+    // Flushes every buffer, waits for the writer thread and closes the file
+    void close()
+    {
+        if (!active)
+            return;
+
+        if (current)
+            endFile();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        changed.notify_all();
+        writerThread.join();
+        active = false;
+    }
+
+    bool isOpen() const { return active; }
+
+    bool hasFailed() const { return failed; }
+
+    unsigned long long packetsWritten() const { return packets; }
+
+    // Bytes that reached the files so far
+    unsigned long long getBytesWritten() const { return bytesWritten; }
+
+    unsigned int getFilesWritten() const { return filesWritten; }
+};
@@ -0,0 +1,598 @@
+#pragma once
+
+#include <poll.h>
+
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "app_layer.h"
+#include "display_filter.h"
+#include "flow_table.h"
+#include "frame_queue.h"
+#include "pcap_reader.h"
+#include "pcap_writer.h"
+#include "recv_batch.h"
+#include "ring.h"
+#include "stats.h"
+#include "tcp_reassembly.h"
+#include "timeline.h"
+
+#define PIPELINE_BATCH 64    // Packets a source hands to the stages at once
+#define PIPELINE_TIMEOUT 100 // Milliseconds the socket and ring sources wait in read() by default
+
+/*
+Capture pipelines built from a source and a list of stages, the last of which is usually a sink.
+
+A source reads packets in batches of up to PIPELINE_BATCH and hands them to
+handler(Packet *packets, size_t count). Its read() returns how many it handed over,
+0 when none were ready or it reached the end, and -1 with errno set on an error.
+
+A stage has bool process(Packet &packet), which may change the packet and returns false
+to drop it, and void flush(), called once the whole batch went through the stage. Each
+stage runs over the whole batch before the next one, so its loop stays tight and only
+the packets it kept are handed on. Packet data belongs to the source and is only valid
+until its handler returns, sinks that keep packets must copy them.
+*/
+
+// Base of the stages, for those with nothing to do at the end of a batch
+struct PipelineStage
+{
+    void flush() {}
+};
+
+// Runs stage Index and the ones after it over a batch, dropped packets are compacted out
+template <size_t Index, size_t Count>
+struct PipelineRunner
+{
+    template <typename Stages>
+    static size_t run(Stages &stages, Packet *packets, size_t count)
+    {
+        typename std::tuple_element<Index, Stages>::type &stage = std::get<Index>(stages);
+        size_t kept = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!stage.process(packets[i]))
+                continue;
+            if (kept != i)
+                packets[kept] = packets[i];
+            kept++;
+        }
+        stage.flush();
+        return PipelineRunner<Index + 1, Count>::run(stages, packets, kept);
+    }
+};
+
+template <size_t Count>
+struct PipelineRunner<Count, Count>
+{
+    template <typename Stages>
+    static size_t run(Stages &, Packet *, size_t count) { return count; }
+};
+
+/*
+Pipeline whose stages are fixed at compile time, every call goes straight to the
+stage type so the compiler can inline the whole chain into the loop over a batch.
+*/
+template <typename Source, typename... Stages>
+class Pipeline
+{
+private:
+    Source source;
+    std::tuple<Stages...> stages;
+
+public:
+    explicit Pipeline(const Source &from, const Stages &...stageList) : source(from), stages(stageList...) {}
+
+    // Runs a batch through every stage, returns how many packets none of them dropped
+    size_t process(Packet *packets, size_t count)
+    {
+        return PipelineRunner<0, sizeof...(Stages)>::run(stages, packets, count);
+    }
+
+    // Reads one batch from the source and runs it, returns what the source's read() returned
+    int run()
+    {
+        return source.read([this](Packet *packets, size_t count)
+                           { process(packets, count); });
+    }
+
+    Source &getSource() { return source; }
+
+    template <size_t Index>
+    typename std::tuple_element<Index, std::tuple<Stages...>>::type &stage()
+    {
+        return std::get<Index>(stages);
+    }
+};
+
+template <typename Source, typename... Stages>
+Pipeline<Source, Stages...> makePipeline(const Source &source, const Stages &...stages)
+{
+    return Pipeline<Source, Stages...>(source, stages...);
+}
+
+/*
+Pipeline whose stages are chosen at run time, such as those the GUI turns on and off.
+Packets go through the stages the same way as in Pipeline, with one virtual call per
+packet and stage.
+*/
+class DynamicPipeline
+{
+private:
+    struct Node
+    {
+        std::string name;
+
+        virtual ~Node() {}
+        virtual bool process(Packet &packet) = 0;
+        virtual void flush() = 0;
+    };
+
+    template <typename Stage>
+    struct StageNode : Node
+    {
+        Stage stage;
+
+        explicit StageNode(const Stage &from) : stage(from) {}
+        bool process(Packet &packet) { return stage.process(packet); }
+        void flush() { stage.flush(); }
+    };
+
+    std::vector<std::unique_ptr<Node>> nodes;
+
+public:
+    DynamicPipeline() {}
+
+    DynamicPipeline(const DynamicPipeline &) = delete;
+    DynamicPipeline &operator=(const DynamicPipeline &) = delete;
+
+    // Appends a stage, the name is used to remove it and to show the pipeline
+    template <typename Stage>
+    void add(const std::string &name, const Stage &stage)
+    {
+        nodes.push_back(std::unique_ptr<Node>(new StageNode<Stage>(stage)));
+        nodes.back()->name = name;
+    }
+
+    // Removes the stages called name, returns false if there was none
+    bool remove(const std::string &name)
+    {
+        bool found = false;
+        for (size_t i = nodes.size(); i-- > 0;)
+        {
+            if (nodes[i]->name != name)
+                continue;
+            nodes.erase(nodes.begin() + i);
+            found = true;
+        }
+        return found;
+    }
+
+    bool contains(const std::string &name) const
+    {
+        for (size_t i = 0; i < nodes.size(); i++)
+            if (nodes[i]->name == name)
+                return true;
+        return false;
+    }
+
+    size_t stageCount() const { return nodes.size(); }
+
+    const std::string &stageName(size_t index) const { return nodes[index]->name; }
+
+    // Runs a batch through every stage, returns how many packets none of them dropped
+    size_t process(Packet *packets, size_t count)
+    {
+        for (size_t n = 0; n < nodes.size(); n++)
+        {
+            Node &node = *nodes[n];
+            size_t kept = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                if (!node.process(packets[i]))
+                    continue;
+                if (kept != i)
+                    packets[kept] = packets[i];
+                kept++;
+            }
+            node.flush();
+            count = kept;
+        }
+        return count;
+    }
+
+    // Reads one batch from source and runs it, returns what the source's read() returned
+    template <typename Source>
+    int run(Source &source)
+    {
+        return source.read([this](Packet *packets, size_t count)
+                           { process(packets, count); });
+    }
+};
+
+// Sources
+
+// Packets of a store from first on, each read() continues where the last one stopped
+class StoreSource
+{
+private:
+    const PacketStore *store;
+    PacketHandle next;
+
+public:
+    explicit StoreSource(const PacketStore &from, PacketHandle first = 0) : store(&from), next(first) {}
+
+    template <typename BatchHandler>
+    int read(BatchHandler handler)
+    {
+        // A spilled segment holds far more than a batch, so the cache keeps every packet of it loaded
+        Packet batch[PIPELINE_BATCH];
+        size_t count = 0;
+        for (size_t end = store->size(); count < PIPELINE_BATCH && next < end; count++)
+            batch[count] = (*store)[next++];
+        if (count)
+            handler(batch, count);
+        return (int)count;
+    }
+
+    PacketHandle position() const { return next; }
+};
+
+// Up to maxPackets packets of an opened capture file per read(), already dissected, as views of the mapped file
+class PcapFileSource
+{
+private:
+    PcapReader *reader;
+    size_t maxPackets;
+
+public:
+    explicit PcapFileSource(PcapReader &from, size_t limit = READER_BATCH) : reader(&from), maxPackets(limit) {}
+
+    template <typename BatchHandler>
+    int read(BatchHandler handler)
+    {
+        Packet batch[PIPELINE_BATCH];
+        size_t total = 0;
+        while (total < maxPackets)
+        {
+            size_t count = 0;
+            size_t want = maxPackets - total < PIPELINE_BATCH ? maxPackets - total : PIPELINE_BATCH;
+            reader->consume([&batch, &count](const Packet &packet)
+                            { batch[count++] = packet; },
+                            want);
+            if (!count)
+                break;
+            handler(batch, count);
+            total += count;
+        }
+        return (int)total;
+    }
+};
+
+// Waits until fd is readable, returns 1 when it is, 0 on timeout and -1 with errno set
+inline int pipelineWait(int fd, int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ret = ::poll(&pfd, 1, timeout);
+    return ret < 0 && errno == EINTR ? 0 : ret > 0 ? 1 : ret;
+}
+
+// Frames of one block of a receive ring, not dissected, read() waits up to timeout milliseconds
+class RingSource
+{
+private:
+    PacketRing *ring;
+    int timeout;
+
+public:
+    explicit RingSource(PacketRing &from, int wait = PIPELINE_TIMEOUT) : ring(&from), timeout(wait) {}
+
+    template <typename BatchHandler>
+    int read(BatchHandler handler)
+    {
+        // The frames stay in the ring until the block is released, after the last batch of it
+        Packet batch[PIPELINE_BATCH];
+        size_t count = 0;
+        return ring->poll([&batch, &count, &handler](const struct tpacket3_hdr *hdr, const unsigned char *data)
+                          {
+                              batch[count] = Packet();
+                              readRingFrame(hdr, data, batch[count]);
+                              if (++count == PIPELINE_BATCH)
+                              {
+                                  handler(batch, count);
+                                  count = 0;
+                              } },
+                          timeout,
+                          [&batch, &count, &handler]()
+                          {
+                              if (count)
+                                  handler(batch, count);
+                              count = 0;
+                          });
+    }
+};
+
+// Frames received from a socket with recvmmsg(), not dissected, read() waits up to timeout milliseconds
+class RecvMmsgSource
+{
+private:
+    int fd;
+    RecvBatch *frames;
+    int timeout;
+
+public:
+    RecvMmsgSource(int sock, RecvBatch &buffers, int wait = PIPELINE_TIMEOUT)
+        : fd(sock), frames(&buffers), timeout(wait) {}
+
+    template <typename BatchHandler>
+    int read(BatchHandler handler)
+    {
+        int ready = pipelineWait(fd, timeout);
+        if (ready <= 0)
+            return ready;
+
+        int received = frames->receive(fd);
+        if (received < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+
+        // The buffers are reused by the next receive(), every batch is handled before returning
+        Packet batch[PIPELINE_BATCH];
+        size_t count = 0;
+        for (int i = 0; i < received; i++)
+        {
+            Packet &packet = batch[count];
+            packet = Packet();
+            packet.data = frames->data(i);
+            packet.size = frames->size(i);
+            readControl(frames->header(i), packet);
+            if (++count == PIPELINE_BATCH)
+            {
+                handler(batch, count);
+                count = 0;
+            }
+        }
+        if (count)
+            handler(batch, count);
+        return received;
+    }
+};
+
+// One frame per read() received with recvmsg() into buffer, not dissected, read() waits up to timeout milliseconds
+class RecvFromSource
+{
+private:
+    int fd;
+    std::vector<unsigned char> *buffer;
+    int timeout;
+
+public:
+    RecvFromSource(int sock, std::vector<unsigned char> &frame, int wait = PIPELINE_TIMEOUT)
+        : fd(sock), buffer(&frame), timeout(wait) {}
+
+    template <typename BatchHandler>
+    int read(BatchHandler handler)
+    {
+        int ready = pipelineWait(fd, timeout);
+        if (ready <= 0)
+            return ready;
+
+        Packet packet = Packet();
+        if (readSocket(fd, *buffer, packet) < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        handler(&packet, 1);
+        return 1;
+    }
+};
+
+// Stages
+
+// Decodes the headers, for sources that hand over raw frames
+struct DissectStage : PipelineStage
+{
+    bool process(Packet &packet)
+    {
+        dissect(packet.data, packet.size > 0 ? packet.size : 0, packet.info);
+        return true;
+    }
+};
+
+// Finds DNS, HTTP and TLS host names, after DissectStage. A NULL pool passes packets through
+struct ApplicationStage : PipelineStage
+{
+    StringPool *names;
+
+    explicit ApplicationStage(StringPool *pool) : names(pool) {}
+
+    bool process(Packet &packet)
+    {
+        if (names)
+            dissectApplication(packet, *names);
+        return true;
+    }
+};
+
+// Drops the packets a display filter does not match
+struct FilterStage : PipelineStage
+{
+    const DisplayFilter *filter;
+
+    explicit FilterStage(const DisplayFilter &from) : filter(&from) {}
+
+    bool process(Packet &packet) { return filter->matches(packet); }
+};
+
+// Cuts packets to a snaplen or to their headers, see truncatedLength()
+struct SnaplenStage : PipelineStage
+{
+    unsigned int snaplen;
+    bool headersOnly;
+
+    explicit SnaplenStage(unsigned int length, bool headers = false) : snaplen(length), headersOnly(headers) {}
+
+    bool process(Packet &packet)
+    {
+        packet.size = truncatedLength(packet, snaplen, headersOnly);
+        return true;
+    }
+};
+
+// A NULL timeline passes packets through
+struct TimelineStage : PipelineStage
+{
+    Timeline *timeline;
+    unsigned int lane;
+
+    explicit TimelineStage(Timeline *to, unsigned int laneIndex = 0) : timeline(to), lane(laneIndex) {}
+
+    bool process(Packet &packet)
+    {
+        if (timeline)
+            timeline->add(packet, lane);
+        return true;
+    }
+};
+
+// A NULL reassembler passes packets through
+struct ReassemblyStage : PipelineStage
+{
+    TcpReassembler *reassembler;
+
+    explicit ReassemblyStage(TcpReassembler *to) : reassembler(to) {}
+
+    bool process(Packet &packet)
+    {
+        if (reassembler)
+            reassembler->add(packet);
+        return true;
+    }
+};
+
+struct FlowStage : PipelineStage
+{
+    FlowTable *flows;
+
+    explicit FlowStage(FlowTable &to) : flows(&to) {}
+
+    bool process(Packet &packet)
+    {
+        flows->update(packet);
+        return true;
+    }
+};
+
+struct HostStage : PipelineStage
+{
+    HostTable *hosts;
+
+    explicit HostStage(HostTable &to) : hosts(&to) {}
+
+    bool process(Packet &packet)
+    {
+        hosts->update(packet);
+        return true;
+    }
+};
+
+// Sinks, they keep every packet so stages after them still see it
+
+// Copies packets into a store
+struct StoreSink : PipelineStage
+{
+    PacketStore *store;
+
+    explicit StoreSink(PacketStore &to) : store(&to) {}
+
+    bool process(Packet &packet)
+    {
+        store->add(packet);
+        return true;
+    }
+};
+
+// Adds packets to a store as views, their source must outlive the store or be retained by it
+struct ViewSink : PipelineStage
+{
+    PacketStore *store;
+
+    explicit ViewSink(PacketStore &to) : store(&to) {}
+
+    bool process(Packet &packet)
+    {
+        store->addView(packet);
+        return true;
+    }
+};
+
+struct WriterSink : PipelineStage
+{
+    PcapngWriter *writer;
+
+    explicit WriterSink(PcapngWriter &to) : writer(&to) {}
+
+    bool process(Packet &packet)
+    {
+        writer->write(packet);
+        return true;
+    }
+};
+
+// Copies packets into a frame queue and publishes them once per batch, from its producer thread
+struct QueueSink : PipelineStage
+{
+    FrameQueue *queue;
+
+    explicit QueueSink(FrameQueue &to) : queue(&to) {}
+
+    bool process(Packet &packet)
+    {
+        queue->push(packet);
+        return true;
+    }
+
+    void flush() { queue->publish(); }
+};
+
+// Counts packets and wire bytes in the metrics of a capture worker, once per batch
+struct MetricsStage
+{
+    WorkerMetrics *metrics;
+    unsigned long long packets;
+    unsigned long long bytes;
+
+    explicit MetricsStage(WorkerMetrics &to) : metrics(&to), packets(0), bytes(0) {}
+
+    bool process(Packet &packet)
+    {
+        packets++;
+        bytes += packet.wireLength;
+        return true;
+    }
+
+    void flush()
+    {
+        metrics->count(packets, bytes);
+        packets = 0;
+        bytes = 0;
+    }
+};
+
+// Counts packets and captured bytes
+struct CountSink : PipelineStage
+{
+    unsigned long long packets;
+    unsigned long long bytes;
+
+    CountSink() : packets(0), bytes(0) {}
+
+    bool process(Packet &packet)
+    {
+        packets++;
+        bytes += packet.size;
+        return true;
+    }
+};
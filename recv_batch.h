@@ -0,0 +1,172 @@
+#pragma once
+
+#include <linux/errqueue.h> // For scm_timestamping
+#include <linux/if_packet.h> // For tpacket_auxdata
+#include <sys/socket.h>
+#include <time.h>
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "packet.h"
+
+#define RECV_BATCH_FRAMES 64 // Frames per recvmmsg() call, 32 to 256 work well
+#define RECV_CONTROL_SIZE (CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct tpacket_auxdata)))
+
+/*
+Pool of receive buffers for recvmmsg().
+
+Every slot has a fixed buffer sized to the largest frame expected on the
+interface, its iovec and room for the timestamp and auxdata control messages, all set up
+once per capture. A single recvmmsg() call fills as many slots as there are
+frames waiting, the slots are reused by the next call once the worker has
+copied the frames out, so nothing is allocated while capturing.
+*/
+class RecvBatch
+{
+private:
+    std::unique_ptr<unsigned char[]> buffers; // Left uninitialized so unused slots cost no memory
+    std::unique_ptr<char[]> control;
+    std::vector<struct mmsghdr> messages;
+    std::vector<struct iovec> iovecs;
+    size_t frameSize;
+    std::atomic<unsigned long long> truncated; // Written by the capture thread only
+
+public:
+    RecvBatch() : frameSize(0), truncated(0) {}
+
+    bool isActive() const { return !messages.empty(); }
+
+    // Allocates frameCount buffers of frameSize bytes
+    void setup(unsigned int frameCount, size_t size)
+    {
+        frameSize = size;
+        truncated.store(0, std::memory_order_relaxed);
+        buffers.reset(new unsigned char[frameCount * size]);
+        control.reset(new char[frameCount * RECV_CONTROL_SIZE]);
+        messages.assign(frameCount, mmsghdr());
+        iovecs.resize(frameCount);
+        for (unsigned int i = 0; i < frameCount; i++)
+        {
+            iovecs[i].iov_base = buffers.get() + i * size;
+            iovecs[i].iov_len = size;
+            std::memset(&messages[i], 0, sizeof(messages[i]));
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    void teardown()
+    {
+        buffers.reset();
+        control.reset();
+        messages.clear();
+        iovecs.clear();
+    }
+
+    /*
+    Receives the frames already waiting on fd without blocking, up to one per slot.
+    Returns how many arrived, or -1 with errno set.
+    */
+    int receive(int fd)
+    {
+        for (size_t i = 0; i < messages.size(); i++)
+        {
+            // The kernel overwrites these on every call
+            messages[i].msg_hdr.msg_control = control.get() + i * RECV_CONTROL_SIZE;
+            messages[i].msg_hdr.msg_controllen = RECV_CONTROL_SIZE;
+            messages[i].msg_hdr.msg_flags = 0;
+        }
+        int count = recvmmsg(fd, messages.data(), messages.size(), MSG_DONTWAIT, NULL);
+        unsigned long long cut = 0;
+        for (int i = 0; i < count; i++)
+            if (messages[i].msg_hdr.msg_flags & MSG_TRUNC)
+                cut++;
+        if (cut)
+            truncated.store(truncated.load(std::memory_order_relaxed) + cut, std::memory_order_relaxed);
+        return count;
+    }
+
+    const unsigned char *data(unsigned int i) const { return buffers.get() + i * frameSize; }
+
+    // Captured size, frames longer than the buffer are cut to it
+    unsigned int size(unsigned int i) const
+    {
+        return messages[i].msg_len < frameSize ? messages[i].msg_len : (unsigned int)frameSize;
+    }
+
+    const struct msghdr &header(unsigned int i) const { return messages[i].msg_hdr; }
+
+    // Frames cut because they did not fit in a buffer
+    unsigned long long truncatedFrames() const { return truncated.load(std::memory_order_relaxed); }
+};
+
+/*
+Fills in the packet timestamp from the SO_TIMESTAMPING control message, the clock is only
+read if the kernel sent none, and the wire length from PACKET_AUXDATA, which still holds
+the original length when the filter or the buffer cut the frame short.
+*/
+inline void readControl(const struct msghdr &msg, Packet &packet)
+{
+    packet.timestampSource = TimestampSource::User;
+    packet.timestamp = 0;
+    packet.wireLength = packet.size;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(const_cast<struct msghdr *>(&msg), cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_AUXDATA)
+        {
+            struct tpacket_auxdata aux;
+            std::memcpy(&aux, CMSG_DATA(cmsg), sizeof(aux));
+            if (aux.tp_len > packet.wireLength)
+                packet.wireLength = aux.tp_len;
+            continue;
+        }
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+            continue;
+        struct scm_timestamping stamps;
+        std::memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+        // ts[0] is the software stamp, ts[2] the raw hardware one
+        if (stamps.ts[2].tv_sec || stamps.ts[2].tv_nsec)
+        {
+            packet.timestamp = (unsigned long long)stamps.ts[2].tv_sec * 1000000000ULL + stamps.ts[2].tv_nsec;
+            packet.timestampSource = TimestampSource::Hardware;
+        }
+        else if (stamps.ts[0].tv_sec || stamps.ts[0].tv_nsec)
+        {
+            packet.timestamp = (unsigned long long)stamps.ts[0].tv_sec * 1000000000ULL + stamps.ts[0].tv_nsec;
+            packet.timestampSource = TimestampSource::Software;
+        }
+    }
+    if (packet.timestampSource == TimestampSource::User)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        packet.timestamp = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+}
+
+// Reads one packet from fd into buffer and fills in packet, returns its captured size or -1 with errno set
+inline int readSocket(int fd, std::vector<unsigned char> &buffer, Packet &packet)
+{
+    struct iovec iov;
+    iov.iov_base = buffer.data();
+    iov.iov_len = buffer.size();
+    char control[RECV_CONTROL_SIZE];
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int data_size = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (data_size >= 0)
+    {
+        packet.data = buffer.data();
+        packet.size = data_size;
+        readControl(msg, packet);
+    }
+    return data_size;
+}
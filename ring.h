@@ -0,0 +1,182 @@
+#pragma once
+
+#include <linux/if_packet.h> // For tpacket_req3, tpacket_block_desc, tpacket3_hdr
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include "packet.h"
+
+#define RING_BLOCK_SIZE (1 << 20) // 1 MiB per block, must be a multiple of the page size
+#define RING_BLOCK_COUNT 64
+#define RING_FRAME_SIZE 2048      // Only used by the kernel for sanity checks on TPACKET_V3
+#define RING_RETIRE_TIMEOUT 60    // Milliseconds before a partially filled block is handed over
+
+/*
+TPACKET_V3 receive ring mapped on top of an existing AF_PACKET socket.
+
+The kernel fills whole blocks of variable sized frames and flips the block
+status to TP_STATUS_USER, user space walks every frame of the block directly
+in the shared mapping and gives the block back by setting TP_STATUS_KERNEL.
+No syscall is made per packet, only a poll() when the next block is not ready.
+*/
+class PacketRing
+{
+private:
+    int sock;
+    unsigned char *map;
+    size_t mapSize;
+    struct tpacket_req3 req;
+    unsigned int currentBlock;
+
+    struct tpacket_block_desc *block(unsigned int i)
+    {
+        return reinterpret_cast<struct tpacket_block_desc *>(map + (size_t)i * req.tp_block_size);
+    }
+
+    static bool blockReady(struct tpacket_block_desc *desc)
+    {
+        return __atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER;
+    }
+
+public:
+    PacketRing() : sock(-1), map(NULL), mapSize(0), currentBlock(0)
+    {
+        std::memset(&req, 0, sizeof(req));
+    }
+
+    ~PacketRing() { teardown(); }
+
+    bool isActive() const { return map != NULL; }
+
+    // Switches the socket to TPACKET_V3 and maps the receive ring, returns false on failure
+    bool setup(int socketFd,
+               unsigned int blockSize = RING_BLOCK_SIZE,
+               unsigned int blockCount = RING_BLOCK_COUNT,
+               unsigned int frameSize = RING_FRAME_SIZE,
+               unsigned int retireTimeout = RING_RETIRE_TIMEOUT)
+    {
+        if (isActive())
+            return true;
+
+        int version = TPACKET_V3;
+        if (setsockopt(socketFd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+        {
+            std::cerr << "Error setting TPACKET_V3 on the socket" << std::endl;
+            return false;
+        }
+
+        std::memset(&req, 0, sizeof(req));
+        req.tp_block_size = blockSize;
+        req.tp_block_nr = blockCount;
+        req.tp_frame_size = frameSize;
+        req.tp_frame_nr = (blockSize / frameSize) * blockCount;
+        req.tp_retire_blk_tov = retireTimeout;
+        req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+
+        if (setsockopt(socketFd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+        {
+            std::cerr << "Error creating the receive ring" << std::endl;
+            return false;
+        }
+
+        mapSize = (size_t)req.tp_block_size * req.tp_block_nr;
+        void *m = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, socketFd, 0);
+        if (m == MAP_FAILED)
+            m = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, socketFd, 0); // MAP_LOCKED needs CAP_IPC_LOCK
+        if (m == MAP_FAILED)
+        {
+            std::cerr << "Error mapping the receive ring" << std::endl;
+            std::memset(&req, 0, sizeof(req));
+            setsockopt(socketFd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+            return false;
+        }
+
+        map = static_cast<unsigned char *>(m);
+        sock = socketFd;
+        currentBlock = 0;
+        return true;
+    }
+
+    // Unmaps the ring and detaches it from the socket so it can be used with recvfrom() again
+    void teardown()
+    {
+        if (!isActive())
+            return;
+
+        munmap(map, mapSize);
+        map = NULL;
+        mapSize = 0;
+
+        std::memset(&req, 0, sizeof(req));
+        setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+        int version = TPACKET_V1;
+        setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version));
+        sock = -1;
+    }
+
+    /*
+    Waits up to timeout milliseconds for the next block and hands every frame in it to
+    handler(const struct tpacket3_hdr *hdr, const unsigned char *data). The data pointer
+    refers to the shared mapping and is only valid until the handler returns.
+    Returns the number of frames processed, 0 on timeout and -1 on error.
+    */
+    template <typename Handler>
+    int poll(Handler handler, int timeout)
+    {
+        return poll(handler, timeout, []() {});
+    }
+
+    // Same as poll(), and calls blockDone() after the last frame, while the block is still held
+    template <typename Handler, typename BlockDone>
+    int poll(Handler handler, int timeout, BlockDone blockDone)
+    {
+        struct tpacket_block_desc *desc = block(currentBlock);
+
+        if (!blockReady(desc))
+        {
+            struct pollfd pfd;
+            pfd.fd = sock;
+            pfd.events = POLLIN | POLLERR;
+            pfd.revents = 0;
+
+            int ret = ::poll(&pfd, 1, timeout);
+            if (ret < 0)
+                return errno == EINTR ? 0 : -1;
+            if (!blockReady(desc))
+                return 0;
+        }
+
+        unsigned int count = desc->hdr.bh1.num_pkts;
+        const unsigned char *ptr = reinterpret_cast<const unsigned char *>(desc) +
+                                   desc->hdr.bh1.offset_to_first_pkt;
+        for (unsigned int i = 0; i < count; i++)
+        {
+            const struct tpacket3_hdr *hdr = reinterpret_cast<const struct tpacket3_hdr *>(ptr);
+            handler(hdr, ptr + hdr->tp_mac);
+            ptr += hdr->tp_next_offset;
+        }
+        blockDone();
+
+        // Release so the kernel only reuses the block once every frame has been read
+        __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        currentBlock = (currentBlock + 1) % req.tp_block_nr;
+
+        return (int)count;
+    }
+};
+
+// Fills in a packet from a frame of the receive ring, data points into the mapping
+inline void readRingFrame(const struct tpacket3_hdr *hdr, const unsigned char *data, Packet &packet)
+{
+    packet.data = data;
+    packet.size = hdr->tp_snaplen;
+    packet.wireLength = hdr->tp_len;
+    packet.timestamp = (unsigned long long)hdr->tp_sec * 1000000000ULL + hdr->tp_nsec;
+    packet.timestampSource = (hdr->tp_status & TP_STATUS_TS_RAW_HARDWARE) ? TimestampSource::Hardware
+                                                                           : TimestampSource::Software;
+}
@@ -6,19 +6,115 @@
 
 #include <net/ethernet.h>     //For ether_header
 #include <netinet/if_ether.h> //For ETH_P_ALL
+#include <net/if.h>           //For if_nametoindex
+#include <linux/errqueue.h>   //For scm_timestamping
+#include <linux/net_tstamp.h> //For SOF_TIMESTAMPING_*
+#include <linux/sockios.h>    //For SIOCSHWTSTAMP
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
 #include <atomic>
+#include <cerrno>
+#include <cstdio>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <utility> // for std::pair
 #include <vector>
-#include <iomanip>
-#include <sstream>
+#include <time.h>
 
-#define BUFFSIZE 65536
+#include "app_layer.h"
+#include "bpf_filter.h"
+#include "frame_queue.h"
+#include "hexdump.h"
+#include "packet_store.h"
+#include "pipeline.h"
+#include "recv_batch.h"
+#include "ring.h"
+#include "stats.h"
+#include "tcp_reassembly.h"
+#include "timeline.h"
+
+#define BUFFSIZE (65535 + ETH_HLEN + 4 * DISSECT_MAX_VLANS) // Largest IP packet behind an Ethernet header and its VLAN tags
+#define POLL_TIMEOUT 100 // Milliseconds, bounds how long stopCapture() waits for the capture thread
+#define DRAIN_BATCH 65536 // Packets moved from the queue per drain() call by default
+#define CONSUME_BATCH 64 // Packets per handler call of consumeBatches()
+#define MERGE_DELAY 200000000ULL // Nanoseconds a worker may lag behind the others when merging by time
+#define FANOUT_GROUP_BASE 0x4353 // Fanout group ids are derived from this and the process id
+
+enum class CaptureBackend
+{
+    RecvFrom, // One recvfrom() syscall per packet
+    Ring,     // TPACKET_V3 memory-mapped receive ring
+    RecvMmsg  // recvmmsg() into a pool of buffers, for sockets where a ring cannot be mapped
+};
+
+// How the kernel spreads packets over the sockets of a fanout capture
+enum class FanoutMode
+{
+    Hash = PACKET_FANOUT_HASH, // By flow hash, keeps a flow on one worker
+    Cpu = PACKET_FANOUT_CPU,   // By the CPU that received the packet
+    LoadBalance = PACKET_FANOUT_LB // Round robin
+};
+
+// Clock used for packet timestamps, both are taken by the kernel
+enum class TimestampMode
+{
+    Software, // When the kernel received the packet
+    Hardware  // When the NIC received it, needs a bound interface whose driver supports it
+};
+
+// Network interface as listed by PacketSniffer::listInterfaces()
+struct CaptureInterface
+{
+    std::string name;
+    int index;
+    bool up;
+    bool loopback;
+};
+
+// Counters reported by the kernel through PACKET_STATISTICS
+struct CaptureStats
+{
+    unsigned long long packets; // Packets that reached the socket, including drops
+    unsigned long long drops;   // Packets dropped because the buffer or ring was full
+    unsigned long long freezes; // Times the TPACKET_V3 queue was frozen because no block was free
+};
+
+// One capture thread with its own socket, ring and queue, nothing in it is shared with other workers
+struct CaptureWorker
+{
+    int sock;
+    bool ownsSocket; // Fanout sockets are opened per capture, the main socket is reused
+    int cpu;         // Core the thread is pinned to, -1 when not pinned
+    unsigned int lane; // Timeline lane the worker counts its packets in
+    std::thread thread;
+    PacketRing ring;
+    RecvBatch batch;
+    FrameQueue queue;
+    CaptureStats stats;
+    WorkerMetrics metrics;
+    std::vector<unsigned char> recvBuffer; // Reused by every recvfrom(), packets are copied to the queue
+
+    CaptureWorker(int fd, bool owned, int core)
+        : sock(fd), ownsSocket(owned), cpu(core), lane(0), recvBuffer(BUFFSIZE)
+    {
+        std::memset(&stats, 0, sizeof(stats));
+    }
+
+    ~CaptureWorker()
+    {
+        ring.teardown();
+        if (ownsSocket)
+            close(sock);
+    }
+};
 
 class PacketSniffer
 {
@@ -26,128 +122,838 @@ private:
     int sock;
 
     std::atomic<bool> captureActive;
+    CaptureBackend backend;
+    std::vector<std::unique_ptr<CaptureWorker>> workers; // Kept after stopCapture() until the next start
+    std::vector<unsigned char> recvBuffer; // Used by capturePackets()
+    std::vector<struct sock_filter> filterProgram; // Empty when every packet is captured
+    std::string filterText;
+    std::atomic<unsigned int> snaplen; // 0 keeps whole packets, read by the capture threads
+    std::atomic<bool> headersOnly;
+    int interfaceIndex; // 0 captures on every interface
+    bool promiscuous;
+    std::vector<int> promiscuousInterfaces; // Memberships held by the main socket during a capture
+    TimestampMode timestampMode;
+    TcpReassembler *reassembler; // Fed by the capture workers when set
+    Timeline *timeline;          // Counts the packets of the capture workers when set
+    StringPool *names;           // Host names of the packets found by the capture workers when set
+    LatencyHistogram deliveryLatency; // Written by the consumer thread
+    unsigned int deliverySampleCountdown;
+
+    static unsigned long long now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    // Frees the queue bytes of every packet consumeBatches() handed over
+    void releaseQueues()
+    {
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i]->queue.release();
+    }
 
     int createSocket() { return socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL)); }
 
     void closeSocket() { close(sock); }
 
-    std::pair<int, unsigned char *> readSocket()
+    // Restricts fd to the selected interface, index 0 unbinds it
+    bool bindSocket(int fd)
+    {
+        struct sockaddr_ll addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sll_family = AF_PACKET;
+        addr.sll_protocol = htons(ETH_P_ALL);
+        addr.sll_ifindex = interfaceIndex;
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            std::cerr << "Error binding to the capture interface" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /*
+    Decides whether a worker keeps going after a failed read. Interrupted calls and empty
+    sockets are retried at once, a downed interface or a short memory shortage after a pause.
+    Anything else means the socket is unusable and ends the worker.
+    */
+    static bool recoverReadError(CaptureWorker *worker, int error)
     {
-        unsigned char *buf =
-            (unsigned char *)malloc(BUFFSIZE); // Allocate memory for buffer
-        if (!buf)
+        if (error == EINTR || error == EAGAIN || error == EWOULDBLOCK)
+            return true;
+
+        worker->metrics.countError();
+        if (error == ENETDOWN || error == ENOBUFS || error == ENOMEM)
         {
-            std::cerr << "Error allocating memory for buffer" << std::endl;
-            exit(EXIT_FAILURE);
+            std::this_thread::sleep_for(std::chrono::milliseconds(POLL_TIMEOUT));
+            return true;
         }
+        std::cerr << "Error reading the socket: " << std::strerror(error) << std::endl;
+        return false;
+    }
+
+    // Largest frame the bound interface can deliver, every buffer of the recvmmsg pool gets this size
+    size_t frameBufferSize()
+    {
+        char name[IF_NAMESIZE];
+        if (interfaceIndex == 0 || !if_indextoname(interfaceIndex, name))
+            return BUFFSIZE;
+
+        struct ifreq request;
+        std::memset(&request, 0, sizeof(request));
+        std::memcpy(request.ifr_name, name, IF_NAMESIZE);
+        if (ioctl(sock, SIOCGIFMTU, &request) < 0)
+            return BUFFSIZE;
+        size_t size = request.ifr_mtu + ETH_HLEN + 4 * DISSECT_MAX_VLANS;
+        return size < BUFFSIZE ? size : BUFFSIZE;
+    }
 
-        struct sockaddr saddr;
-        socklen_t saddr_size = sizeof(saddr);
+    /*
+    Asks for kernel timestamps on fd, for recvmsg() through SO_TIMESTAMPING and for the ring
+    through PACKET_TIMESTAMP, and for PACKET_AUXDATA so recvmsg() also reports the wire length.
+    */
+    void configureControl(int fd)
+    {
+        int aux = 1;
+        if (setsockopt(fd, SOL_PACKET, PACKET_AUXDATA, &aux, sizeof(aux)) < 0)
+            std::cerr << "Error enabling packet auxiliary data" << std::endl;
+
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        if (timestampMode == TimestampMode::Hardware)
+            flags |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+        if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+            std::cerr << "Error enabling kernel timestamps" << std::endl;
+
+        int ringFlags = timestampMode == TimestampMode::Hardware ? SOF_TIMESTAMPING_RAW_HARDWARE : 0;
+        setsockopt(fd, SOL_PACKET, PACKET_TIMESTAMP, &ringFlags, sizeof(ringFlags));
+    }
 
-        int data_size = recvfrom(sock, buf, BUFFSIZE, 0, &saddr, &saddr_size);
-        if (data_size < 0)
+    // Turns on receive timestamping in the NIC of the bound interface, returns false if the driver refuses
+    bool enableHardwareTimestamps()
+    {
+        char name[IF_NAMESIZE];
+        if (interfaceIndex == 0 || !if_indextoname(interfaceIndex, name))
+            return false;
+
+        struct hwtstamp_config config;
+        std::memset(&config, 0, sizeof(config));
+        config.tx_type = HWTSTAMP_TX_OFF;
+        config.rx_filter = HWTSTAMP_FILTER_ALL;
+        struct ifreq request;
+        std::memset(&request, 0, sizeof(request));
+        std::memcpy(request.ifr_name, name, IF_NAMESIZE);
+        request.ifr_data = (char *)&config;
+        return ioctl(sock, SIOCSHWTSTAMP, &request) == 0;
+    }
+
+    // Adds or drops promiscuous memberships on the main socket, they end with the capture
+    void updatePromiscuous(bool enable)
+    {
+        int option = enable ? PACKET_ADD_MEMBERSHIP : PACKET_DROP_MEMBERSHIP;
+        std::vector<int> indexes;
+        if (!enable)
+            indexes.swap(promiscuousInterfaces);
+        else if (interfaceIndex != 0)
+            indexes.push_back(interfaceIndex);
+        else
         {
-            std::cerr << "Error reading the socket, are you running as sudo?" << std::endl;
-            free(buf); // Free allocated memory before exit
-            exit(EXIT_FAILURE);
+            // Not bound, every interface that can see foreign traffic
+            std::vector<CaptureInterface> interfaces = listInterfaces();
+            for (size_t i = 0; i < interfaces.size(); i++)
+                if (interfaces[i].up && !interfaces[i].loopback)
+                    indexes.push_back(interfaces[i].index);
         }
 
-        return std::make_pair(data_size, buf);
+        for (size_t i = 0; i < indexes.size(); i++)
+        {
+            struct packet_mreq request;
+            std::memset(&request, 0, sizeof(request));
+            request.mr_ifindex = indexes[i];
+            request.mr_type = PACKET_MR_PROMISC;
+            if (setsockopt(sock, SOL_PACKET, option, &request, sizeof(request)) < 0)
+                std::cerr << "Error changing promiscuous mode" << std::endl;
+            else if (enable)
+                promiscuousInterfaces.push_back(indexes[i]);
+        }
     }
 
-    void captureThreadFunc(std::vector<std::pair<int, unsigned char *>> &packetBuffer)
+    /*
+    Runs a capture worker: every batch source reads is dissected, named, reassembled, counted in the
+    timeline, cut to the snaplen and copied into the worker queue, which is published once per batch.
+    The chain is a Pipeline, so each backend gets it inlined around its own source.
+    */
+    template <typename Source>
+    void runWorker(CaptureWorker *worker, const Source &source)
     {
+        WorkerMetrics &metrics = worker->metrics;
+        auto pipeline = makePipeline(source, DissectStage(), ApplicationStage(names), ReassemblyStage(reassembler),
+                                     TimelineStage(timeline, worker->lane), SnaplenStage(0),
+                                     QueueSink(worker->queue), MetricsStage(metrics));
         while (captureActive)
         {
-            packetBuffer.push_back(readSocket());
+            SnaplenStage &cut = pipeline.template stage<4>();
+            cut.snaplen = snaplen.load(std::memory_order_relaxed);
+            cut.headersOnly = headersOnly.load(std::memory_order_relaxed);
+            int ret = pipeline.getSource().read([&pipeline, &metrics](Packet *packets, size_t count)
+                                                {
+                                                    bool timed = metrics.sampleBatch((unsigned int)count);
+                                                    unsigned long long start = timed ? statsClock() : 0;
+                                                    pipeline.process(packets, count);
+                                                    if (timed)
+                                                        metrics.processing.record((statsClock() - start) / count);
+                                                });
+            if (ret < 0 && !recoverReadError(worker, errno))
+                break;
+        }
+    }
+
+    // One recvfrom() per packet, published one at a time since there is no batch to wait for
+    void captureThreadFunc(CaptureWorker *worker)
+    {
+        runWorker(worker, RecvFromSource(worker->sock, worker->recvBuffer, POLL_TIMEOUT));
+    }
+
+    // recvmmsg() into the worker's buffers, which are reused once the batch was copied into the queue
+    void batchThreadFunc(CaptureWorker *worker)
+    {
+        runWorker(worker, RecvMmsgSource(worker->sock, worker->batch, POLL_TIMEOUT));
+    }
+
+    // Frames are copied straight from the ring mapping into the queue before the block is released
+    void ringThreadFunc(CaptureWorker *worker)
+    {
+        runWorker(worker, RingSource(worker->ring, POLL_TIMEOUT));
+    }
+
+    // PACKET_STATISTICS resets the kernel counters on every read, so they are accumulated here
+    static void updateStats(int fd, CaptureStats &stats)
+    {
+        struct tpacket_stats_v3 st;
+        std::memset(&st, 0, sizeof(st));
+        socklen_t len = sizeof(st);
+        if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0)
+            return;
+
+        stats.packets += st.tp_packets;
+        stats.drops += st.tp_drops;
+        if (len >= sizeof(st))
+            stats.freezes += st.tp_freeze_q_cnt;
+    }
+
+    // Opens the fanout sockets, every one joins the same group before any packet is read
+    bool createFanoutWorkers(unsigned int count, FanoutMode mode)
+    {
+        static std::atomic<unsigned int> nextGroup(0);
+        unsigned int group = (FANOUT_GROUP_BASE + getpid() + nextGroup++) & 0xffff;
+        int option = (int)(group | ((unsigned int)mode << 16));
+        unsigned int cpus = std::thread::hardware_concurrency();
+
+        for (unsigned int i = 0; i < count; i++)
+        {
+            int fd = createSocket();
+            if (fd < 0)
+            {
+                std::cerr << "Error creating fanout socket" << std::endl;
+                return false;
+            }
+
+            workers.push_back(std::unique_ptr<CaptureWorker>(new CaptureWorker(fd, true, cpus ? (int)(i % cpus) : -1)));
+            if (!attachFilter(fd, filterProgram) || !bindSocket(fd))
+                return false;
+            configureControl(fd);
+            if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &option, sizeof(option)) < 0)
+            {
+                std::cerr << "Error joining fanout group" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Program for expression that also cuts packets, stays empty when neither is asked for so no program runs per packet
+    static bool compileFilter(const std::string &expression, unsigned int length, bool headers,
+                              std::vector<struct sock_filter> &program, std::string &error)
+    {
+        FilterExpr parsed;
+        FilterParser parser;
+        if (!parser.parse(expression, parsed, error))
+            return false;
+
+        program.clear();
+        if (parsed.empty() && length == 0 && !headers)
+            return true;
+        BpfCompiler compiler;
+        return compiler.compile(parsed, program, error, length ? length : BPF_SNAPLEN, headers);
+    }
+
+    void reattachFilter()
+    {
+        if (!captureActive)
+            return;
+        for (size_t i = 0; i < workers.size(); i++)
+            attachFilter(workers[i]->sock, filterProgram);
+    }
+
+    // Attaches the program to the socket, an empty program removes any filter
+    static bool attachFilter(int fd, const std::vector<struct sock_filter> &program)
+    {
+        if (program.empty())
+        {
+            int unused = 0;
+            setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, &unused, sizeof(unused)); // Fails harmlessly when nothing is attached
+            return true;
+        }
+
+        struct sock_fprog fprog;
+        fprog.len = (unsigned short)program.size();
+        fprog.filter = const_cast<struct sock_filter *>(program.data());
+        if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
+        {
+            std::cerr << "Error attaching the capture filter" << std::endl;
+            return false;
         }
+        return true;
+    }
+
+    /*
+    The main socket exists for the whole lifetime of the sniffer but is only read while
+    capturing, a filter rejecting everything keeps the kernel from cloning every packet
+    into it in the meantime. Packets queued before the filter was attached are discarded.
+    */
+    void parkSocket()
+    {
+        std::vector<struct sock_filter> dropAll(1);
+        dropAll[0].code = BPF_RET | BPF_K;
+        dropAll[0].jt = dropAll[0].jf = 0;
+        dropAll[0].k = 0;
+        attachFilter(sock, dropAll);
+
+        while (recv(sock, recvBuffer.data(), BUFFSIZE, MSG_DONTWAIT) >= 0)
+            ;
+    }
+
+    static void pinThread(std::thread &thread, int cpu)
+    {
+        if (cpu < 0)
+            return;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
     }
 
 public:
-    PacketSniffer() : sock(createSocket()), captureActive(false) {}
+    PacketSniffer()
+        : sock(createSocket()), captureActive(false), backend(CaptureBackend::RecvFrom), recvBuffer(BUFFSIZE),
+          snaplen(0), headersOnly(false), interfaceIndex(0), promiscuous(false), timestampMode(TimestampMode::Software),
+          reassembler(NULL), timeline(NULL), names(NULL), deliverySampleCountdown(STATS_SAMPLE_INTERVAL)
+    {
+        configureControl(sock);
+        parkSocket();
+    }
 
     ~PacketSniffer()
     {
         stopCapture();
+        workers.clear();
         closeSocket();
     }
 
-    void startCapture(std::vector<std::pair<int, unsigned char *>> &packetBuffer)
+    /*
+    Starts capturing with workerCount threads. With a single worker the main socket is used,
+    with more each worker opens its own socket and the kernel spreads packets over them
+    through a PACKET_FANOUT group. Returns false if the sockets or backend could not be set up.
+    */
+    bool startCapture(CaptureBackend captureBackend = CaptureBackend::RecvFrom,
+                      unsigned int workerCount = 1, FanoutMode fanoutMode = FanoutMode::Hash)
     {
-        if (!captureActive)
+        if (captureActive)
+            return true;
+
+        workers.clear();
+        deliveryLatency.reset();
+
+        if (workerCount <= 1)
         {
-            captureActive = true;
-            std::thread captureThread(&PacketSniffer::captureThreadFunc, this, std::ref(packetBuffer));
-            captureThread.detach();
+            workers.push_back(std::unique_ptr<CaptureWorker>(new CaptureWorker(sock, false, -1)));
+            updateStats(sock, workers[0]->stats); // Discard whatever the kernel counted while nobody was capturing
+            std::memset(&workers[0]->stats, 0, sizeof(CaptureStats));
+            if (!attachFilter(sock, filterProgram))
+            {
+                workers.clear();
+                return false;
+            }
+        }
+        else if (!createFanoutWorkers(workerCount, fanoutMode))
+        {
+            workers.clear();
+            return false;
         }
+
+        if (captureBackend == CaptureBackend::Ring)
+        {
+            for (size_t i = 0; i < workers.size(); i++)
+            {
+                if (!workers[i]->ring.setup(workers[i]->sock))
+                {
+                    workers.clear();
+                    parkSocket();
+                    return false;
+                }
+            }
+        }
+        else if (captureBackend == CaptureBackend::RecvMmsg)
+        {
+            // The filter already cuts frames to the snaplen, larger buffers would only waste memory
+            size_t frameSize = frameBufferSize();
+            size_t cut = snaplen;
+            if (headersOnly && (cut == 0 || cut > BPF_HEADERS_SNAPLEN))
+                cut = BPF_HEADERS_SNAPLEN;
+            if (cut && cut < frameSize)
+                frameSize = cut;
+            for (size_t i = 0; i < workers.size(); i++)
+                workers[i]->batch.setup(RECV_BATCH_FRAMES, frameSize);
+        }
+
+        backend = captureBackend;
+        if (promiscuous)
+            updatePromiscuous(true);
+        if (timestampMode == TimestampMode::Hardware && !enableHardwareTimestamps())
+            std::cerr << "Hardware timestamps are not supported here, using software timestamps" << std::endl;
+        // Lane 0 stays with the thread that started the capture
+        if (timeline)
+            timeline->setLanes(workers.size() + 1);
+        captureActive = true;
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            CaptureWorker *worker = workers[i].get();
+            worker->lane = i + 1;
+            if (backend == CaptureBackend::Ring)
+                worker->thread = std::thread(&PacketSniffer::ringThreadFunc, this, worker);
+            else if (backend == CaptureBackend::RecvMmsg)
+                worker->thread = std::thread(&PacketSniffer::batchThreadFunc, this, worker);
+            else
+                worker->thread = std::thread(&PacketSniffer::captureThreadFunc, this, worker);
+            pinThread(worker->thread, worker->cpu);
+        }
+        return true;
     }
 
+    // Stops the workers, packets still queued can be drained until the next startCapture()
     void stopCapture()
     {
         captureActive = false;
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            CaptureWorker &worker = *workers[i];
+            if (!worker.thread.joinable())
+                continue;
+
+            worker.thread.join();
+            updateStats(worker.sock, worker.stats); // Read the counters before the ring is torn down
+            worker.ring.teardown();
+            worker.batch.teardown();
+            if (!worker.ownsSocket)
+                parkSocket();
+        }
+        updatePromiscuous(false);
     }
 
-    std::vector<std::pair<int, unsigned char *>> capturePackets()
+    /*
+    Compiles a filter expression (see filter_expr.h) to classic BPF and attaches it to the
+    capture sockets, so rejected packets never reach user space. Applies immediately to a
+    running capture, an empty expression captures everything. Returns false and fills error
+    if the expression is invalid, the previous filter then stays in place.
+    */
+    bool setFilter(const std::string &expression, std::string &error)
     {
-        std::vector<std::pair<int, unsigned char *>> vec;
+        std::vector<struct sock_filter> program;
+        if (!compileFilter(expression, snaplen, headersOnly, program, error))
+            return false;
+
+        filterProgram = program;
+        filterText = expression;
+        reattachFilter();
+        return true;
+    }
 
-        vec.push_back(readSocket());
+    /*
+    Keeps at most length bytes of every packet, 0 keeps whole packets. With headers set only
+    the link, network and transport headers are kept. The cut is made by the socket filter so
+    the rest of the packet is never copied to user space, while each packet keeps its wire
+    length. Applies immediately to a running capture.
+    */
+    bool setSnaplen(unsigned int length, bool headers = false)
+    {
+        std::vector<struct sock_filter> program;
+        std::string error;
+        if (!compileFilter(filterText, length, headers, program, error))
+        {
+            std::cerr << "Error compiling the filter: " << error << std::endl;
+            return false;
+        }
+
+        filterProgram = program;
+        snaplen = length;
+        headersOnly = headers;
+        reattachFilter();
+        return true;
+    }
+
+    /*
+    Has the capture workers feed every TCP packet to reassembler as it arrives, NULL stops it.
+    Takes effect from the next capture, the reassembler must outlive it.
+    */
+    void setReassembler(TcpReassembler *tcp)
+    {
+        if (!captureActive)
+            reassembler = tcp;
+    }
+
+    /*
+    Has the capture workers count every packet in timeline, NULL stops it. Takes effect from the
+    next capture, which gives each worker its own lane, the timeline must outlive it.
+    */
+    void setTimeline(Timeline *histogram)
+    {
+        if (!captureActive)
+            timeline = histogram;
+    }
 
-        return vec;
+    /*
+    Has the capture workers look for DNS, HTTP and TLS names in every packet and intern them in
+    pool, see dissectApplication(). NULL stops it. Takes effect from the next capture, the pool
+    must outlive it.
+    */
+    void setNamePool(StringPool *pool)
+    {
+        if (!captureActive)
+            names = pool;
     }
 
-    std::string printData(const std::pair<int, unsigned char *> &packet)
+    unsigned int getSnaplen() const { return snaplen; }
+    bool isHeadersOnly() const { return headersOnly; }
+
+    const std::string &getFilter() const { return filterText; }
+
+    /*
+    Captures only on the named interface from the next startCapture() on, an empty name
+    captures on every interface. Returns false if the interface does not exist or a
+    capture is running.
+    */
+    bool setInterface(const std::string &name)
     {
-        int data_size = packet.first;
-        unsigned char *data = packet.second;
+        if (captureActive)
+            return false;
 
-        std::ostringstream output;
-        output << "Packet size: " << data_size << std::endl
-               << "Packet content:" << std::endl;
-        int i, j;
-        for (i = 0; i < data_size; i++)
+        int index = 0;
+        if (!name.empty())
         {
-            if (i != 0 && i % 16 == 0)
+            index = (int)if_nametoindex(name.c_str());
+            if (index == 0)
             {
-                output << "         ";
-                for (j = i - 16; j < i; j++)
-                {
-                    if (data[j] >= 32 && data[j] <= 128)
-                        output << (char)data[j];
-                    else
-                        output << ".";
-                }
-                output << std::endl;
+                std::cerr << "Unknown interface " << name << std::endl;
+                return false;
             }
+        }
 
-            if (i % 16 == 0)
-                output << "   ";
-            output << " " << std::hex << std::setw(2) << std::setfill('0') << (int)data[i];
+        int previous = interfaceIndex;
+        interfaceIndex = index;
+        if (!bindSocket(sock))
+        {
+            interfaceIndex = previous;
+            return false;
+        }
+        parkSocket(); // Drop what was queued from other interfaces
+        return true;
+    }
+
+    // Index of the capture interface, 0 when capturing on every interface
+    int getInterfaceIndex() const { return interfaceIndex; }
 
-            if (i == data_size - 1)
+    // Lists the network interfaces that can be passed to setInterface()
+    static std::vector<CaptureInterface> listInterfaces()
+    {
+        std::vector<CaptureInterface> interfaces;
+        struct if_nameindex *names = if_nameindex();
+        if (names == NULL)
+            return interfaces;
+
+        int fd = socket(AF_INET, SOCK_DGRAM, 0); // Any socket can query interface flags
+        for (struct if_nameindex *name = names; name->if_index != 0; name++)
+        {
+            CaptureInterface interface;
+            interface.name = name->if_name;
+            interface.index = (int)name->if_index;
+            interface.up = false;
+            interface.loopback = false;
+
+            struct ifreq request;
+            std::memset(&request, 0, sizeof(request));
+            strncpy(request.ifr_name, name->if_name, IF_NAMESIZE - 1);
+            if (fd >= 0 && ioctl(fd, SIOCGIFFLAGS, &request) == 0)
             {
-                for (j = 0; j < 15 - i % 16; j++)
-                {
-                    output << "   ";
-                }
+                interface.up = (request.ifr_flags & IFF_UP) != 0;
+                interface.loopback = (request.ifr_flags & IFF_LOOPBACK) != 0;
+            }
+            interfaces.push_back(interface);
+        }
+        if (fd >= 0)
+            ::close(fd);
+        if_freenameindex(names);
+        return interfaces;
+    }
+
+    /*
+    Puts the capture interface, or every non loopback interface that is up when none was
+    chosen, in promiscuous mode for the next captures. The kernel counts the request per
+    socket, so the interface goes back to normal when the capture stops or the process exits.
+    */
+    void setPromiscuous(bool enable) { promiscuous = enable; }
+
+    bool isPromiscuous() const { return promiscuous; }
+
+    /*
+    Chooses the clock of the packet timestamps from the next startCapture() on. Hardware
+    timestamps need a bound interface whose driver supports them, packets fall back to
+    software timestamps otherwise and report which one they carry in timestampSource.
+    */
+    void setTimestampMode(TimestampMode mode)
+    {
+        timestampMode = mode;
+        configureControl(sock);
+    }
+
+    TimestampMode getTimestampMode() const { return timestampMode; }
+
+    bool isCapturing() const { return captureActive; }
 
-                output << "         ";
+    size_t workerCount() const { return workers.size(); }
 
-                for (j = i - i % 16; j <= i; j++)
+    // Kernel packet and drop counters summed over the workers of the current or last capture
+    CaptureStats getKernelStats()
+    {
+        CaptureStats total;
+        std::memset(&total, 0, sizeof(total));
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            CaptureWorker &worker = *workers[i];
+            if (captureActive)
+                updateStats(worker.sock, worker.stats);
+            total.packets += worker.stats.packets;
+            total.drops += worker.stats.drops;
+            total.freezes += worker.stats.freezes;
+        }
+        return total;
+    }
+
+    /*
+    Hands up to maxPackets queued packets to handler(Packet *packets, size_t count) in batches of
+    up to CONSUME_BATCH, in timestamp order. With several workers their queues are merged, a packet
+    is only handed over once every worker has a later one queued or it is older than MERGE_DELAY,
+    so a briefly idle worker cannot reorder the view. The queues keep the bytes of a batch until
+    the handler returns, which may change the packets but must not keep their data. Must always
+    be called from the same thread.
+    */
+    template <typename BatchHandler>
+    size_t consumeBatches(BatchHandler handler, size_t maxPackets = DRAIN_BATCH)
+    {
+        Packet batch[CONSUME_BATCH];
+        size_t batched = 0;
+        size_t count = 0;
+        bool flush = !captureActive;
+        unsigned long long horizon = now() - MERGE_DELAY;
+        while (count < maxPackets)
+        {
+            FrameQueue *oldest = NULL;
+            unsigned long long oldestTime = 0;
+            bool complete = true; // Every worker has at least one packet queued
+            for (size_t i = 0; i < workers.size(); i++)
+            {
+                if (!workers[i]->queue.front(batch[batched]))
+                {
+                    complete = false;
+                    continue;
+                }
+                if (!oldest || batch[batched].timestamp < oldestTime)
                 {
-                    if (data[j] >= 32 && data[j] <= 128)
-                    {
-                        output << (char)data[j];
-                    }
-                    else
-                    {
-                        output << ".";
-                    }
+                    oldest = &workers[i]->queue;
+                    oldestTime = batch[batched].timestamp;
                 }
+            }
 
-                output << std::endl;
+            if (!oldest || (!complete && !flush && oldestTime > horizon))
+                break;
+
+            // Samples how long packets waited since the kernel stamped them, hardware clocks are not comparable
+            Packet &packet = batch[batched++];
+            oldest->front(packet);
+            oldest->take();
+            count++;
+            if (--deliverySampleCountdown == 0)
+            {
+                deliverySampleCountdown = STATS_SAMPLE_INTERVAL;
+                unsigned long long arrival = now();
+                if (packet.timestampSource == TimestampSource::Software && arrival > packet.timestamp)
+                    deliveryLatency.record(arrival - packet.timestamp);
             }
+            if (batched == CONSUME_BATCH)
+            {
+                handler(batch, batched);
+                releaseQueues();
+                batched = 0;
+            }
+        }
+        if (batched)
+        {
+            handler(batch, batched);
+            releaseQueues();
         }
-        return output.str();
+        return count;
+    }
+
+    /*
+    Hands up to maxPackets queued packets to handler(const Packet &packet) in timestamp order,
+    merged like consumeBatches(). Must always be called from the same thread, the packet data is
+    only valid until the handler returns.
+    */
+    template <typename Handler>
+    size_t consume(Handler handler, size_t maxPackets = DRAIN_BATCH)
+    {
+        return consumeBatches([&handler](Packet *packets, size_t count)
+                              {
+                                  for (size_t i = 0; i < count; i++)
+                                      handler(packets[i]);
+                              },
+                              maxPackets);
+    }
+
+    // Moves up to maxPackets queued packets into the store, returns how many were moved
+    size_t drain(PacketStore &store, size_t maxPackets = DRAIN_BATCH)
+    {
+        return consume([&store](const Packet &packet)
+                       { store.add(packet); },
+                       maxPackets);
+    }
+
+    // Packets waiting in the queues
+    size_t queueDepth() const
+    {
+        size_t depth = 0;
+        for (size_t i = 0; i < workers.size(); i++)
+            depth += workers[i]->queue.depth();
+        return depth;
+    }
+
+    // Packets dropped because the consumer did not drain the queues fast enough
+    unsigned long long queueOverflows() const
+    {
+        unsigned long long overflows = 0;
+        for (size_t i = 0; i < workers.size(); i++)
+            overflows += workers[i]->queue.overflowCount();
+        return overflows;
+    }
+
+    /*
+    Fills snapshot with the worker counters and latency histograms of the current or last
+    capture, the kernel counters and the queue state. The store fields are left to the
+    caller. Reading never stops the workers, counters of a running capture may be a few
+    packets apart from each other.
+    */
+    void getMetrics(MetricsSnapshot &snapshot)
+    {
+        snapshot.timestamp = statsClock();
+        snapshot.packets = 0;
+        snapshot.bytes = 0;
+        snapshot.readErrors = 0;
+        snapshot.truncatedFrames = 0;
+        snapshot.workerPackets.clear();
+        snapshot.processing.clear();
+        snapshot.delivery.clear();
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            const WorkerMetrics &metrics = workers[i]->metrics;
+            unsigned long long packets = metrics.packets.load(std::memory_order_relaxed);
+            snapshot.workerPackets.push_back(packets);
+            snapshot.packets += packets;
+            snapshot.bytes += metrics.bytes.load(std::memory_order_relaxed);
+            snapshot.readErrors += metrics.errors.load(std::memory_order_relaxed);
+            snapshot.truncatedFrames += workers[i]->batch.truncatedFrames();
+            metrics.processing.mergeInto(snapshot.processing);
+        }
+        deliveryLatency.mergeInto(snapshot.delivery);
+
+        CaptureStats kernel = getKernelStats();
+        snapshot.kernelPackets = kernel.packets;
+        snapshot.kernelDrops = kernel.drops;
+        snapshot.kernelFreezes = kernel.freezes;
+        snapshot.queueDepth = queueDepth();
+        snapshot.queueOverflows = queueOverflows();
+    }
+
+    /*
+    Synchronously captures a single packet into the store, only valid while no capture is running.
+    Returns false if reading failed or the store refused the packet.
+    */
+    bool capturePackets(PacketStore &store)
+    {
+        attachFilter(sock, filterProgram);
+        Packet packet;
+        int size;
+        do
+        {
+            pipelineWait(sock, -1);
+            size = readSocket(sock, recvBuffer, packet);
+        } while (size < 0 && (errno == EINTR || errno == EAGAIN));
+        bool added = false;
+        if (size >= 0)
+        {
+            dissect(packet.data, packet.size, packet.info);
+            if (names)
+                dissectApplication(packet, *names);
+            packet.size = truncatedLength(packet, snaplen, headersOnly);
+            added = store.add(packet);
+        }
+        else
+            std::cerr << "Error reading the socket: " << std::strerror(errno) << std::endl;
+        parkSocket();
+        return added;
+    }
+
+    // Packet size, the name found by dissectApplication() if any, then a hex and ASCII dump of its content
+    std::string printData(const Packet &packet)
+    {
+        size_t size = packet.size > 0 ? packet.size : 0;
+        const char *application = applicationName(packet.info.application);
+        const char *name = names ? names->lookup(packet.info.name) : NULL;
+        char header[64 + APP_NAME_SIZE];
+        int length = snprintf(header, sizeof(header), "Packet size: %zu\n", size);
+        if (application)
+            length += snprintf(header + length, sizeof(header) - length, "%s: %s\n", application, name ? name : "");
+        length += snprintf(header + length, sizeof(header) - length, "Packet content:\n");
+
+        std::string output(length + HEXDUMP_SIZE(size), '\0');
+        std::memcpy(&output[0], header, length);
+        output.resize(length + hexdump(packet.data, size, &output[length], output.size() - length));
+        return output;
+    }
+};
+
+// Packets the capture workers queued, merged in timestamp order, see PacketSniffer::consumeBatches()
+class SnifferSource
+{
+private:
+    PacketSniffer *sniffer;
+    size_t maxPackets;
+
+public:
+    explicit SnifferSource(PacketSniffer &from, size_t limit = DRAIN_BATCH) : sniffer(&from), maxPackets(limit) {}
+
+    template <typename BatchHandler>
+    int read(BatchHandler handler)
+    {
+        return (int)sniffer->consumeBatches(handler, maxPackets);
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "lz_codec.h"
+#include "packet.h"
+
+#define SPILL_CACHE_BLOCKS 8 // Decompressed segments kept for reads
+
+// Sparse index entry of one spilled chunk
+struct SpillSegment
+{
+    PacketHandle first; // Handle of its first packet
+    size_t count;
+    unsigned long long firstTime; // Oldest and newest timestamp of its packets
+    unsigned long long lastTime;
+    unsigned long long offset; // Position in the segment file
+    size_t storedSize;         // Bytes in the file, equal to rawSize when compression did not help
+    size_t rawSize;            // Packet records followed by the chunk bytes
+};
+
+// Decompressed segment, readers keep it alive while they use it even after it left the cache
+struct SpillBlock
+{
+    std::vector<Packet> packets;      // data points into bytes
+    std::vector<unsigned char> bytes; // The segment as written, records then chunk bytes
+};
+
+/*
+Segment file for the packets a PacketStore moves out of memory.
+
+Each segment is one store chunk: the Packet records of its packets with
+their data pointers turned into offsets, followed by the chunk bytes, the
+whole compressed with the built-in LZ codec. Only a small index entry per
+segment stays in memory, with the handle and time range it covers and where
+it lives in the file. The file is unlinked as soon as it is created, so it
+disappears with the process.
+
+Reads go through a cache of the SPILL_CACHE_BLOCKS most recently used
+decompressed segments, shared with the readers still holding them, and may
+come from several threads. Appending must not run concurrently with reads.
+*/
+class SpillFile
+{
+private:
+    int fd;
+    unsigned long long fileSize;
+    std::vector<SpillSegment> segments;
+    std::vector<unsigned char> raw; // Write buffers, reused for every segment
+    std::vector<unsigned char> compressed;
+
+    mutable std::mutex lock; // Guards the cache and the counters below
+    mutable std::list<std::pair<size_t, std::shared_ptr<const SpillBlock>>> cache; // Most recently used first
+    mutable unsigned long long hits;
+    mutable unsigned long long misses;
+
+    static bool readAll(int file, unsigned char *data, size_t size, unsigned long long offset)
+    {
+        while (size > 0)
+        {
+            ssize_t done = pread(file, data, size, offset);
+            if (done < 0 && errno == EINTR)
+                continue;
+            if (done <= 0)
+                return false;
+            data += done;
+            size -= done;
+            offset += done;
+        }
+        return true;
+    }
+
+    static bool writeAll(int file, const unsigned char *data, size_t size, unsigned long long offset)
+    {
+        while (size > 0)
+        {
+            ssize_t done = pwrite(file, data, size, offset);
+            if (done < 0 && errno == EINTR)
+                continue;
+            if (done <= 0)
+                return false;
+            data += done;
+            size -= done;
+            offset += done;
+        }
+        return true;
+    }
+
+    std::shared_ptr<const SpillBlock> decode(const SpillSegment &segment) const
+    {
+        std::shared_ptr<SpillBlock> block(new SpillBlock());
+        std::vector<unsigned char> stored;
+        bool packed = segment.storedSize != segment.rawSize;
+        std::vector<unsigned char> &target = packed ? stored : block->bytes;
+        target.resize(segment.storedSize);
+        if (!readAll(fd, target.data(), target.size(), segment.offset))
+        {
+            std::cerr << "Error reading spilled packets: " << strerror(errno) << std::endl;
+            return std::shared_ptr<const SpillBlock>();
+        }
+        if (packed)
+        {
+            block->bytes.resize(segment.rawSize);
+            if (!lzDecompress(stored.data(), stored.size(), block->bytes.data(), block->bytes.size()))
+            {
+                std::cerr << "Spilled packets are corrupt" << std::endl;
+                return std::shared_ptr<const SpillBlock>();
+            }
+        }
+
+        size_t records = segment.count * sizeof(Packet);
+        const unsigned char *chunk = block->bytes.data() + records;
+        block->packets.resize(segment.count);
+        memcpy(block->packets.data(), block->bytes.data(), records);
+        for (size_t i = 0; i < block->packets.size(); i++)
+            block->packets[i].data = chunk + (size_t)block->packets[i].data;
+        return block;
+    }
+
+public:
+    SpillFile() : fd(-1), fileSize(0), hits(0), misses(0) {}
+
+    ~SpillFile() { close(); }
+
+    SpillFile(const SpillFile &) = delete;
+    SpillFile &operator=(const SpillFile &) = delete;
+
+    // Creates the segment file in directory, returns false if it cannot be created
+    bool open(const std::string &directory)
+    {
+        close();
+        std::string path = (directory.empty() ? std::string(".") : directory) + "/csniff-spill-XXXXXX";
+        std::vector<char> name(path.begin(), path.end());
+        name.push_back('\0');
+        fd = mkstemp(name.data());
+        if (fd < 0)
+        {
+            std::cerr << "Unable to create a spill file in " << directory << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        unlink(name.data());
+        return true;
+    }
+
+    void close()
+    {
+        clear();
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+    /*
+    Appends count packets from the front of packets, whose data lies in the used bytes of
+    chunk, as one compressed segment starting at handle first. Returns false if the file
+    cannot be written, nothing is added to the index then.
+    */
+    bool append(const std::deque<Packet> &packets, size_t count, PacketHandle first, const unsigned char *chunk,
+                size_t used)
+    {
+        if (fd < 0 || count == 0)
+            return false;
+
+        size_t records = count * sizeof(Packet);
+        raw.resize(records + used);
+        SpillSegment segment;
+        segment.first = first;
+        segment.count = count;
+        segment.firstTime = ~0ULL;
+        segment.lastTime = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            Packet record = packets[i];
+            record.data = (const unsigned char *)(size_t)(record.data - chunk);
+            memcpy(raw.data() + i * sizeof(Packet), &record, sizeof(Packet));
+            segment.firstTime = std::min(segment.firstTime, record.timestamp);
+            segment.lastTime = std::max(segment.lastTime, record.timestamp);
+        }
+        memcpy(raw.data() + records, chunk, used);
+
+        compressed.resize(lzCompressBound(raw.size()));
+        size_t packed = lzCompress(raw.data(), raw.size(), compressed.data(), compressed.size());
+        bool shrunk = packed && packed < raw.size();
+        const std::vector<unsigned char> &stored = shrunk ? compressed : raw;
+        segment.rawSize = raw.size();
+        segment.storedSize = shrunk ? packed : raw.size();
+        segment.offset = fileSize;
+        if (!writeAll(fd, stored.data(), segment.storedSize, fileSize))
+        {
+            std::cerr << "Error writing spilled packets: " << strerror(errno) << std::endl;
+            return false;
+        }
+        fileSize += segment.storedSize;
+        segments.push_back(segment);
+        return true;
+    }
+
+    // Index of the segment holding handle, which must have been spilled
+    size_t find(PacketHandle handle) const
+    {
+        size_t low = 0;
+        size_t high = segments.size();
+        while (high - low > 1)
+        {
+            size_t middle = (low + high) / 2;
+            if (segments[middle].first <= handle)
+                low = middle;
+            else
+                high = middle;
+        }
+        return low;
+    }
+
+    // Decompressed segment i, from the cache when it was read recently. Empty after a read error
+    std::shared_ptr<const SpillBlock> load(size_t i) const
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto it = cache.begin(); it != cache.end(); ++it)
+            {
+                if (it->first == i)
+                {
+                    cache.splice(cache.begin(), cache, it);
+                    hits++;
+                    return it->second;
+                }
+            }
+            misses++;
+        }
+
+        // Read and decompressed without the lock, so threads reading other segments proceed
+        std::shared_ptr<const SpillBlock> block = decode(segments[i]);
+        if (!block)
+            return block;
+        std::lock_guard<std::mutex> guard(lock);
+        cache.push_front(std::make_pair(i, block));
+        if (cache.size() > SPILL_CACHE_BLOCKS)
+            cache.pop_back();
+        return block;
+    }
+
+    const SpillSegment &segment(size_t i) const { return segments[i]; }
+
+    size_t segmentCount() const { return segments.size(); }
+
+    // Handles below this one were spilled
+    PacketHandle end() const { return segments.empty() ? 0 : segments.back().first + segments.back().count; }
+
+    // Forgets every segment and truncates the file, which stays open
+    void clear()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        segments.clear();
+        cache.clear();
+        hits = misses = 0;
+        if (fd >= 0 && fileSize && ftruncate(fd, 0) < 0)
+            std::cerr << "Error truncating the spill file: " << strerror(errno) << std::endl;
+        fileSize = 0;
+    }
+
+    // Bytes of the segments in the file and before compression
+    unsigned long long storedBytes() const { return fileSize; }
+
+    unsigned long long rawBytes() const
+    {
+        unsigned long long total = 0;
+        for (size_t i = 0; i < segments.size(); i++)
+            total += segments[i].rawSize;
+        return total;
+    }
+
+    // Memory held by the index and the cached segments
+    size_t memoryUsage() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t total = segments.capacity() * sizeof(SpillSegment) + raw.capacity() + compressed.capacity();
+        for (auto it = cache.begin(); it != cache.end(); ++it)
+            total += it->second->bytes.capacity() + it->second->packets.capacity() * sizeof(Packet);
+        return total;
+    }
+
+    void getCacheStats(unsigned long long &cacheHits, unsigned long long &cacheMisses) const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        cacheHits = hits;
+        cacheMisses = misses;
+    }
+};
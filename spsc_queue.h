@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+#define CACHE_LINE_SIZE 64
+
+/*
+Bounded single-producer/single-consumer lock-free queue.
+
+The producer writes any number of items with write() and makes them visible
+to the consumer at once with publish(), so a whole batch costs one release
+store. Head and tail are kept on separate cache lines by padding rather than
+alignas, heap objects are not over-aligned before C++17. Each side keeps a
+cached copy of the other side's index to avoid touching the shared line on
+every item.
+*/
+template <typename T>
+class SpscQueue
+{
+private:
+    std::unique_ptr<T[]> items; // Default initialized so untouched pages of large queues cost no memory
+    size_t slots;
+    size_t mask;
+
+    // Consumer side
+    char consumerPadding[CACHE_LINE_SIZE];
+    std::atomic<size_t> head;
+    size_t cachedTail;
+
+    // Producer side
+    char producerPadding[CACHE_LINE_SIZE];
+    std::atomic<size_t> tail;
+    size_t pendingTail;
+    size_t cachedHead;
+
+public:
+    // Capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity)
+        : head(0), cachedTail(0), tail(0), pendingTail(0), cachedHead(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        items.reset(new T[size]);
+        slots = size;
+        mask = size - 1;
+    }
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    size_t capacity() const { return slots; }
+
+    // Producer: stores an item without publishing it, returns false when the queue is full
+    bool write(const T &item)
+    {
+        if (pendingTail - cachedHead >= slots)
+        {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (pendingTail - cachedHead >= slots)
+                return false;
+        }
+
+        items[pendingTail & mask] = item;
+        pendingTail++;
+        return true;
+    }
+
+    // Producer: makes every written item visible to the consumer
+    void publish() { tail.store(pendingTail, std::memory_order_release); }
+
+    // Producer: items written but not yet published
+    size_t pending() const { return pendingTail - tail.load(std::memory_order_relaxed); }
+
+    // Consumer: copies up to max published items into out and removes them
+    size_t read(T *out, size_t max)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (cachedTail == h)
+            cachedTail = tail.load(std::memory_order_acquire);
+
+        size_t count = cachedTail - h;
+        if (count > max)
+            count = max;
+        for (size_t i = 0; i < count; i++)
+            out[i] = items[(h + i) & mask];
+
+        head.store(h + count, std::memory_order_release);
+        return count;
+    }
+
+    // Consumer: oldest published item without removing it, NULL when the queue is empty
+    const T *front()
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (cachedTail == h)
+        {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (cachedTail == h)
+                return NULL;
+        }
+        return &items[h & mask];
+    }
+
+    // Consumer: removes the item returned by front()
+    void pop() { head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // Consumer: number of published items, approximate while the producer is running
+    size_t size() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+};
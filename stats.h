@@ -0,0 +1,360 @@
+#pragma once
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "spsc_queue.h"
+
+#define STATS_BUCKETS 40          // Latency histogram buckets, bucket i counts durations in [2^i, 2^(i+1)) ns
+#define STATS_SAMPLE_INTERVAL 16  // One packet in this many is timed, with the rest of its batch
+#define STATS_HISTORY 120         // Rate samples kept for the graphs, one per sample() call
+
+// Monotonic clock in nanoseconds for measuring durations
+inline unsigned long long statsClock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Point in time copy of a LatencyHistogram, histograms of several threads are merged into one
+struct HistogramSnapshot
+{
+    unsigned long long buckets[STATS_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum; // Nanoseconds
+
+    HistogramSnapshot() { clear(); }
+
+    void clear()
+    {
+        memset(buckets, 0, sizeof(buckets));
+        count = 0;
+        sum = 0;
+    }
+
+    // Upper bound in nanoseconds of the bucket holding quantile q, 0 without samples
+    unsigned long long quantile(double q) const
+    {
+        unsigned long long rank = (unsigned long long)(q * count);
+        unsigned long long seen = 0;
+        for (int i = 0; i < STATS_BUCKETS; i++)
+        {
+            seen += buckets[i];
+            if (seen > rank)
+                return 2ULL << i;
+        }
+        return count ? 2ULL << (STATS_BUCKETS - 1) : 0;
+    }
+
+    double mean() const { return count ? (double)sum / count : 0.0; }
+};
+
+/*
+Log2 histogram of durations written by a single thread.
+
+The writer updates the buckets with plain relaxed loads and stores instead
+of atomic read-modify-write instructions, there is no lock prefix on the
+capture path. Readers on other threads may see a sample counted in its
+bucket but not yet in the total, which is fine for monitoring.
+*/
+class LatencyHistogram
+{
+private:
+    std::atomic<unsigned long long> buckets[STATS_BUCKETS];
+    std::atomic<unsigned long long> count;
+    std::atomic<unsigned long long> sum;
+
+    static void increment(std::atomic<unsigned long long> &value, unsigned long long amount)
+    {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+public:
+    LatencyHistogram() { reset(); }
+
+    // Writer only
+    void record(unsigned long long nanoseconds)
+    {
+        int bucket = 63 - __builtin_clzll(nanoseconds | 1);
+        if (bucket >= STATS_BUCKETS)
+            bucket = STATS_BUCKETS - 1;
+        increment(buckets[bucket], 1);
+        increment(count, 1);
+        increment(sum, nanoseconds);
+    }
+
+    // Must not run concurrently with record()
+    void reset()
+    {
+        for (int i = 0; i < STATS_BUCKETS; i++)
+            buckets[i].store(0, std::memory_order_relaxed);
+        count.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+    }
+
+    // Adds the current counts to snapshot, safe from any thread
+    void mergeInto(HistogramSnapshot &snapshot) const
+    {
+        for (int i = 0; i < STATS_BUCKETS; i++)
+            snapshot.buckets[i] += buckets[i].load(std::memory_order_relaxed);
+        snapshot.count += count.load(std::memory_order_relaxed);
+        snapshot.sum += sum.load(std::memory_order_relaxed);
+    }
+};
+
+// Counters owned by one capture thread, only that thread writes them
+struct WorkerMetrics
+{
+    char padding[CACHE_LINE_SIZE]; // Keeps the counters off the cache line of whatever precedes them
+    std::atomic<unsigned long long> packets;
+    std::atomic<unsigned long long> bytes;
+    std::atomic<unsigned long long> errors; // Failed socket reads, the worker retries after most of them
+    LatencyHistogram processing; // Time the worker spends per packet, averaged over sampled batches
+    unsigned int sampleCountdown;
+
+    WorkerMetrics() : packets(0), bytes(0), errors(0), sampleCountdown(STATS_SAMPLE_INTERVAL) {}
+
+    void countError() { errors.store(errors.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+
+    void count(unsigned long long packetCount, unsigned long long byteCount)
+    {
+        packets.store(packets.load(std::memory_order_relaxed) + packetCount, std::memory_order_relaxed);
+        bytes.store(bytes.load(std::memory_order_relaxed) + byteCount, std::memory_order_relaxed);
+    }
+
+    // True for the batch of count packets that holds every STATS_SAMPLE_INTERVAL-th packet, it should be timed
+    bool sampleBatch(unsigned int count)
+    {
+        if (sampleCountdown > count)
+        {
+            sampleCountdown -= count;
+            return false;
+        }
+        sampleCountdown = STATS_SAMPLE_INTERVAL;
+        return true;
+    }
+};
+
+// Everything exported about a capture at one point in time
+struct MetricsSnapshot
+{
+    unsigned long long timestamp; // Monotonic nanoseconds, see statsClock()
+    unsigned long long packets;   // Packets the workers took from the kernel
+    unsigned long long bytes;
+    std::vector<unsigned long long> workerPackets;
+    unsigned long long kernelPackets;
+    unsigned long long kernelDrops;
+    unsigned long long kernelFreezes;
+    unsigned long long queueDepth;
+    unsigned long long queueOverflows;
+    unsigned long long readErrors;
+    unsigned long long truncatedFrames; // Cut to the receive buffer size by the recvmmsg backend
+    unsigned long long storePackets; // Filled by the owner of the PacketStore, 0 without one
+    unsigned long long storeMemory;
+    unsigned long long storeDrops;
+    HistogramSnapshot processing; // Worker time per packet
+    HistogramSnapshot delivery;   // Kernel timestamp to the consumer taking the packet
+
+    MetricsSnapshot()
+        : timestamp(0), packets(0), bytes(0), kernelPackets(0), kernelDrops(0), kernelFreezes(0), queueDepth(0),
+          queueOverflows(0), readErrors(0), truncatedFrames(0), storePackets(0), storeMemory(0), storeDrops(0) {}
+};
+
+enum class StatsSeries
+{
+    PacketsPerSecond,
+    BitsPerSecond,
+    DropsPerSecond, // Kernel and queue drops together
+    QueueDepth,
+    Count
+};
+
+/*
+Rolling per interval rates computed from successive snapshots.
+
+Each series is a fixed ring of floats, offset() is the oldest sample so the
+arrays can be handed to ImGui::PlotLines as they are.
+*/
+class StatsHistory
+{
+private:
+    float series[(int)StatsSeries::Count][STATS_HISTORY];
+    int next;
+    MetricsSnapshot previous;
+    bool hasPrevious;
+
+public:
+    StatsHistory() { clear(); }
+
+    void clear()
+    {
+        memset(series, 0, sizeof(series));
+        next = 0;
+        hasPrevious = false;
+    }
+
+    void sample(const MetricsSnapshot &snapshot)
+    {
+        if (hasPrevious && snapshot.timestamp > previous.timestamp && snapshot.packets >= previous.packets)
+        {
+            double seconds = (snapshot.timestamp - previous.timestamp) / 1e9;
+            unsigned long long drops = snapshot.kernelDrops + snapshot.queueOverflows;
+            unsigned long long previousDrops = previous.kernelDrops + previous.queueOverflows;
+            series[(int)StatsSeries::PacketsPerSecond][next] = (float)((snapshot.packets - previous.packets) / seconds);
+            series[(int)StatsSeries::BitsPerSecond][next] = (float)((snapshot.bytes - previous.bytes) * 8 / seconds);
+            series[(int)StatsSeries::DropsPerSecond][next] =
+                drops >= previousDrops ? (float)((drops - previousDrops) / seconds) : 0.0f;
+            series[(int)StatsSeries::QueueDepth][next] = (float)snapshot.queueDepth;
+            next = (next + 1) % STATS_HISTORY;
+        }
+        previous = snapshot;
+        hasPrevious = true;
+    }
+
+    const float *values(StatsSeries which) const { return series[(int)which]; }
+
+    int offset() const { return next; }
+
+    // Most recent sample of a series
+    float latest(StatsSeries which) const { return series[(int)which][(next + STATS_HISTORY - 1) % STATS_HISTORY]; }
+
+    // Largest sample of a series, for scaling a graph
+    float peak(StatsSeries which) const
+    {
+        float value = 0.0f;
+        for (int i = 0; i < STATS_HISTORY; i++)
+            if (series[(int)which][i] > value)
+                value = series[(int)which][i];
+        return value;
+    }
+};
+
+inline void statsAppendHistogram(std::string &text, const char *name, const char *help,
+                                 const HistogramSnapshot &histogram)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    text += line;
+    unsigned long long cumulative = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++)
+    {
+        cumulative += histogram.buckets[i];
+        snprintf(line, sizeof(line), "%s_bucket{le=\"%.9g\"} %llu\n", name, (2ULL << i) / 1e9, cumulative);
+        text += line;
+    }
+    snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n", name,
+             histogram.count, name, histogram.sum / 1e9, name, histogram.count);
+    text += line;
+}
+
+// Prometheus text exposition format, suitable for the node exporter textfile collector
+inline std::string formatPrometheus(const MetricsSnapshot &snapshot)
+{
+    std::string text;
+    const char *counter = "counter";
+    const char *gauge = "gauge";
+    struct
+    {
+        const char *name;
+        const char *type;
+        unsigned long long value;
+    } metrics[] = {
+        {"csniff_packets_total", counter, snapshot.packets},
+        {"csniff_bytes_total", counter, snapshot.bytes},
+        {"csniff_kernel_packets_total", counter, snapshot.kernelPackets},
+        {"csniff_kernel_drops_total", counter, snapshot.kernelDrops},
+        {"csniff_kernel_freezes_total", counter, snapshot.kernelFreezes},
+        {"csniff_queue_overflows_total", counter, snapshot.queueOverflows},
+        {"csniff_queue_depth", gauge, snapshot.queueDepth},
+        {"csniff_read_errors_total", counter, snapshot.readErrors},
+        {"csniff_truncated_frames_total", counter, snapshot.truncatedFrames},
+        {"csniff_store_packets", gauge, snapshot.storePackets},
+        {"csniff_store_memory_bytes", gauge, snapshot.storeMemory},
+        {"csniff_store_drops_total", counter, snapshot.storeDrops},
+    };
+    for (size_t i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++)
+    {
+        char line[256];
+        snprintf(line, sizeof(line), "# TYPE %s %s\n%s %llu\n", metrics[i].name, metrics[i].type, metrics[i].name,
+                 metrics[i].value);
+        text += line;
+    }
+
+    text += "# TYPE csniff_worker_packets_total counter\n";
+    for (size_t i = 0; i < snapshot.workerPackets.size(); i++)
+    {
+        char line[128];
+        snprintf(line, sizeof(line), "csniff_worker_packets_total{worker=\"%u\"} %llu\n", (unsigned int)i,
+                 snapshot.workerPackets[i]);
+        text += line;
+    }
+
+    statsAppendHistogram(text, "csniff_processing_seconds", "Capture thread time per packet, sampled",
+                         snapshot.processing);
+    statsAppendHistogram(text, "csniff_delivery_seconds", "Kernel timestamp to the consumer taking the packet, sampled",
+                         snapshot.delivery);
+    return text;
+}
+
+inline void statsAppendJsonHistogram(std::string &text, const char *name, const HistogramSnapshot &histogram)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "\"%s\":{\"count\":%llu,\"sumNs\":%llu,\"p50Ns\":%llu,\"p99Ns\":%llu,\"buckets\":[",
+             name, histogram.count, histogram.sum, histogram.quantile(0.5), histogram.quantile(0.99));
+    text += line;
+    for (int i = 0; i < STATS_BUCKETS; i++)
+    {
+        snprintf(line, sizeof(line), i ? ",%llu" : "%llu", histogram.buckets[i]);
+        text += line;
+    }
+    text += "]}";
+}
+
+// One JSON object, histogram bucket i counts durations below 2^(i+1) ns
+inline std::string formatJson(const MetricsSnapshot &snapshot)
+{
+    char line[512];
+    snprintf(line, sizeof(line),
+             "{\"packets\":%llu,\"bytes\":%llu,\"kernelPackets\":%llu,\"kernelDrops\":%llu,\"kernelFreezes\":%llu,"
+             "\"queueDepth\":%llu,\"queueOverflows\":%llu,\"readErrors\":%llu,\"truncatedFrames\":%llu,"
+             "\"storePackets\":%llu,\"storeMemory\":%llu,\"storeDrops\":%llu,\"workerPackets\":[",
+             snapshot.packets, snapshot.bytes, snapshot.kernelPackets, snapshot.kernelDrops, snapshot.kernelFreezes,
+             snapshot.queueDepth, snapshot.queueOverflows, snapshot.readErrors, snapshot.truncatedFrames,
+             snapshot.storePackets, snapshot.storeMemory, snapshot.storeDrops);
+    std::string text = line;
+    for (size_t i = 0; i < snapshot.workerPackets.size(); i++)
+    {
+        snprintf(line, sizeof(line), i ? ",%llu" : "%llu", snapshot.workerPackets[i]);
+        text += line;
+    }
+    text += "],";
+    statsAppendJsonHistogram(text, "processing", snapshot.processing);
+    text += ",";
+    statsAppendJsonHistogram(text, "delivery", snapshot.delivery);
+    text += "}\n";
+    return text;
+}
+
+// Replaces path with text through a rename, so a collector never reads a half written file
+inline bool writeMetricsFile(const std::string &path, const std::string &text)
+{
+    std::string temporary = path + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "w");
+    if (!file)
+        return false;
+    bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+    written = fclose(file) == 0 && written;
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
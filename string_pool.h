@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define STRING_POOL_SHARDS 16        // Independently locked parts of the pool, a power of two
+#define STRING_POOL_LIMIT (1 << 20)  // Strings kept at most, later ones are refused
+#define STRING_POOL_NONE 0           // Id of no string
+
+/*
+Interned strings, such as the host names found in packets.
+
+Each distinct string is stored once and packets carry its 4 byte id, so
+a name seen in a million packets costs one copy. The pool is split in
+STRING_POOL_SHARDS parts by hash, each with its own lock, open addressing
+table and list of strings, so capture workers interning at once rarely
+wait on each other. Strings never move once added, the pointers returned
+by lookup() stay valid until clear().
+*/
+class StringPool
+{
+private:
+    struct Shard
+    {
+        mutable std::mutex lock;
+        std::vector<unsigned int> slots;  // Index + 1 into strings, 0 for an empty slot
+        std::vector<unsigned int> hashes; // Hash of each string, to grow the table and reject most probes
+        std::deque<std::string> strings;
+        size_t bytes;
+        unsigned long long refused;
+
+        Shard() : bytes(0), refused(0) {}
+    };
+
+    Shard shards[STRING_POOL_SHARDS];
+
+    // FNV-1a, never 0
+    static unsigned int hash(const char *text, size_t length)
+    {
+        unsigned int h = 2166136261u;
+        for (size_t i = 0; i < length; i++)
+            h = (h ^ (unsigned char)text[i]) * 16777619u;
+        return h ? h : 1;
+    }
+
+    static void place(Shard &shard, unsigned int index)
+    {
+        size_t mask = shard.slots.size() - 1;
+        size_t slot = (shard.hashes[index] / STRING_POOL_SHARDS) & mask;
+        while (shard.slots[slot])
+            slot = (slot + 1) & mask;
+        shard.slots[slot] = index + 1;
+    }
+
+    // Doubles the table once it is half full
+    static void grow(Shard &shard)
+    {
+        shard.slots.assign(shard.slots.empty() ? 64 : shard.slots.size() * 2, 0);
+        for (size_t i = 0; i < shard.strings.size(); i++)
+            place(shard, (unsigned int)i);
+    }
+
+public:
+    StringPool() {}
+
+    StringPool(const StringPool &) = delete;
+    StringPool &operator=(const StringPool &) = delete;
+
+    /*
+    Id of the string of length bytes at text, added if it is new. Returns STRING_POOL_NONE for an
+    empty string or once the pool holds STRING_POOL_LIMIT strings. Safe to call from every thread.
+    */
+    unsigned int intern(const char *text, size_t length)
+    {
+        if (length == 0)
+            return STRING_POOL_NONE;
+
+        unsigned int h = hash(text, length);
+        unsigned int part = h & (STRING_POOL_SHARDS - 1);
+        Shard &shard = shards[part];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        if (shard.slots.empty())
+            grow(shard);
+
+        size_t mask = shard.slots.size() - 1;
+        for (size_t slot = (h / STRING_POOL_SHARDS) & mask; shard.slots[slot]; slot = (slot + 1) & mask)
+        {
+            unsigned int index = shard.slots[slot] - 1;
+            const std::string &string = shard.strings[index];
+            if (shard.hashes[index] == h && string.size() == length && memcmp(string.data(), text, length) == 0)
+                return index * STRING_POOL_SHARDS + part + 1;
+        }
+
+        if (shard.strings.size() >= STRING_POOL_LIMIT / STRING_POOL_SHARDS)
+        {
+            shard.refused++;
+            return STRING_POOL_NONE;
+        }
+        unsigned int index = (unsigned int)shard.strings.size();
+        shard.strings.push_back(std::string(text, length));
+        shard.hashes.push_back(h);
+        shard.bytes += length + 1;
+        if (shard.strings.size() * 2 > shard.slots.size())
+            grow(shard);
+        else
+            place(shard, index);
+        return index * STRING_POOL_SHARDS + part + 1;
+    }
+
+    // Text of id, NULL for STRING_POOL_NONE or an id handed out before the last clear()
+    const char *lookup(unsigned int id) const
+    {
+        if (id == STRING_POOL_NONE)
+            return NULL;
+        const Shard &shard = shards[(id - 1) & (STRING_POOL_SHARDS - 1)];
+        size_t index = (id - 1) / STRING_POOL_SHARDS;
+        std::lock_guard<std::mutex> guard(shard.lock);
+        return index < shard.strings.size() ? shard.strings[index].c_str() : NULL;
+    }
+
+    size_t size() const
+    {
+        size_t total = 0;
+        for (int i = 0; i < STRING_POOL_SHARDS; i++)
+        {
+            std::lock_guard<std::mutex> guard(shards[i].lock);
+            total += shards[i].strings.size();
+        }
+        return total;
+    }
+
+    // Bytes of text plus the tables, not counting the string objects
+    size_t memoryUsage() const
+    {
+        size_t total = 0;
+        for (int i = 0; i < STRING_POOL_SHARDS; i++)
+        {
+            std::lock_guard<std::mutex> guard(shards[i].lock);
+            total += shards[i].bytes + (shards[i].slots.capacity() + shards[i].hashes.capacity()) * sizeof(unsigned int);
+        }
+        return total;
+    }
+
+    // Strings not added because the pool was full
+    unsigned long long refusedStrings() const
+    {
+        unsigned long long total = 0;
+        for (int i = 0; i < STRING_POOL_SHARDS; i++)
+        {
+            std::lock_guard<std::mutex> guard(shards[i].lock);
+            total += shards[i].refused;
+        }
+        return total;
+    }
+
+    // Forgets every string. Ids interned before may then name nothing or a newer string
+    void clear()
+    {
+        for (int i = 0; i < STRING_POOL_SHARDS; i++)
+        {
+            Shard &shard = shards[i];
+            std::lock_guard<std::mutex> guard(shard.lock);
+            shard.slots.clear();
+            shard.hashes.clear();
+            shard.strings.clear();
+            shard.bytes = 0;
+            shard.refused = 0;
+        }
+    }
+};
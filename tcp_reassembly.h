@@ -0,0 +1,423 @@
+#pragma once
+
+#include <cstdio>
+#include <iostream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "flow_table.h"
+
+#define REASSEMBLY_MEMORY (256u << 20)       // Bytes held by every stream together
+#define REASSEMBLY_SHARDS 16                 // Independently locked parts of the stream table, a power of two
+#define REASSEMBLY_STREAM_LIMIT (16u << 20)  // Bytes kept per direction, at most a quarter of a shard, later data is only counted
+#define REASSEMBLY_PENDING_LIMIT (1u << 20)  // Out of order bytes held per direction before a gap is skipped, at most an eighth of a shard
+#define REASSEMBLY_STREAM_OVERHEAD 256       // Bytes charged per stream for its bookkeeping
+
+// Consecutive bytes of one direction in the order they completed, or bytes that were never captured
+struct StreamChunk
+{
+    unsigned long long offset; // Position in StreamDirection::data, for gaps where they would have been
+    unsigned int length;
+    unsigned char direction; // 0 from endpoint A to endpoint B of the key
+    bool missing;            // Gap skipped after a loss, no bytes are stored for it
+};
+
+struct StreamDirection
+{
+    bool started; // The initial sequence number is known
+    bool finished;
+    unsigned int initialSeq; // Sequence number of the first data byte
+    unsigned long long end;  // Stream offset after the last byte, known once finished
+    unsigned long long delivered; // Bytes completed in order, gaps included
+    unsigned long long missing;   // Bytes skipped over gaps
+    std::vector<unsigned char> data; // The first bytes completed, up to REASSEMBLY_STREAM_LIMIT or a quarter of a shard
+    std::map<unsigned long long, std::vector<unsigned char>> pending; // Out of order segments by stream offset
+    size_t pendingBytes;
+
+    StreamDirection() : started(false), finished(false), initialSeq(0), end(0), delivered(0), missing(0), pendingBytes(0) {}
+};
+
+struct TcpStream
+{
+    FlowKey key;
+    StreamDirection directions[2];
+    std::vector<StreamChunk> chunks; // The conversation as it happened, alternating directions
+    unsigned long long firstSeen;
+    unsigned long long lastSeen;
+    unsigned long long retransmitted; // Payload bytes received again after they were already complete
+    bool reset;
+    bool full;     // Its chunks reached their share of the shard, later data is only counted
+    size_t memory; // Bytes charged to the budget
+};
+
+/*
+Rebuilds the byte streams of TCP connections from captured packets.
+
+Streams are keyed like FlowTable flows and spread over independently locked
+shards by key hash, so capture workers can feed packets concurrently and the
+UI only ever waits for one shard. Sequence numbers are turned into 64 bit
+stream offsets relative to the next expected byte, which handles wraparound.
+Data before that point is a retransmission and trimmed, data after it waits
+in an ordered map until the gap is filled, or is skipped and recorded as
+missing once too much piles up behind a lost segment or the connection
+closes.
+
+Each shard owns an equal part of the memory budget and keeps its streams in
+least recently used order, the oldest streams are evicted when a packet
+pushes the shard over its part. The data, pending segments and chunks of a
+single stream are limited to fractions of that part, so even a stream left
+alone in its shard stays within it.
+*/
+class TcpReassembler
+{
+private:
+    struct KeyHash
+    {
+        size_t operator()(const FlowKey &key) const { return FlowTable::hashKey(key); }
+    };
+
+    struct KeyEqual
+    {
+        bool operator()(const FlowKey &a, const FlowKey &b) const { return FlowTable::sameKey(a, b); }
+    };
+
+    struct Shard
+    {
+        std::mutex lock;
+        std::list<TcpStream> streams; // Most recently used first
+        std::unordered_map<FlowKey, std::list<TcpStream>::iterator, KeyHash, KeyEqual> index;
+        size_t memory;
+        unsigned long long evicted;
+
+        Shard() : memory(0), evicted(0) {}
+    };
+
+    Shard shards[REASSEMBLY_SHARDS];
+    size_t shardBudget;
+    size_t streamLimit;  // Completed bytes kept per direction
+    size_t pendingLimit; // Out of order bytes held per direction
+    size_t chunkLimit;   // Chunks per stream
+
+    // Returns false once the stream is full, nothing may be stored for it then
+    bool addChunk(TcpStream &stream, int direction, unsigned long long offset, unsigned int length, bool missing)
+    {
+        if (stream.full)
+            return false;
+        if (!stream.chunks.empty())
+        {
+            StreamChunk &last = stream.chunks.back();
+            if (!missing && !last.missing && last.direction == direction && last.offset + last.length == offset)
+            {
+                last.length += length;
+                return true;
+            }
+        }
+        if (stream.chunks.size() >= chunkLimit)
+        {
+            stream.full = true;
+            return false;
+        }
+        StreamChunk chunk;
+        chunk.offset = offset;
+        chunk.length = length;
+        chunk.direction = (unsigned char)direction;
+        chunk.missing = missing;
+        stream.chunks.push_back(chunk);
+        stream.memory += sizeof(StreamChunk);
+        return true;
+    }
+
+    // Appends bytes that start exactly at the delivered position
+    void deliver(TcpStream &stream, int direction, const unsigned char *bytes, size_t length)
+    {
+        StreamDirection &side = stream.directions[direction];
+        size_t room = side.data.size() < streamLimit ? streamLimit - side.data.size() : 0;
+        size_t kept = length < room ? length : room;
+        if (kept && addChunk(stream, direction, side.data.size(), (unsigned int)kept, false))
+        {
+            side.data.insert(side.data.end(), bytes, bytes + kept);
+            stream.memory += kept;
+        }
+        side.delivered += length;
+    }
+
+    // Delivers the pending segments that became contiguous
+    void drainPending(TcpStream &stream, int direction)
+    {
+        StreamDirection &side = stream.directions[direction];
+        while (!side.pending.empty() && side.pending.begin()->first <= side.delivered)
+        {
+            std::map<unsigned long long, std::vector<unsigned char>>::iterator first = side.pending.begin();
+            unsigned long long end = first->first + first->second.size();
+            if (end > side.delivered)
+            {
+                size_t skip = (size_t)(side.delivered - first->first);
+                deliver(stream, direction, first->second.data() + skip, first->second.size() - skip);
+            }
+            side.pendingBytes -= first->second.size();
+            stream.memory -= first->second.size();
+            side.pending.erase(first);
+        }
+    }
+
+    // Gives up on the bytes missing before the first pending segment, or before end when nothing is pending
+    void skipGap(TcpStream &stream, int direction, unsigned long long end)
+    {
+        StreamDirection &side = stream.directions[direction];
+        unsigned long long next = side.pending.empty() ? end : side.pending.begin()->first;
+        addChunk(stream, direction, side.data.size(), (unsigned int)(next - side.delivered), true);
+        side.missing += next - side.delivered;
+        side.delivered = next;
+        drainPending(stream, direction);
+    }
+
+    // Stores payload at its stream offset, which lies past the delivered position or overlaps it
+    void place(TcpStream &stream, int direction, long long offset, const unsigned char *payload, size_t length)
+    {
+        StreamDirection &side = stream.directions[direction];
+        if (offset < 0 || (unsigned long long)offset + length <= side.delivered)
+        {
+            stream.retransmitted += length;
+            return;
+        }
+
+        if ((unsigned long long)offset <= side.delivered)
+        {
+            size_t skip = (size_t)(side.delivered - offset);
+            stream.retransmitted += skip;
+            deliver(stream, direction, payload + skip, length - skip);
+            drainPending(stream, direction);
+            return;
+        }
+
+        std::vector<unsigned char> &held = side.pending[offset];
+        if (held.size() < length)
+        {
+            side.pendingBytes += length - held.size();
+            stream.memory += length - held.size();
+            held.assign(payload, payload + length);
+        }
+        while (side.pendingBytes > pendingLimit)
+            skipGap(stream, direction, 0);
+    }
+
+    void segment(TcpStream &stream, int direction, unsigned int seq, unsigned char flags,
+                        const unsigned char *payload, size_t length)
+    {
+        StreamDirection &side = stream.directions[direction];
+        if (flags & 0x04) // RST
+            stream.reset = true;
+        if (!side.started)
+        {
+            if (!(flags & 0x02) && length == 0)
+                return; // A bare ACK says nothing about where the data starts
+            side.started = true;
+            side.initialSeq = (flags & 0x02) ? seq + 1 : seq;
+        }
+        if (flags & 0x02)
+            seq++; // The SYN takes one sequence number before the data
+
+        // Offsets are taken relative to the next expected byte, so sequence numbers may wrap
+        unsigned int nextSeq = side.initialSeq + (unsigned int)side.delivered;
+        long long offset = (long long)side.delivered + (int)(seq - nextSeq);
+        if (length)
+            place(stream, direction, offset, payload, length);
+
+        if ((flags & 0x01) && !side.finished)
+        {
+            side.finished = true;
+            side.end = offset >= 0 ? (unsigned long long)offset + length : 0;
+        }
+
+        // Once both sides closed, or on a reset, nothing else is coming and what is still missing was lost
+        if (stream.reset || (stream.directions[0].finished && stream.directions[1].finished))
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                StreamDirection &closed = stream.directions[i];
+                unsigned long long end = closed.finished ? closed.end : closed.delivered;
+                while (!closed.pending.empty() || closed.delivered < end)
+                    skipGap(stream, i, end);
+            }
+        }
+    }
+
+    void evict(Shard &shard, const TcpStream *keep)
+    {
+        while (shard.memory > shardBudget && !shard.streams.empty() && &shard.streams.back() != keep)
+        {
+            shard.memory -= shard.streams.back().memory;
+            shard.index.erase(shard.streams.back().key);
+            shard.streams.pop_back();
+            shard.evicted++;
+        }
+    }
+
+public:
+    // Budgets below a couple of KiB per shard leave no room for a stream's bookkeeping
+    explicit TcpReassembler(size_t memoryBudget = REASSEMBLY_MEMORY)
+        : shardBudget(memoryBudget / REASSEMBLY_SHARDS),
+          streamLimit(shardBudget / 4 < REASSEMBLY_STREAM_LIMIT ? shardBudget / 4 : REASSEMBLY_STREAM_LIMIT),
+          pendingLimit(shardBudget / 8 < REASSEMBLY_PENDING_LIMIT ? shardBudget / 8 : REASSEMBLY_PENDING_LIMIT),
+          chunkLimit(shardBudget / 8 / sizeof(StreamChunk))
+    {
+    }
+
+    TcpReassembler(const TcpReassembler &) = delete;
+    TcpReassembler &operator=(const TcpReassembler &) = delete;
+
+    // Adds the payload of a TCP packet to its stream, other packets are ignored. Safe to call from several threads
+    void add(const Packet &packet)
+    {
+        const PacketInfo &info = packet.info;
+        unsigned int size = packet.size;
+        if (info.transport != TransportLayer::Tcp || info.transportOffset + 20u > size)
+            return;
+
+        FlowKey key;
+        bool reversed;
+        if (!FlowTable::makeKey(packet, key, &reversed))
+            return;
+
+        // The IP length excludes Ethernet padding, the capture may still hold less than it announces.
+        // Segmentation offload can leave the length at 0, the frame is then taken as is
+        const unsigned char *tcp = packet.data + info.transportOffset;
+        const unsigned char *ip = packet.data + info.networkOffset;
+        unsigned int headerLength = (tcp[12] >> 4) * 4u;
+        unsigned int ipLength = dissectRead16(ip + (info.network == NetworkLayer::IPv4 ? 2 : 4));
+        unsigned int ipEnd = info.networkOffset + ipLength + (info.network == NetworkLayer::IPv4 ? 0 : 40);
+        unsigned int start = info.transportOffset + headerLength;
+        unsigned int end = ipLength && ipEnd < size ? ipEnd : size;
+        size_t length = end > start ? end - start : 0;
+        unsigned int seq = ((unsigned int)dissectRead16(tcp + 4) << 16) | dissectRead16(tcp + 6);
+
+        Shard &shard = shards[FlowTable::hashKey(key) & (REASSEMBLY_SHARDS - 1)];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto found = shard.index.find(key);
+        if (found == shard.index.end())
+        {
+            TcpStream stream;
+            stream.key = key;
+            stream.firstSeen = packet.timestamp;
+            stream.retransmitted = 0;
+            stream.reset = false;
+            stream.full = false;
+            stream.memory = REASSEMBLY_STREAM_OVERHEAD;
+            shard.streams.push_front(stream);
+            found = shard.index.insert(std::make_pair(key, shard.streams.begin())).first;
+        }
+        else
+            shard.streams.splice(shard.streams.begin(), shard.streams, found->second);
+
+        TcpStream &stream = *found->second;
+        size_t before = stream.memory;
+        stream.lastSeen = packet.timestamp;
+        segment(stream, reversed ? 1 : 0, seq, tcp[13], packet.data + start, length);
+        shard.memory += stream.memory - before;
+        evict(shard, &stream);
+    }
+
+    /*
+    Copies the stream of the connection key belongs to into stream, without the segments
+    still waiting for a gap. Returns false if the stream is unknown or was evicted.
+    */
+    bool copyStream(const FlowKey &key, TcpStream &stream)
+    {
+        Shard &shard = shards[FlowTable::hashKey(key) & (REASSEMBLY_SHARDS - 1)];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto found = shard.index.find(key);
+        if (found == shard.index.end())
+            return false;
+
+        const TcpStream &source = *found->second;
+        stream.key = source.key;
+        stream.chunks = source.chunks;
+        stream.firstSeen = source.firstSeen;
+        stream.lastSeen = source.lastSeen;
+        stream.retransmitted = source.retransmitted;
+        stream.reset = source.reset;
+        stream.full = source.full;
+        stream.memory = source.memory;
+        for (int i = 0; i < 2; i++)
+        {
+            const StreamDirection &side = source.directions[i];
+            StreamDirection &copy = stream.directions[i];
+            copy.started = side.started;
+            copy.finished = side.finished;
+            copy.initialSeq = side.initialSeq;
+            copy.end = side.end;
+            copy.delivered = side.delivered;
+            copy.missing = side.missing;
+            copy.data = side.data;
+            copy.pending.clear();
+            copy.pendingBytes = side.pendingBytes;
+        }
+        return true;
+    }
+
+    /*
+    Writes the bytes of one direction of stream to path, or both in conversation order when
+    direction is -1. Gaps are left out. Returns false if the file cannot be written.
+    */
+    static bool saveStream(const TcpStream &stream, int direction, const std::string &path)
+    {
+        FILE *file = fopen(path.c_str(), "wb");
+        if (!file)
+        {
+            std::cerr << "Unable to open " << path << std::endl;
+            return false;
+        }
+
+        bool written = true;
+        if (direction >= 0)
+        {
+            const std::vector<unsigned char> &data = stream.directions[direction].data;
+            written = data.empty() || fwrite(data.data(), data.size(), 1, file) == 1;
+        }
+        else
+        {
+            for (size_t i = 0; i < stream.chunks.size() && written; i++)
+            {
+                const StreamChunk &chunk = stream.chunks[i];
+                if (!chunk.missing)
+                    written = fwrite(&stream.directions[chunk.direction].data[chunk.offset], chunk.length, 1, file) == 1;
+            }
+        }
+        if (fclose(file) != 0 || !written)
+        {
+            std::cerr << "Unable to write " << path << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void clear()
+    {
+        for (int i = 0; i < REASSEMBLY_SHARDS; i++)
+        {
+            std::lock_guard<std::mutex> guard(shards[i].lock);
+            shards[i].streams.clear();
+            shards[i].index.clear();
+            shards[i].memory = 0;
+            shards[i].evicted = 0;
+        }
+    }
+
+    // Streams tracked, bytes charged to the budget and streams evicted to stay under it
+    void getUsage(size_t &streams, size_t &memory, unsigned long long &evicted)
+    {
+        streams = memory = 0;
+        evicted = 0;
+        for (int i = 0; i < REASSEMBLY_SHARDS; i++)
+        {
+            std::lock_guard<std::mutex> guard(shards[i].lock);
+            streams += shards[i].streams.size();
+            memory += shards[i].memory;
+            evicted += shards[i].evicted;
+        }
+    }
+};
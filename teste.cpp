@@ -9,10 +9,12 @@ Used for testing the sniff.h functions
 
 int main() {
   PacketSniffer sniffer;
-  std::vector<std::pair<int, unsigned char *>> capturedPackets;
+  PacketStore capturedPackets;
+  StringPool names; // printData() shows the DNS, HTTP and TLS names found in the packets
+  sniffer.setNamePool(&names);
 
   // Start capturing packets
-  sniffer.startCapture(capturedPackets);
+  sniffer.startCapture();
 
   // Wait 5 seconds for packet capturing
   std::this_thread::sleep_for(std::chrono::seconds(5));
@@ -20,15 +22,17 @@ int main() {
   // Stop capturing packets
   sniffer.stopCapture();
 
+  // Move the queued packets into the store
+  while (sniffer.drain(capturedPackets) > 0)
+    ;
+
   // Ensure that at least one packet is captured
   assert(!capturedPackets.empty());
 
   // Print captured packets information
   std::cout << "Captured Packets:" << std::endl;
-  for (const auto& p : capturedPackets) {
-	std::cout << sniffer.printData(p) << std::endl;
-    // Free allocated memory for packet
-    free(p.second);
+  for (PacketHandle i = 0; i < capturedPackets.size(); i++) {
+	std::cout << sniffer.printData(capturedPackets[i]) << std::endl;
   }
 
   return 0;
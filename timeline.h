@@ -0,0 +1,256 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "packet_store.h"
+
+#define TIMELINE_LEVELS 4     // Bucket widths of 1 ms, 100 ms, 1 s and 1 min
+#define TIMELINE_BUCKETS 2048 // Buckets kept per level and lane, a power of two
+#define TIMELINE_PROTOCOLS 4  // TimelineProtocol values
+
+#define TIMELINE_UNUSED (~0ULL)  // Index of a bucket that never held packets
+#define TIMELINE_NO_TIME (~0ULL) // First timestamp while the timeline is empty
+
+// Traffic classes the timeline is split by
+enum class TimelineProtocol
+{
+    Tcp,
+    Udp,
+    Icmp,
+    Other
+};
+
+// Packets and bytes of one time range, per TimelineProtocol
+struct TimelinePoint
+{
+    unsigned long long packets[TIMELINE_PROTOCOLS];
+    unsigned long long bytes[TIMELINE_PROTOCOLS];
+
+    TimelinePoint() { clear(); }
+
+    void clear()
+    {
+        memset(packets, 0, sizeof(packets));
+        memset(bytes, 0, sizeof(bytes));
+    }
+};
+
+/*
+Packets and bytes per time bucket, split by protocol, at several resolutions.
+
+Every packet is counted once per level as it is captured, so drawing any
+time range sums at most TIMELINE_BUCKETS buckets however many packets the
+capture holds. Each level is a ring indexed by timestamp / width: a bucket
+is recycled when a packet of a later period lands on it, so the 1 ms level
+covers the last 2 s and the 1 min level the last 34 h.
+
+Writers own a lane each, which they update with plain relaxed loads and
+stores like LatencyHistogram, so capture workers never share a cache line
+or take a lock. Readers merge the lanes and may see a packet in one level
+and not yet in another.
+*/
+class Timeline
+{
+private:
+    struct Bucket
+    {
+        std::atomic<unsigned long long> index; // timestamp / width of the period counted, TIMELINE_UNUSED if none
+        std::atomic<unsigned long long> packets[TIMELINE_PROTOCOLS];
+        std::atomic<unsigned long long> bytes[TIMELINE_PROTOCOLS];
+    };
+
+    struct Lane
+    {
+        std::unique_ptr<Bucket[]> levels[TIMELINE_LEVELS];
+        std::atomic<unsigned long long> first; // Timestamps of the oldest and newest packet of the lane
+        std::atomic<unsigned long long> last;
+
+        Lane()
+        {
+            for (int i = 0; i < TIMELINE_LEVELS; i++)
+                levels[i].reset(new Bucket[TIMELINE_BUCKETS]);
+            clear();
+        }
+
+        void clear()
+        {
+            for (int i = 0; i < TIMELINE_LEVELS; i++)
+            {
+                for (int j = 0; j < TIMELINE_BUCKETS; j++)
+                    levels[i][j].index.store(TIMELINE_UNUSED, std::memory_order_relaxed);
+            }
+            first.store(TIMELINE_NO_TIME, std::memory_order_relaxed);
+            last.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    std::vector<std::unique_ptr<Lane>> lanes;
+
+    static void increment(std::atomic<unsigned long long> &value, unsigned long long amount)
+    {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    static TimelineProtocol classify(const PacketInfo &info)
+    {
+        if (info.network != NetworkLayer::IPv4 && info.network != NetworkLayer::IPv6)
+            return TimelineProtocol::Other;
+        switch (info.ipProtocol)
+        {
+        case IPPROTO_TCP:
+            return TimelineProtocol::Tcp;
+        case IPPROTO_UDP:
+            return TimelineProtocol::Udp;
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            return TimelineProtocol::Icmp;
+        }
+        return TimelineProtocol::Other;
+    }
+
+    // Newest bucket index any lane reached at level, 0 when empty
+    unsigned long long newest(int level) const
+    {
+        unsigned long long last = 0;
+        for (size_t i = 0; i < lanes.size(); i++)
+        {
+            unsigned long long time = lanes[i]->last.load(std::memory_order_relaxed);
+            if (time > last)
+                last = time;
+        }
+        return last / width(level);
+    }
+
+public:
+    // laneCount writers can add packets concurrently, more are added by setLanes()
+    explicit Timeline(unsigned int laneCount = 1) { setLanes(laneCount); }
+
+    Timeline(const Timeline &) = delete;
+    Timeline &operator=(const Timeline &) = delete;
+
+    // Width in nanoseconds of the buckets of level
+    static unsigned long long width(int level)
+    {
+        static const unsigned long long widths[TIMELINE_LEVELS] = {1000000ULL, 100000000ULL, 1000000000ULL,
+                                                                   60000000000ULL};
+        return widths[level];
+    }
+
+    // Grows the timeline to count lanes. Must not run concurrently with add() or query()
+    void setLanes(unsigned int count)
+    {
+        while (lanes.size() < count)
+            lanes.push_back(std::unique_ptr<Lane>(new Lane()));
+    }
+
+    unsigned int laneCount() const { return lanes.size(); }
+
+    // Counts packet in every level. Only one thread may add to a lane at a time
+    void add(const Packet &packet, unsigned int lane = 0)
+    {
+        Lane &target = *lanes[lane];
+        unsigned long long time = packet.timestamp;
+        int protocol = static_cast<int>(classify(packet.info));
+        unsigned int length = packet.wireLength ? packet.wireLength : (unsigned int)packet.size;
+        // Constant divisors, which the compiler turns into multiplications
+        const unsigned long long indexes[TIMELINE_LEVELS] = {time / 1000000ULL, time / 100000000ULL,
+                                                             time / 1000000000ULL, time / 60000000000ULL};
+        for (int level = 0; level < TIMELINE_LEVELS; level++)
+        {
+            unsigned long long index = indexes[level];
+            Bucket &bucket = target.levels[level][index & (TIMELINE_BUCKETS - 1)];
+            unsigned long long held = bucket.index.load(std::memory_order_relaxed);
+            if (held != index)
+            {
+                if (held != TIMELINE_UNUSED && held > index)
+                    continue; // Older than the period the ring keeps for this slot
+                for (int i = 0; i < TIMELINE_PROTOCOLS; i++)
+                {
+                    bucket.packets[i].store(0, std::memory_order_relaxed);
+                    bucket.bytes[i].store(0, std::memory_order_relaxed);
+                }
+                bucket.index.store(index, std::memory_order_release);
+            }
+            increment(bucket.packets[protocol], 1);
+            increment(bucket.bytes[protocol], length);
+        }
+        if (time < target.first.load(std::memory_order_relaxed))
+            target.first.store(time, std::memory_order_relaxed);
+        if (time > target.last.load(std::memory_order_relaxed))
+            target.last.store(time, std::memory_order_relaxed);
+    }
+
+    // Timestamps of the oldest and newest packet counted, false while the timeline is empty
+    bool getRange(unsigned long long &first, unsigned long long &last) const
+    {
+        first = TIMELINE_NO_TIME;
+        last = 0;
+        for (size_t i = 0; i < lanes.size(); i++)
+        {
+            unsigned long long time = lanes[i]->first.load(std::memory_order_relaxed);
+            if (time < first)
+                first = time;
+            time = lanes[i]->last.load(std::memory_order_relaxed);
+            if (time > last)
+                last = time;
+        }
+        return first != TIMELINE_NO_TIME;
+    }
+
+    /*
+    Sums the traffic between the timestamps start and end into count points of equal width.
+    Uses the finest level that still holds the whole range, so at most TIMELINE_BUCKETS buckets
+    are read per lane, and returns it. Ranges older than every level only get what remains of them.
+    */
+    int query(unsigned long long start, unsigned long long end, unsigned int count,
+              std::vector<TimelinePoint> &points) const
+    {
+        points.assign(count, TimelinePoint());
+        if (count == 0 || end <= start)
+            return 0;
+
+        // Coarser levels are used when start was recycled or the range spans more buckets than a ring holds
+        int level = 0;
+        while (level < TIMELINE_LEVELS - 1 && (start / width(level) + TIMELINE_BUCKETS <= newest(level) ||
+                                               (end - 1) / width(level) - start / width(level) >= TIMELINE_BUCKETS))
+            level++;
+
+        unsigned long long size = width(level);
+        unsigned long long firstIndex = start / size;
+        unsigned long long lastIndex = (end - 1) / size;
+        if (lastIndex - firstIndex >= TIMELINE_BUCKETS)
+            firstIndex = lastIndex - TIMELINE_BUCKETS + 1;
+        double scale = (double)count / (end - start);
+        for (unsigned long long index = firstIndex; index <= lastIndex; index++)
+        {
+            // Each bucket goes to the point its start falls in, the first one may begin before start
+            unsigned long long time = index * size > start ? index * size : start;
+            unsigned int point = (unsigned int)((time - start) * scale);
+            if (point >= count)
+                point = count - 1;
+            TimelinePoint &target = points[point];
+            for (size_t i = 0; i < lanes.size(); i++)
+            {
+                const Bucket &bucket = lanes[i]->levels[level][index & (TIMELINE_BUCKETS - 1)];
+                if (bucket.index.load(std::memory_order_acquire) != index)
+                    continue;
+                for (int j = 0; j < TIMELINE_PROTOCOLS; j++)
+                {
+                    target.packets[j] += bucket.packets[j].load(std::memory_order_relaxed);
+                    target.bytes[j] += bucket.bytes[j].load(std::memory_order_relaxed);
+                }
+            }
+        }
+        return level;
+    }
+
+    // Forgets every packet. Packets added meanwhile may be lost or kept
+    void clear()
+    {
+        for (size_t i = 0; i < lanes.size(); i++)
+            lanes[i]->clear();
+    }
+};